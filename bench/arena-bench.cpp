@@ -0,0 +1,46 @@
+// Measures building, compiling and freeing a large generated program with its
+// nodes on the heap and in an arena.
+
+#include "../include/arena.hpp"
+#include "../include/ast.hpp"
+#include "../include/interpreter.hpp"
+#include "programs.hpp"
+
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <string>
+
+// Builds, compiles and frees a program of 2^depth leaves iterations times
+static double run(int depth, int iterations, bool arena) {
+  size_t instructions = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < iterations; i++) {
+    std::unique_ptr<Arena> memory;
+    std::unique_ptr<Arena::Scope> scope;
+    if (arena) {
+      memory = std::make_unique<Arena>();
+      scope = std::make_unique<Arena::Scope>(*memory);
+    }
+    int leaf = 0;
+    ExprPtr program = arithmetic(depth, leaf);
+    instructions += interpreter::compile(*program).size();
+  }
+  auto stop = std::chrono::steady_clock::now();
+  double seconds = std::chrono::duration<double>(stop - start).count();
+  std::cout << "depth " << depth << (arena ? " (arena)" : " (heap)") << ": "
+            << seconds << " s, " << instructions << " instructions"
+            << std::endl;
+  return seconds;
+}
+
+int main() {
+  for (int depth : {10, 16}) {
+    int iterations = (1 << 20) >> depth;
+    double heap = run(depth, iterations, false);
+    double arena = run(depth, iterations, true);
+    std::cout << "depth " << depth << ": arena/heap time " << arena / heap
+              << std::endl;
+  }
+  return 0;
+}
@@ -0,0 +1,69 @@
+// Measures compiling the same small scripts over and over, straight through
+// the front end and through a CompileCache, from one thread and from several.
+
+#include "../include/bytecode.hpp"
+#include "../include/cache.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+template <typename F> static double time(F f) {
+  auto start = std::chrono::steady_clock::now();
+  f();
+  auto stop = std::chrono::steady_clock::now();
+  return std::chrono::duration<double>(stop - start).count();
+}
+
+// A snippet of a few small definitions and a call, one of count variants
+static std::string snippet(int i) {
+  std::string n = std::to_string(i);
+  return "(val scale" + n + " (lambda (x) (* x " + n + ")))\n" +
+         "(val sum (lambda (self f n) (if n (+ (f n) (self self f (- n 1)))"
+         " 0)))\n" +
+         "(sum sum scale" + n + " 10)\n";
+}
+
+int main() {
+  const int variants = 100;
+  const int compiles = 100000;
+  std::vector<std::string> snippets;
+  for (int i = 0; i < variants; i++)
+    snippets.push_back(snippet(i));
+
+  size_t forms = 0;
+  double direct = time([&] {
+    for (int i = 0; i < compiles; i++)
+      forms += bytecode::compile(snippets[i % variants]).size();
+  });
+  std::cout << "compile: " << compiles / direct << " scripts/s" << std::endl;
+
+  CompileCache cache(64 << 20);
+  double cached = time([&] {
+    for (int i = 0; i < compiles; i++)
+      forms += cache.compile(snippets[i % variants]).size();
+  });
+  CompileCache::Stats stats = cache.stats();
+  std::cout << "cached: " << compiles / cached << " scripts/s, " << stats.hits
+            << " hits, " << stats.misses << " misses, " << stats.bytes
+            << " bytes" << std::endl;
+
+  unsigned threads = std::max(2u, std::thread::hardware_concurrency());
+  double parallel = time([&] {
+    std::vector<std::thread> workers;
+    for (unsigned t = 0; t < threads; t++) {
+      workers.emplace_back([&, t] {
+        for (int i = t; i < compiles; i += threads)
+          cache.compile(snippets[i % variants]);
+      });
+    }
+    for (auto &worker : workers)
+      worker.join();
+  });
+  std::cout << "cached, " << threads << " threads: " << compiles / parallel
+            << " scripts/s" << std::endl;
+  return forms == 0;
+}
@@ -0,0 +1,60 @@
+// Measures compile time of deeply nested generated expressions, which should
+// grow linearly with their depth: right-nested arithmetic, nested ifs and
+// nested calls.
+
+#include "../include/ast.hpp"
+#include "../include/interpreter.hpp"
+#include "programs.hpp"
+
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <string>
+
+// (+ 1 (+ 1 ... x))
+static ExprPtr nestedArithmetic(int depth) {
+  ExprPtr exp = sym("x");
+  for (int i = 0; i < depth; i++)
+    exp = binop('+', num(1), std::move(exp));
+  return exp;
+}
+
+// (if x (if x ... 0) 1)
+static ExprPtr nestedIfs(int depth) {
+  ExprPtr exp = num(0);
+  for (int i = 0; i < depth; i++)
+    exp = list(sym("if"), sym("x"), std::move(exp), num(1));
+  return exp;
+}
+
+// (f 1 (f 1 ... x))
+static ExprPtr nestedCalls(int depth) {
+  ExprPtr exp = sym("x");
+  for (int i = 0; i < depth; i++)
+    exp = list(sym("f"), num(1), std::move(exp));
+  return exp;
+}
+
+static void bench(const std::string &label,
+                  const std::function<ExprPtr(int)> &build) {
+  std::cout << label << ":" << std::endl;
+  for (int depth = 2500; depth <= 20000; depth *= 2) {
+    ExprPtr program = build(depth);
+    size_t instructions = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int run = 0; run < 10; run++)
+      instructions = interpreter::compile(*program).size();
+    auto stop = std::chrono::steady_clock::now();
+    double seconds = std::chrono::duration<double>(stop - start).count() / 10;
+    std::cout << "  depth " << depth << ": " << instructions
+              << " instructions in " << seconds * 1e3 << " ms, "
+              << seconds / depth * 1e9 << " ns per level" << std::endl;
+  }
+}
+
+int main() {
+  bench("arithmetic", nestedArithmetic);
+  bench("ifs", nestedIfs);
+  bench("calls", nestedCalls);
+  return 0;
+}
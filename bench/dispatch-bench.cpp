@@ -0,0 +1,69 @@
+// Measures interpreter throughput in instructions per second on an
+// arithmetic-heavy and a call-heavy program, with and without the peephole
+// pass, and how many dispatches the pass saves. Built by `make bench` once
+// with threaded dispatch and once with the switch fallback.
+
+#include "../include/ast.hpp"
+#include "../include/interpreter.hpp"
+#include "programs.hpp"
+
+#include <chrono>
+#include <iostream>
+#include <string>
+
+#ifndef INTERP_STATS
+#error "dispatch-bench needs INTERP_STATS to count instructions"
+#endif
+
+// Runs program iterations times and returns the number of instructions
+// dispatched
+static unsigned long long run(const std::string &name, Expression &program,
+                              int iterations, CompileOptions options) {
+  interpreter::Code code = interpreter::compile(program, options);
+  Environment env;
+  env.define("x", 3);
+  env.define("y", 5);
+
+  unsigned long long before = interpreter::dispatchCount;
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < iterations; i++) {
+    interpreter::eval(code, env);
+  }
+  auto stop = std::chrono::steady_clock::now();
+  unsigned long long count = interpreter::dispatchCount - before;
+
+  double seconds = std::chrono::duration<double>(stop - start).count();
+  std::cout << name << (options.peephole ? " (peephole)" : " (naive)") << ": "
+            << count << " instructions in " << seconds << " s, "
+            << count / seconds / 1e6 << " M instructions/s" << std::endl;
+  return count;
+}
+
+static void compare(const std::string &name, Expression &program,
+                    int iterations) {
+  CompileOptions naive;
+  naive.peephole = false;
+  unsigned long long before = run(name, program, iterations, naive);
+  unsigned long long after =
+      run(name, program, iterations, CompileOptions());
+  std::cout << name << ": peephole saves "
+            << 100.0 * (before - after) / before << "% of dispatches"
+            << std::endl;
+}
+
+int main() {
+#ifdef INTERP_NO_COMPUTED_GOTO
+  std::cout << "dispatch: switch" << std::endl;
+#else
+  std::cout << "dispatch: computed goto" << std::endl;
+#endif
+
+  int leaf = 0;
+  ExprPtr arith = arithmetic(12, leaf);
+  compare("arithmetic", *arith, 2000);
+
+  ExprPtr calls = countdown(500);
+  compare("calls", *calls, 20000);
+
+  return 0;
+}
@@ -0,0 +1,77 @@
+// Compares the stack machine with the register machine on the same programs:
+// global and local arithmetic, deep recursion, a tail-recursive loop and a loop
+// that creates a closure per iteration. Reports time and instructions
+// dispatched by each engine.
+
+#include "../include/ast.hpp"
+#include "../include/interpreter.hpp"
+#include "../include/register.hpp"
+#include "programs.hpp"
+
+#include <chrono>
+#include <iostream>
+#include <string>
+
+#ifndef INTERP_STATS
+#error "engine-bench needs INTERP_STATS to count instructions"
+#endif
+
+struct Measurement {
+  double seconds;
+  unsigned long long dispatches;
+};
+
+// Runs program iterations times on engine, compiled once up front
+static Measurement measure(Expression &program, int iterations,
+                           interpreter::Engine engine) {
+  interpreter::Code code = interpreter::compile(program);
+  RegisterCode registers = interpreter::compileRegisters(program);
+  Environment env;
+  env.define("x", 3);
+  env.define("y", 5);
+
+  unsigned long long before = interpreter::dispatchCount;
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < iterations; i++) {
+    if (engine == interpreter::Engine::Stack) {
+      interpreter::eval(code, env);
+    } else {
+      interpreter::evalRegisters(registers, env);
+    }
+  }
+  auto stop = std::chrono::steady_clock::now();
+  return Measurement{std::chrono::duration<double>(stop - start).count(),
+                     interpreter::dispatchCount - before};
+}
+
+static void compare(const std::string &name, Expression &program,
+                    int iterations) {
+  Measurement stack = measure(program, iterations, interpreter::Engine::Stack);
+  Measurement registers =
+      measure(program, iterations, interpreter::Engine::Register);
+  std::cout << name << ": stack " << stack.seconds << " s, "
+            << stack.dispatches << " instructions; register "
+            << registers.seconds << " s, " << registers.dispatches
+            << " instructions; register/stack time "
+            << registers.seconds / stack.seconds << std::endl;
+}
+
+int main() {
+  int leaf = 0;
+  ExprPtr globals = arithmetic(12, leaf);
+  compare("global arithmetic", *globals, 2000);
+
+  ExprPtr locals = localArithmetic(12);
+  compare("local arithmetic", *locals, 2000);
+
+  ExprPtr recursion = countdown(500);
+  compare("recursion", *recursion, 20000);
+
+  ExprPtr tail = loop(100000);
+  compare("tail loop", *tail, 100);
+
+  ExprPtr closure = closures(100000);
+  compare("closures", *closure, 20);
+
+  return 0;
+}
@@ -0,0 +1,79 @@
+// Measures the throughput of independent evaluations of one small script, each
+// in an isolate of its own, on a growing number of threads that share the
+// compiled program. Also compares shared code with code of its own on one
+// thread, where sharing costs the inline caches.
+
+#include "../include/bytecode.hpp"
+#include "../include/isolate.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+template <typename F> static double time(F f) {
+  auto start = std::chrono::steady_clock::now();
+  f();
+  auto stop = std::chrono::steady_clock::now();
+  return std::chrono::duration<double>(stop - start).count();
+}
+
+// Defines a few functions, builds a closure per element and sums up to input
+static const std::string script =
+    "(val scale (lambda (k) (lambda (x) (* x k))))\n"
+    "(val sum (lambda (self f n acc) (if n (self self f (- n 1) (+ acc (f n)))"
+    " acc)))\n"
+    "(val loop (lambda (self n acc) (if n (self self (- n 1) (+ acc (sum sum "
+    "(scale n) 20 0))) acc)))\n"
+    "(loop loop input 0)\n";
+
+// Runs program in a fresh isolate for every input
+static long long evaluate(const bytecode::Program &program, int first,
+                          int count) {
+  long long total = 0;
+  for (int i = first; i < first + count; i++) {
+    interpreter::Isolate isolate;
+    isolate.globals().define("input", Value(i % 50));
+    total += isolate.run(program).asInt();
+  }
+  return total;
+}
+
+int main() {
+  const int evaluations = 40000;
+  bytecode::Program program = bytecode::compile(script);
+  bytecode::Program own = bytecode::compile(script);
+
+  long long checksum = 0;
+  double unshared = time([&] { checksum += evaluate(own, 0, evaluations); });
+  interpreter::share(program);
+  double single = time([&] { checksum += evaluate(program, 0, evaluations); });
+  std::cout << "one thread: own code " << evaluations / unshared
+            << " evaluations/s, shared code " << evaluations / single
+            << " evaluations/s" << std::endl;
+
+  unsigned cores = std::max(2u, std::thread::hardware_concurrency());
+  for (unsigned threads = 1; threads <= cores; threads *= 2) {
+    std::atomic<long long> total{0};
+    double parallel = time([&] {
+      std::vector<std::thread> workers;
+      int each = evaluations / threads;
+      for (unsigned t = 0; t < threads; t++) {
+        workers.emplace_back(
+            [&, t] { total += evaluate(program, t * each, each); });
+      }
+      for (auto &worker : workers)
+        worker.join();
+    });
+    int done = evaluations / threads * threads;
+    double rate = done / parallel;
+    std::cout << threads << " threads: " << rate << " evaluations/s, "
+              << rate / (evaluations / single) << "x one thread" << std::endl;
+    checksum += total;
+  }
+  std::cout << "cores: " << std::thread::hardware_concurrency() << std::endl;
+  return checksum == 0;
+}
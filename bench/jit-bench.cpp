@@ -0,0 +1,57 @@
+// Measures the baseline JIT: a loop calling a leaf function of arithmetic, run
+// with the JIT off and on. With the JIT on the leaf runs as machine code and
+// only the loop is dispatched.
+
+#include "../include/ast.hpp"
+#include "../include/interpreter.hpp"
+#include "programs.hpp"
+
+#include <chrono>
+#include <iostream>
+#include <string>
+
+#ifndef INTERP_STATS
+#error "jit-bench needs INTERP_STATS to count instructions"
+#endif
+
+// Runs program iterations times, compiled once up front, and returns the time
+// taken
+static double run(const std::string &name, Expression &program, int iterations,
+                  bool jit) {
+  interpreter::setJitEnabled(jit);
+  interpreter::Code code = interpreter::compile(program);
+  Environment env;
+
+  int result = 0;
+  unsigned long long before = interpreter::dispatchCount;
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < iterations; i++) {
+    result = interpreter::eval(code, env).asInt();
+  }
+  auto stop = std::chrono::steady_clock::now();
+  unsigned long long count = interpreter::dispatchCount - before;
+
+  double seconds = std::chrono::duration<double>(stop - start).count();
+  std::cout << name << (jit ? " (jit)" : " (interpreted)") << ": " << seconds
+            << " s, " << count << " instructions, result " << result
+            << std::endl;
+  return seconds;
+}
+
+static void compare(const std::string &name, Expression &program,
+                    int iterations) {
+  double interpreted = run(name, program, iterations, false);
+  double jit = run(name, program, iterations, true);
+  std::cout << name << ": jit/interpreted time " << jit / interpreted
+            << std::endl;
+}
+
+int main() {
+  ExprPtr small = hotLeaf(100000, 3);
+  compare("small leaf", *small, 20);
+
+  ExprPtr large = hotLeaf(100000, 8);
+  compare("large leaf", *large, 20);
+
+  return 0;
+}
@@ -0,0 +1,91 @@
+// Measures lexer throughput in MB/s at every scanning level the CPU supports,
+// on two generated multi-megabyte sources: the program the parse benchmark
+// runs, and one padded with the long runs of indentation, comments, names and
+// string literals that vectorized scanning skips in a few steps. The padded
+// source is then lexed in parallel on more and more threads.
+
+#include "../include/lexer.hpp"
+#include "../include/scan.hpp"
+#include "programs.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <thread>
+
+template <typename F> static double time(F f) {
+  auto start = std::chrono::steady_clock::now();
+  f();
+  auto stop = std::chrono::steady_clock::now();
+  return std::chrono::duration<double>(stop - start).count();
+}
+
+static std::string padded(int forms) {
+  std::string text;
+  for (int i = 0; i < forms; i++) {
+    std::string name = "a_rather_long_function_name_" + std::to_string(i);
+    text += "\n\n// ------------------------------------------------------------"
+            "----------\n// " +
+            name + ": a comment long enough to span a few vectors\n";
+    text += "(val " + name + "\n        (lambda (first_argument second_argument)"
+            "\n            (+ first_argument 1234567890 second_argument)))\n";
+    text += "        \"a string literal that is skipped in a few steps\"\n";
+  }
+  return text;
+}
+
+static const char *name(scan::Level level) {
+  switch (level) {
+  case scan::Level::AVX2:
+    return "avx2";
+  case scan::Level::SSE2:
+    return "sse2";
+  default:
+    return "scalar";
+  }
+}
+
+static void bench(const std::string &label, const std::string &text) {
+  double megabytes = text.size() / 1e6;
+  std::cout << label << ": " << megabytes << " MB" << std::endl;
+  for (scan::Level level :
+       {scan::Level::Scalar, scan::Level::SSE2, scan::Level::AVX2}) {
+    if (level > scan::supported())
+      break;
+    scan::setLevel(level);
+    size_t tokens = 0;
+    double best = 1e9;
+    for (int run = 0; run < 5; run++) {
+      best = std::min(best, time([&] { tokens = Lexer(text).lex().size(); }));
+    }
+    std::cout << "  " << name(level) << ": " << tokens << " tokens, "
+              << megabytes / best << " MB/s" << std::endl;
+  }
+  scan::setLevel(scan::supported());
+}
+
+static void parallel(const std::string &text) {
+  double megabytes = text.size() / 1e6;
+  unsigned cores = std::max(1u, std::thread::hardware_concurrency());
+  std::cout << "parallel, " << cores << " cores:" << std::endl;
+  for (unsigned threads = 1; threads <= std::max(cores, 4u); threads *= 2) {
+    size_t tokens = 0;
+    double best = 1e9;
+    for (int run = 0; run < 5; run++) {
+      best = std::min(best, time([&] {
+                        tokens = Lexer(text).lexParallel(threads).size();
+                      }));
+    }
+    std::cout << "  " << threads << " threads: " << tokens << " tokens, "
+              << megabytes / best << " MB/s" << std::endl;
+  }
+}
+
+int main() {
+  bench("program", source(100000));
+  std::string text = padded(50000);
+  bench("padded", text);
+  parallel(text);
+  return 0;
+}
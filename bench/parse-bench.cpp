@@ -0,0 +1,79 @@
+// Measures the front end on a generated multi-megabyte source: lexing it into
+// a vector of tokens, from a string and from a mapped file, and streaming it
+// through the parser form by form while running every form. The program is
+// then saved as a bytecode file, which is loaded and run without the front end.
+
+#include "../include/ast.hpp"
+#include "../include/bytecode.hpp"
+#include "../include/interpreter.hpp"
+#include "../include/lexer.hpp"
+#include "../include/parser.hpp"
+#include "programs.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <string>
+
+template <typename F> static double time(F f) {
+  auto start = std::chrono::steady_clock::now();
+  f();
+  auto stop = std::chrono::steady_clock::now();
+  return std::chrono::duration<double>(stop - start).count();
+}
+
+int main() {
+  std::string text = source(100000);
+  double megabytes = text.size() / 1e6;
+  std::cout << "source: " << megabytes << " MB" << std::endl;
+
+  size_t tokens = 0;
+  double lexing = time([&] { tokens = Lexer(text).lex().size(); });
+  std::cout << "lex: " << tokens << " tokens in " << lexing << " s, "
+            << megabytes / lexing << " MB/s" << std::endl;
+
+  std::string path =
+      (std::filesystem::temp_directory_path() / "parse-bench.lisp").string();
+  std::ofstream(path) << text;
+  double mapped = time([&] {
+    SourceFile file(path);
+    tokens = Lexer(file).lex().size();
+  });
+  std::cout << "lex mapped file: " << tokens << " tokens in " << mapped
+            << " s, " << megabytes / mapped << " MB/s" << std::endl;
+
+  Environment env;
+  int result = 0;
+  double running =
+      time([&] { result = interpreter::runSource(text, env).asInt(); });
+  std::cout << "parse and run: " << running << " s, " << megabytes / running
+            << " MB/s, result " << result << std::endl;
+
+  Environment file_env;
+  running =
+      time([&] { result = interpreter::runFile(path, file_env).asInt(); });
+  std::cout << "parse and run mapped file: " << running << " s, "
+            << megabytes / running << " MB/s, result " << result << std::endl;
+  std::remove(path.c_str());
+
+  std::string compiled =
+      (std::filesystem::temp_directory_path() / "parse-bench.lbc").string();
+  bytecode::Program program;
+  double compiling = time([&] { program = bytecode::compile(text); });
+  bytecode::save(program, compiled);
+  std::cout << "parse and compile: " << compiling << " s, "
+            << std::filesystem::file_size(compiled) / 1e6
+            << " MB of bytecode" << std::endl;
+  double loading = time([&] { program = bytecode::load(compiled); });
+  std::cout << "load bytecode: " << loading << " s" << std::endl;
+  Environment bytecode_env;
+  running = time([&] {
+    result = bytecode::run(bytecode::load(compiled), bytecode_env).asInt();
+  });
+  std::cout << "load and run bytecode: " << running << " s, result " << result
+            << std::endl;
+  std::remove(compiled.c_str());
+  return 0;
+}
@@ -0,0 +1,62 @@
+// Measures preduce and pmap against the same work done by a loop in the
+// script, on pools of 1, 2, 4, ... workers. Every call of f runs a small
+// loop of its own, so the work is spread over the calls.
+
+#include "../include/parallel.hpp"
+#include "../include/parser.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <thread>
+
+template <typename F> static double time(F f) {
+  auto start = std::chrono::steady_clock::now();
+  f();
+  auto stop = std::chrono::steady_clock::now();
+  return std::chrono::duration<double>(stop - start).count();
+}
+
+static const std::string definitions =
+    "(val work (lambda (self i k acc) (if k (self self i (- k 1) "
+    "(+ acc (* i k))) acc)))\n"
+    "(val f (lambda (i) (work work i 200 0)))\n"
+    "(val add (lambda (a b) (+ a b)))\n"
+    "(val loop (lambda (self i acc) (if i (self self (- i 1) "
+    "(+ acc (f (- i 1)))) acc)))\n";
+
+int main() {
+  const int n = 20000;
+  const std::string count = std::to_string(n);
+
+  Environment env;
+  parallel::define(env);
+  interpreter::runSource(definitions, env);
+
+  int sequential = 0;
+  double loop = time([&] {
+    sequential =
+        interpreter::runSource("(loop loop " + count + " 0)", env).asInt();
+  });
+  std::cout << "loop: " << loop << " s" << std::endl;
+
+  unsigned cores = std::max(2u, std::thread::hardware_concurrency());
+  for (unsigned threads = 1; threads <= cores; threads *= 2) {
+    parallel::setThreads(threads);
+    parallel::pool();
+    int reduced = 0;
+    double reduce = time([&] {
+      reduced = interpreter::runSource("(preduce add 0 f " + count + ")", env)
+                    .asInt();
+    });
+    double map = time([&] {
+      interpreter::runSource("(val mapped (pmap f " + count + "))", env);
+    });
+    std::cout << threads << " threads: preduce " << reduce << " s, "
+              << loop / reduce << "x the loop; pmap " << map << " s"
+              << (reduced == sequential ? "" : ", WRONG RESULT") << std::endl;
+  }
+  std::cout << "cores: " << std::thread::hardware_concurrency() << std::endl;
+  return 0;
+}
@@ -0,0 +1,142 @@
+// programs.hpp
+// Helpers to build ASTs by hand and the programs the benchmarks run.
+
+#ifndef BENCH_PROGRAMS_HPP
+#define BENCH_PROGRAMS_HPP
+
+#include "../include/ast.hpp"
+
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+using ExprPtr = std::unique_ptr<Expression>;
+
+static ExprPtr num(int value) { return std::make_unique<Constant>(value); }
+
+static ExprPtr sym(const std::string &name) {
+  return std::make_unique<StringConstant>(name);
+}
+
+static ExprPtr binop(char op, ExprPtr left, ExprPtr right) {
+  return std::make_unique<BinaryOperation>(op, std::move(left),
+                                           std::move(right));
+}
+
+template <typename... Exprs> static ExprPtr list(Exprs... exprs) {
+  std::vector<ExprPtr> exps;
+  (exps.push_back(std::move(exprs)), ...);
+  return std::make_unique<ExpressionList>(std::move(exps));
+}
+
+static ExprPtr lambda(std::vector<std::string> names, ExprPtr body) {
+  std::vector<StringConstant> params;
+  for (const auto &name : names) {
+    params.push_back(StringConstant(name));
+  }
+  return std::make_unique<Lambda>(params, std::move(body));
+}
+
+// A balanced tree of +, - and * over constants and the variables x and y
+static ExprPtr arithmetic(int depth, int &leaf, const std::string &x = "x",
+                          const std::string &y = "y") {
+  if (depth == 0) {
+    leaf++;
+    if (leaf % 3 == 0)
+      return sym(x);
+    if (leaf % 3 == 1)
+      return sym(y);
+    return num(leaf % 7);
+  }
+  const char ops[] = {'+', '-', '*'};
+  ExprPtr left = arithmetic(depth - 1, leaf, x, y);
+  ExprPtr right = arithmetic(depth - 1, leaf, x, y);
+  return binop(ops[depth % 3], std::move(left), std::move(right));
+}
+
+// ((lambda (a b) <arithmetic over a and b>) 3 5)
+static ExprPtr localArithmetic(int depth) {
+  int leaf = 0;
+  return list(lambda({"a", "b"}, arithmetic(depth, leaf, "a", "b")), num(3),
+              num(5));
+}
+
+// ((lambda (f n) (f f n))
+//  (lambda (self n) (if n (+ 1 (self self (- n 1))) 0))
+//  depth)
+static ExprPtr countdown(int depth) {
+  ExprPtr body =
+      list(sym("if"), sym("n"),
+           binop('+', num(1),
+                 list(sym("self"), sym("self"),
+                      binop('-', sym("n"), num(1)))),
+           num(0));
+  return list(lambda({"f", "n"}, list(sym("f"), sym("f"), sym("n"))),
+              lambda({"self", "n"}, std::move(body)), num(depth));
+}
+
+// ((lambda (f n acc) (f f n acc))
+//  (lambda (self n acc) (if n (self self (- n 1) (+ acc n)) acc))
+//  count 0)
+static ExprPtr loop(int count) {
+  ExprPtr body = list(sym("if"), sym("n"),
+                      list(sym("self"), sym("self"),
+                           binop('-', sym("n"), num(1)),
+                           binop('+', sym("acc"), sym("n"))),
+                      sym("acc"));
+  return list(lambda({"f", "n", "acc"},
+                     list(sym("f"), sym("f"), sym("n"), sym("acc"))),
+              lambda({"self", "n", "acc"}, std::move(body)), num(count),
+              num(0));
+}
+
+// Like loop, but every iteration goes through a fresh closure over self, n
+// and acc:
+// (lambda (self n acc)
+//   (if n ((lambda () (self self (- n 1) (+ acc n)))) acc))
+static ExprPtr closures(int count) {
+  ExprPtr step = lambda({}, list(sym("self"), sym("self"),
+                                 binop('-', sym("n"), num(1)),
+                                 binop('+', sym("acc"), sym("n"))));
+  ExprPtr body = list(sym("if"), sym("n"), list(std::move(step)), sym("acc"));
+  return list(lambda({"f", "n", "acc"},
+                     list(sym("f"), sym("f"), sym("n"), sym("acc"))),
+              lambda({"self", "n", "acc"}, std::move(body)), num(count),
+              num(0));
+}
+
+// A loop calling a leaf function of arithmetic over its parameters:
+// ((lambda (f g n acc) (f f g n acc))
+//  (lambda (self g n acc) (if n (self self g (- n 1) (g n acc)) acc))
+//  (lambda (a b) <arithmetic over a and b>)
+//  count 0)
+static ExprPtr hotLeaf(int count, int depth) {
+  int leaf = 0;
+  ExprPtr body = list(sym("if"), sym("n"),
+                      list(sym("self"), sym("self"), sym("g"),
+                           binop('-', sym("n"), num(1)),
+                           list(sym("g"), sym("n"), sym("acc"))),
+                      sym("acc"));
+  return list(lambda({"f", "g", "n", "acc"},
+                     list(sym("f"), sym("f"), sym("g"), sym("n"), sym("acc"))),
+              lambda({"self", "g", "n", "acc"}, std::move(body)),
+              lambda({"a", "b"}, arithmetic(depth, leaf, "a", "b")),
+              num(count), num(0));
+}
+
+// Lisp source of 2 * forms top-level forms, each pair defining a small
+// function and calling it
+static std::string source(int forms) {
+  std::string text;
+  for (int i = 0; i < forms; i++) {
+    std::string name = "f" + std::to_string(i);
+    text += "// form " + std::to_string(i) + "\n";
+    text += "(val " + name + " (lambda (a b) (+ (* a " +
+            std::to_string(i % 7) + ") (- b 3) (* a b))))\n";
+    text += "(" + name + " " + std::to_string(i) + " 2)\n";
+  }
+  return text;
+}
+
+#endif
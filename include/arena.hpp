@@ -0,0 +1,60 @@
+// arena.hpp
+// A bump allocator for memory with a common lifetime, such as the AST of one
+// compilation unit or the tables of the Compiler. Allocation moves a pointer
+// through large blocks; nothing is freed until the arena itself is destroyed,
+// which releases every block at once.
+
+#ifndef ARENA_HPP
+#define ARENA_HPP
+
+#include <cstddef>
+#include <memory>
+#include <memory_resource>
+#include <vector>
+
+// Definition of Arena
+// Also a memory_resource, so std::pmr containers can allocate from it.
+class Arena : public std::pmr::memory_resource {
+private:
+  std::vector<std::unique_ptr<char[]>> blocks;
+  char *next = nullptr;
+  char *end = nullptr;
+  size_t blockSize;
+  size_t used = 0;
+
+  void *do_allocate(size_t bytes, size_t alignment) override;
+  // Memory is only returned when the arena is destroyed
+  void do_deallocate(void *, size_t, size_t) override {}
+  bool do_is_equal(const std::pmr::memory_resource &other) const
+      noexcept override {
+    return this == &other;
+  }
+
+public:
+  explicit Arena(size_t blockSize = 64 * 1024) : blockSize(blockSize) {}
+  Arena(const Arena &) = delete;
+  Arena &operator=(const Arena &) = delete;
+
+  // Number of bytes handed out, and number of blocks taken from the heap
+  size_t bytesUsed() const { return used; }
+  size_t blockCount() const { return blocks.size(); }
+
+  // The arena that AST nodes of this thread are allocated in, or null for
+  // the heap
+  static Arena *current();
+
+  // Makes arena current for the thread while it is alive. Nodes created in a
+  // scope must be destroyed before its arena is.
+  class Scope {
+  private:
+    Arena *previous;
+
+  public:
+    explicit Scope(Arena &arena);
+    ~Scope();
+    Scope(const Scope &) = delete;
+    Scope &operator=(const Scope &) = delete;
+  };
+};
+
+#endif
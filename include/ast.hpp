@@ -3,10 +3,17 @@
 #ifndef EXPRESSION_HPP
 #define EXPRESSION_HPP
 
-#include <boost/variant.hpp>
+#include "arena.hpp"
+#include "symbol.hpp"
+#include <atomic>
+#include <cstdint>
+#include <functional>
 #include <iostream>
 #include <memory>
+#include <memory_resource>
+#include <stdexcept>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 // Forward declarations
@@ -16,68 +23,392 @@ class StringConstant;
 class ExpressionList;
 class Lambda;
 class Instruction;
+class CodeObject;
 class Function;
+class Cell;
+class RegisterFunction;
+class Builtin;
+class NativeCode;
 class Environment;
 class Expression;
+class HeapObject;
+class Value;
 
 // Available Opcodes
+// Listed once as an X-macro so that the enum, the printer and the dispatch
+// table of the interpreter are always generated in the same order.
+#define OPCODES(X)                                                             \
+  X(LOAD_CONST)                                                                \
+  X(STORE_NAME)                                                                \
+  X(LOAD_NAME)                                                                 \
+  X(LOAD_LOCAL)                                                                \
+  X(STORE_LOCAL)                                                               \
+  X(MAKE_CELL)                                                                 \
+  X(LOAD_CELL)                                                                 \
+  X(STORE_CELL)                                                                \
+  X(LOAD_UPVALUE)                                                              \
+  X(RELATIVE_JUMP)                                                             \
+  X(RELATIVE_JUMP_IF_TRUE)                                                     \
+  X(MAKE_FUNCTION)                                                             \
+  X(CALL_FUNCTION)                                                             \
+  X(TAIL_CALL)                                                                 \
+  X(RETURN)                                                                    \
+  X(ADD)                                                                       \
+  X(SUB)                                                                       \
+  X(MUL)                                                                       \
+  X(ADD_CONST)                                                                 \
+  X(SUB_CONST)                                                                 \
+  X(MUL_CONST)                                                                 \
+  X(ADD_LOCAL)                                                                 \
+  X(SUB_LOCAL)                                                                 \
+  X(MUL_LOCAL)                                                                 \
+  X(ADD_NAME)                                                                  \
+  X(SUB_NAME)                                                                  \
+  X(MUL_NAME)                                                                  \
+  X(LOAD_LOCAL_LOCAL)                                                          \
+  X(JUMP_IF_LOCAL)                                                             \
+  X(CALL_KNOWN)                                                                \
+  X(TAIL_CALL_KNOWN)
+
 enum class OpCode {
-  LOAD_CONST,
-  STORE_NAME,
-  LOAD_NAME,
-  RELATIVE_JUMP,
-  RELATIVE_JUMP_IF_TRUE,
-  MAKE_FUNCTION,
-  CALL_FUNCTION,
-  ADD,
-  SUB,
-  MUL
-};
-
-typedef boost::variant<int, std::string, std::vector<std::string>,
-                       std::shared_ptr<Function>,
-                       boost::recursive_wrapper<std::vector<Instruction>>>
-    ValueType;
+#define OPCODE_ENUM(op) op,
+  OPCODES(OPCODE_ENUM)
+#undef OPCODE_ENUM
+};
+
+#define OPCODE_ONE(op) +1
+constexpr int OPCODE_COUNT = 0 OPCODES(OPCODE_ONE);
+#undef OPCODE_ONE
+static_assert(OPCODE_COUNT <= 256, "opcodes must fit in 8 bits");
+
+namespace gc {
+class Heap;
+}
+
+// Receives the Values a heap object holds, see gc.hpp
+class Tracer {
+public:
+  virtual ~Tracer() {}
+  // Called for every Value that refers to a heap object
+  virtual void visit(HeapObject *object) = 0;
+  void visit(const Value &value);
+};
+
+// Base class of objects that runtime values refer to by pointer
+// Objects are reference counted, which frees them as soon as the last Value
+// referring to them goes. Cycles are left to the collector of gc.hpp, which
+// tracks every object in the heap that was current when it was made.
+class HeapObject {
+private:
+  gc::Heap *heap = nullptr;      // that tracks the object, if any
+  HeapObject *gcNext = nullptr;  // in the generation the object is in
+  HeapObject **gcPrev = nullptr; // the link that points to the object
+  int gcRefs = 0;                // scratch space of a collection
+  int generation = 0;
+
+  friend class gc::Heap;
+
+public:
+  enum class Kind { Function, Cell, RegisterFunction, Builtin };
+
+  const Kind kind;
+  int refCount = 0;
+
+  HeapObject(Kind kind);
+  virtual ~HeapObject();
+  HeapObject(const HeapObject &) = delete;
+  HeapObject &operator=(const HeapObject &) = delete;
+
+  // Passes every Value the object holds to tracer
+  virtual void trace(Tracer &) {}
+  // Drops every Value the object holds, to break a cycle of garbage
+  virtual void clear() {}
+};
+
+// Definition of Value
+// A runtime value is a single tagged 64-bit word. Integers are stored inline
+// in the high 32 bits with the low bit set; any other word is a pointer to a
+// reference counted HeapObject. Names, parameter lists and lambda bodies are
+// not values: they live in the side tables of a CodeObject.
+class Value {
+private:
+  static constexpr uint64_t INT_TAG = 1;
+  uint64_t bits;
+
+  HeapObject *object() const { return reinterpret_cast<HeapObject *>(bits); }
+  void retain() const {
+    if (!isInt())
+      object()->refCount++;
+  }
+  void release() const {
+    if (!isInt() && --object()->refCount == 0)
+      delete object();
+  }
+
+public:
+  Value() : Value(0) {}
+  Value(int i)
+      : bits((static_cast<uint64_t>(static_cast<uint32_t>(i)) << 32) |
+             INT_TAG) {}
+  Value(HeapObject *object) : bits(reinterpret_cast<uint64_t>(object)) {
+    retain();
+  }
+
+  Value(const Value &other) : bits(other.bits) { retain(); }
+  Value(Value &&other) noexcept : bits(other.bits) { other.bits = INT_TAG; }
+  Value &operator=(const Value &other) {
+    other.retain();
+    release();
+    bits = other.bits;
+    return *this;
+  }
+  Value &operator=(Value &&other) noexcept {
+    if (this != &other) {
+      release();
+      bits = other.bits;
+      other.bits = INT_TAG;
+    }
+    return *this;
+  }
+  ~Value() { release(); }
+
+  bool isInt() const { return bits & INT_TAG; }
+  int asInt() const { return static_cast<int32_t>(bits >> 32); }
+
+  bool isFunction() const {
+    return !isInt() && object()->kind == HeapObject::Kind::Function;
+  }
+  // A function compiled for the register machine, see register.hpp
+  bool isRegisterFunction() const {
+    return !isInt() && object()->kind == HeapObject::Kind::RegisterFunction;
+  }
+  // A function implemented in C++, which the stack machine can call
+  bool isBuiltin() const {
+    return !isInt() && object()->kind == HeapObject::Kind::Builtin;
+  }
+  Function *asFunction() const;
+  Cell *asCell() const;
+  RegisterFunction *asRegisterFunction() const;
+  Builtin *asBuiltin() const;
+
+  // Integer arithmetic directly on the tagged words, wrapping on overflow.
+  // Both operands must be integers.
+  static bool bothInts(const Value &a, const Value &b) {
+    return a.bits & b.bits & INT_TAG;
+  }
+  static Value add(const Value &a, const Value &b) {
+    return fromBits(a.bits + b.bits - INT_TAG);
+  }
+  static Value sub(const Value &a, const Value &b) {
+    return fromBits(a.bits - b.bits + INT_TAG);
+  }
+  static Value mul(const Value &a, const Value &b) {
+    return Value(static_cast<int32_t>(static_cast<uint32_t>(a.asInt()) *
+                                      static_cast<uint32_t>(b.asInt())));
+  }
+
+  bool operator==(const Value &other) const { return bits == other.bits; }
+
+  friend std::ostream &operator<<(std::ostream &os, const Value &value);
+  friend class Tracer;
+
+private:
+  static Value fromBits(uint64_t bits) {
+    Value value;
+    value.bits = bits;
+    return value;
+  }
+};
+
+static_assert(sizeof(Value) == 8, "values must fit in a machine word");
+
+inline void Tracer::visit(const Value &value) {
+  if (!value.isInt())
+    visit(value.object());
+}
 
 // Definition of Instruction
+// An instruction is a single 32-bit word: the low 8 bits hold the opcode and
+// the high 24 bits a signed operand. Depending on the opcode the operand is an
+// index into one of the CodeObject side tables or a relative jump offset.
+// Calls, which take an argument count and a call site, and superinstructions
+// that need two operands split it into an unsigned 8-bit first and a signed
+// 16-bit second operand.
 class Instruction {
+private:
+  uint32_t word;
+
 public:
-  OpCode opCode;
-  ValueType arg;
+  static constexpr int MIN_ARG = -(1 << 23);
+  static constexpr int MAX_ARG = (1 << 23) - 1;
+
+  Instruction(OpCode op, int arg);
+  Instruction(OpCode op, int first, int second);
+
+  // Whether two operands fit in one instruction
+  static bool fits(int first, int second) {
+    return first >= 0 && first <= 0xff && second >= -(1 << 15) &&
+           second < (1 << 15);
+  }
 
-  Instruction(OpCode op, ValueType arg);
+  OpCode opCode() const { return static_cast<OpCode>(word & 0xff); }
+  int arg() const { return static_cast<int32_t>(word) >> 8; }
+  int first() const { return (word >> 8) & 0xff; }
+  int second() const { return static_cast<int32_t>(word) >> 16; }
 
   bool operator==(const Instruction &other) const;
 
   friend std::ostream &operator<<(std::ostream &os, const Instruction &instr);
 };
 
-// Definition of Environment
-using Table = std::unordered_map<std::string, ValueType>;
+// Where a closure finds one of its captured variables when it is created:
+// in a local slot of the enclosing frame, or among the enclosing function's
+// own upvalues
+struct Upvalue {
+  bool isLocal;
+  int index;
+
+  bool operator==(const Upvalue &other) const {
+    return isLocal == other.isLocal && index == other.index;
+  }
+};
+
+// Inline cache of a global name: the entry that satisfied the last lookup,
+// valid while the environment it was found in keeps the same shape
+struct NameCache {
+  uint64_t shape = 0;
+  Value *entry = nullptr;
+
+  // The global name in env. A hit costs one comparison; a miss, on the first
+  // use or after the environment was replaced, hashes the name and refills
+  // the cache.
+  Value &lookup(Environment &env, Symbol name);
+};
 
+// Call count and native code of a function body, kept by eval for the JIT
+// (see jit.hpp)
+struct JitState {
+  int calls = 0;
+  bool attempted = false; // compileNative has run, whether or not it succeeded
+  std::shared_ptr<const NativeCode> native;
+};
+
+// What a call site has seen, kept by eval to quicken it: the id of the code
+// object it last called and the stack slots a frame for it needs. A site that
+// missed once stays generic.
+struct CallCache {
+  uint64_t callee = 0;
+  int frameSize = 0;
+  bool generic = false;
+};
+
+// Whether a code object is shared by isolates (see isolate.hpp): set once, by
+// interpreter::share, and read by any thread. A copy of the code object takes
+// the value along with the code it describes.
+struct ShareFlag {
+  std::atomic<bool> set{false};
+
+  ShareFlag() = default;
+  ShareFlag(const ShareFlag &other) : set(other.set.load()) {}
+  ShareFlag &operator=(const ShareFlag &other) {
+    set = other.set.load();
+    return *this;
+  }
+};
+
+// Definition of CodeObject
+// The unit of compiled code: a packed instruction stream plus the side tables
+// its operands refer to. Every lambda body is compiled to its own CodeObject,
+// which is stored in the functions table of the enclosing one.
+class CodeObject {
+public:
+  mutable std::vector<Instruction> instructions; // quickened in place by eval
+  std::vector<int> constants;                              // LOAD_CONST
+  std::vector<Symbol> names;                               // *_NAME
+  std::vector<Symbol> params;                              // lambda parameters
+  std::vector<std::shared_ptr<const CodeObject>> functions; // MAKE_FUNCTION
+  int stackSize = 0; // maximum operand stack depth, computed by the Compiler
+  int numLocals = 0; // frame slots: the parameters, then the val bindings
+  std::vector<Upvalue> upvalues; // variables captured from enclosing lambdas
+  mutable std::vector<NameCache> nameCaches; // by name, filled in by eval
+  mutable std::vector<CallCache> callCaches; // by call site
+  mutable JitState jit;
+  // Set by interpreter::share, after which eval only reads the code object
+  mutable ShareFlag shared;
+  uint64_t id = 0; // unique to the body, 0 if it is not compiled yet
+
+  // A fresh id for a compiled body
+  static uint64_t freshId();
+
+  size_t size() const { return instructions.size(); }
+  const Instruction &operator[](size_t i) const { return instructions[i]; }
+  void clear();
+
+  friend std::ostream &operator<<(std::ostream &os, const CodeObject &code);
+};
+
+// Definition of Environment
+// Names are interned, so the table hashes and compares integers. The
+// std::string overloads intern their argument and are meant for host code.
+using Table = std::unordered_map<Symbol, Value>;
+
+// An Environment holds the global bindings; variables bound inside lambdas
+// live in frames and cells instead.
+//
+// Entries are never erased and the nodes of the table do not move when it
+// grows, so a pointer to an entry stays valid until the table is replaced.
+// Every table gets a new shape when that happens, which is what inline caches
+// check before using a pointer they kept.
 class Environment {
 private:
   Table table;
-  Environment *parent;
+  uint64_t shape_;
 
 public:
   Environment();
 
-  Environment(Table env, Environment *parent);
+  Environment(Table env);
+
+  Environment(const Environment &other);
+  Environment(Environment &&other);
+  Environment &operator=(const Environment &other);
+  Environment &operator=(Environment &&other);
 
-  void define(std::string name, ValueType value);
+  uint64_t shape() const { return shape_; }
 
-  void assign(std::string name, ValueType value);
+  // The entry for name, or null if it is not defined
+  Value *find(Symbol name);
 
-  ValueType lookup(std::string name);
+  void define(Symbol name, Value value);
+  void define(const std::string &name, Value value);
 
-  Table &resolve(std::string name);
+  void assign(Symbol name, Value value);
+  void assign(const std::string &name, Value value);
 
-  bool isDefined(std::string name);
+  Value lookup(Symbol name);
+  Value lookup(const std::string &name);
+
+  Table &resolve(Symbol name);
+
+  bool isDefined(Symbol name);
+  bool isDefined(const std::string &name);
 
   friend std::ostream &operator<<(std::ostream &os, const Environment &env);
 };
 
+inline Value &NameCache::lookup(Environment &env, Symbol name) {
+  if (shape != env.shape()) {
+    Value *found = env.find(name);
+    if (!found) {
+      throw std::runtime_error("Unable to resolve name " +
+                               SymbolTable::name(name));
+    }
+    entry = found;
+    shape = env.shape();
+  }
+  return *entry;
+}
+
 // Visitor interface
 class ExpressionVisitor {
 public:
@@ -89,23 +420,17 @@ public:
   virtual void visit(Lambda &lambda) = 0;
 };
 
-// Visitor interface for compilation
-class CompilerVisitor {
-public:
-  virtual ~CompilerVisitor() {}
-  virtual std::vector<Instruction> visit(Constant &constant) = 0;
-  virtual std::vector<Instruction> visit(BinaryOperation &binaryOperation) = 0;
-  virtual std::vector<Instruction> visit(StringConstant &stringConstant) = 0;
-  virtual std::vector<Instruction> visit(ExpressionList &expressionList) = 0;
-  virtual std::vector<Instruction> visit(Lambda &lambda) = 0;
-};
-
 // Base class representing an expression
+// Nodes are allocated in the current Arena of the thread if there is one (see
+// arena.hpp), and on the heap otherwise. Deleting a node in an arena only runs
+// its destructor; the memory goes when the arena does.
 class Expression {
 public:
+  static void *operator new(size_t size);
+  static void operator delete(void *node);
+
   virtual ~Expression() {}
   virtual void accept(ExpressionVisitor &visitor) = 0;
-  virtual std::vector<Instruction> accept(CompilerVisitor &visitor) = 0;
 
   // Overload the << operator
   friend std::ostream &operator<<(std::ostream &os, Expression &expr);
@@ -122,27 +447,21 @@ public:
   int getValue() const { return value; }
 
   void accept(ExpressionVisitor &visitor) override { visitor.visit(*this); }
-
-  std::vector<Instruction> accept(CompilerVisitor &visitor) override {
-    return visitor.visit(*this);
-  }
 };
 
 // Derived class representing a string constant
 class StringConstant : public Expression {
 private:
-  std::string value;
+  Symbol symbol;
 
 public:
-  StringConstant(const std::string &val) : value(val) {}
+  StringConstant(const std::string &val) : symbol(SymbolTable::intern(val)) {}
+  StringConstant(Symbol symbol) : symbol(symbol) {}
 
-  const std::string &getValue() const { return value; }
+  const std::string &getValue() const { return SymbolTable::name(symbol); }
+  Symbol getSymbol() const { return symbol; }
 
   void accept(ExpressionVisitor &visitor) override { visitor.visit(*this); }
-
-  std::vector<Instruction> accept(CompilerVisitor &visitor) override {
-    return visitor.visit(*this);
-  }
 };
 
 // Derived class representing a binary operation
@@ -161,11 +480,11 @@ public:
   Expression &getLeft() const { return *left; }
   Expression &getRight() const { return *right; }
 
-  void accept(ExpressionVisitor &visitor) override { visitor.visit(*this); }
+  // The owning slots, for passes that rewrite the tree
+  std::unique_ptr<Expression> &getLeftPtr() { return left; }
+  std::unique_ptr<Expression> &getRightPtr() { return right; }
 
-  std::vector<Instruction> accept(CompilerVisitor &visitor) override {
-    return visitor.visit(*this);
-  }
+  void accept(ExpressionVisitor &visitor) override { visitor.visit(*this); }
 };
 
 // Derived class representing a list of expressions
@@ -180,33 +499,33 @@ public:
   const std::vector<std::unique_ptr<Expression>> &getExpressions() const {
     return expressions;
   }
+  std::vector<std::unique_ptr<Expression>> &getExpressions() {
+    return expressions;
+  }
 
-  void accept(ExpressionVisitor &visitor) override { visitor.visit(*this); }
+  // What is wrong with the list as a form: it is empty, or a val or an if
+  // with the wrong number of parts. Null if nothing is.
+  const char *malformed() const;
 
-  std::vector<Instruction> accept(CompilerVisitor &visitor) override {
-    return visitor.visit(*this);
-  }
+  void accept(ExpressionVisitor &visitor) override { visitor.visit(*this); }
 };
 
 // Derived class representing a lambda (function)
 class Lambda : public Expression {
 private:
-  std::vector<StringConstant> params; //
+  std::vector<StringConstant> params;
   std::unique_ptr<Expression> body;
 
 public:
   Lambda(std::vector<StringConstant> params, std::unique_ptr<Expression> body)
-      : params(params), body(std::move(body)) {}
+      : params(std::move(params)), body(std::move(body)) {}
 
   const std::vector<StringConstant> &getParams() const { return params; }
 
   Expression &getBody() const { return *body; }
+  std::unique_ptr<Expression> &getBodyPtr() { return body; }
 
   void accept(ExpressionVisitor &visitor) override { visitor.visit(*this); }
-
-  std::vector<Instruction> accept(CompilerVisitor &visitor) override {
-    return visitor.visit(*this);
-  }
 };
 
 // Concrete visitor implementation
@@ -224,30 +543,155 @@ public:
   void visit(Lambda &lambda) override;
 };
 
+// Folds arithmetic on constants and replaces an if with a constant condition
+// by the arm it selects. A visit leaves the node to put in place of the one
+// visited in replacement, or leaves it empty to keep it.
+class ConstantFolder : public ExpressionVisitor {
+private:
+  std::unique_ptr<Expression> replacement;
+
+  void fold(std::unique_ptr<Expression> &exp);
+
+public:
+  // Fold exp, returning the simplified tree
+  std::unique_ptr<Expression> run(std::unique_ptr<Expression> exp);
+
+  void visit(Constant &constant) override;
+  void visit(BinaryOperation &binaryOperation) override;
+  void visit(StringConstant &stringConstant) override;
+  void visit(ExpressionList &expressionList) override;
+  void visit(Lambda &lambda) override;
+};
+
+// Switches for the optional passes of the Compiler
+struct CompileOptions {
+  // Fuse common instruction sequences into superinstructions and thread jumps
+  bool peephole = true;
+  // Fold constant subexpressions of a tree that compile is given to own
+  // before compiling it, see fold
+  bool fold = true;
+};
+
 // Concrete visitor implementation
-class Compiler : public CompilerVisitor {
+class Compiler : public ExpressionVisitor {
+private:
+  // Code objects under construction, innermost lambda last. Each visit
+  // appends the code of its node to the instructions of the innermost code
+  // object, which are never copied; constants, names and nested functions go
+  // straight into its side tables. Forward jumps are emitted with a
+  // placeholder offset and patched once their target is reached.
+  //
+  // Names bound inside a lambda, its parameters and vals, are resolved at
+  // compile time: to a slot of its frame, or, from a nested lambda, to an
+  // upvalue of the closure. Variables that some closure captures are marked
+  // and kept in cells. Names bound at the top level, and any that do not
+  // resolve, are globals looked up by name at run time.
+  //
+  // The tables of a unit only live as long as the compilation, and are
+  // allocated in the arena of the Compiler.
+  struct Unit {
+    CodeObject *code;
+    std::pmr::unordered_map<int, int> constantIndex;
+    std::pmr::unordered_map<Symbol, int> nameIndex;
+    std::pmr::unordered_map<Symbol, int> localIndex;
+    std::pmr::unordered_map<Symbol, int> upvalueIndex;
+    std::pmr::vector<bool> captured; // by local slot
+
+    Unit(CodeObject *code, std::pmr::memory_resource *memory)
+        : code(code), constantIndex(memory), nameIndex(memory),
+          localIndex(memory), upvalueIndex(memory), captured(memory) {}
+  };
+  Arena arena;
+  std::vector<Unit> units;
+  CompileOptions options;
+
+  int constant(int value);
+  int name(Symbol name);
+  int declareLocal(Symbol name);
+  int upvalue(int unit, Symbol name);
+  Instruction load(Symbol name);
+  void emit(Instruction ins);
+  // Emits a forward jump and returns the label to patch once its target is
+  // known
+  int jump(OpCode op);
+  // Points the jump at label to the next instruction to be emitted
+  void patch(int label);
+  void finish(CodeObject &code);
+  void value(Expression &exp);
+
 public:
-  Compiler() {}
+  Compiler(CompileOptions options = CompileOptions()) : options(options) {}
 
-  std::vector<Instruction> visit(Constant &constant) override;
-  std::vector<Instruction> visit(BinaryOperation &binaryOperation) override;
-  std::vector<Instruction> visit(StringConstant &stringConstant) override;
-  std::vector<Instruction> visit(ExpressionList &expressionList) override;
-  std::vector<Instruction> visit(Lambda &lambda) override;
+  // Compile a top-level expression into a new code object
+  CodeObject compile(Expression &exp);
+
+  void visit(Constant &constant) override;
+  void visit(BinaryOperation &binaryOperation) override;
+  void visit(StringConstant &stringConstant) override;
+  void visit(ExpressionList &expressionList) override;
+  void visit(Lambda &lambda) override;
+};
+
+// Rewrites a finished instruction stream, ending in RETURN, into an
+// equivalent one with superinstructions and without redundant jumps
+void peephole(std::vector<Instruction> &ins);
+
+// Definition of Cell
+// A variable captured by a closure. The frame that binds it and every closure
+// that captures it share the cell, so closure creation copies cell pointers
+// rather than environments.
+class Cell : public HeapObject {
+public:
+  Value value;
+
+  Cell(Value value) : HeapObject(Kind::Cell), value(std::move(value)) {}
+
+  void trace(Tracer &tracer) override { tracer.visit(value); }
+  void clear() override { value = Value(); }
 };
 
 // Definition of Function
-class Function {
+class Function : public HeapObject {
 
 public:
-  Function(std::vector<std::string> params, std::vector<Instruction> body,
-           Environment env);
+  Function(std::shared_ptr<const CodeObject> code);
 
-  std::vector<std::string> params;
-  std::vector<Instruction> body;
-  Environment env;
+  std::shared_ptr<const CodeObject> code;
+  std::vector<Value> upvalues; // cells, in the order of code->upvalues
+
+  void trace(Tracer &tracer) override;
+  void clear() override { upvalues.clear(); }
 
   friend std::ostream &operator<<(std::ostream &os, const Function &f);
 };
 
+inline Function *Value::asFunction() const {
+  return static_cast<Function *>(object());
+}
+
+inline Cell *Value::asCell() const { return static_cast<Cell *>(object()); }
+
+// Definition of Builtin
+// A function implemented in C++, such as pmap (see parallel.hpp). The body is
+// passed the arguments of a call, which it must not keep, and the environment
+// of the caller. It may not run eval on the calling thread, which is in the
+// middle of the call, and must not hold Values of its own: they would be
+// hidden from the collector.
+class Builtin : public HeapObject {
+public:
+  using Body =
+      std::function<Value(const Value *args, int nargs, Environment &env)>;
+
+  Builtin(std::string name, Body body)
+      : HeapObject(Kind::Builtin), name(std::move(name)),
+        body(std::move(body)) {}
+
+  std::string name;
+  Body body;
+};
+
+inline Builtin *Value::asBuiltin() const {
+  return static_cast<Builtin *>(object());
+}
+
 #endif // EXPRESSION_HPP
\ No newline at end of file
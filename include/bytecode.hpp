@@ -0,0 +1,69 @@
+// bytecode.hpp
+// An on-disk format for compiled programs, so that a script can be run again
+// without being lexed, parsed and compiled. A file holds the top-level forms
+// of a program as stack machine code objects, together with their lambda
+// bodies, their side tables and the spelling of every name they use.
+//
+// The file is a sequence of 32-bit words in the byte order of the machine
+// that wrote it:
+//
+//   header   MAGIC VERSION OPCODE_COUNT symbolCount codeCount formCount
+//   symbols  symbolCount times: the length, then the characters padded to a
+//            whole word
+//   codes    codeCount times, every lambda body before the code that makes
+//            it: stackSize numLocals callSites, the lengths of instructions,
+//            constants, names, params, functions and upvalues, then those
+//            tables. Names and params are symbol indices, functions are code
+//            indices and an upvalue takes two words, isLocal and index.
+//   forms    formCount code indices, the top-level forms in order
+//
+// Loading maps the file and copies the instruction and constant words
+// straight into the code objects; the only other work is interning each
+// distinct name once. Files are trusted to come from save: the operands of
+// instructions are not checked against the tables they index.
+
+#ifndef BYTECODE_HPP
+#define BYTECODE_HPP
+
+#include "interpreter.hpp"
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace bytecode {
+constexpr uint32_t MAGIC = 0x43424c53; // "SLBC"
+// Bumped whenever the layout or the meaning of an instruction changes. Files
+// written with a different opcode set are rejected as well.
+constexpr uint32_t VERSION = 1;
+
+// The compiled top-level forms of a program, in order
+using Program = std::vector<std::shared_ptr<const interpreter::Code>>;
+
+// Parses source and compiles each of its top-level forms for the stack
+// machine. Throws a runtime_error on a syntax error.
+Program compile(std::string source);
+
+// The words of the file that save writes for program
+std::vector<uint32_t> serialize(const Program &program);
+
+// Rebuilds a program from data, which holds words in the format above and is
+// aligned to a word. Throws a runtime_error, naming data as what, if it is not
+// bytecode of this VERSION. The program does not refer to data once built.
+Program deserialize(std::string_view data, const std::string &what);
+
+// Writes program to path. Throws a runtime_error if it cannot be written.
+void save(const Program &program, const std::string &path);
+
+// Maps the file at path and rebuilds the program it holds. Throws a
+// runtime_error if the file cannot be read or is not a bytecode file of this
+// VERSION.
+Program load(const std::string &path);
+
+// Runs the forms of program one after the other. Returns the value of the
+// last form, or -1 if there are none.
+Value run(const Program &program, Environment &env);
+} // namespace bytecode
+
+#endif
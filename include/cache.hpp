@@ -0,0 +1,86 @@
+// cache.hpp
+// A compilation cache for scripts that are run over and over. Programs are
+// keyed by the SHA-256 of their source text and kept as bytecode (see
+// bytecode.hpp): in memory, in least recently used order up to a number of
+// bytes, and optionally as files in a directory, which outlive the process
+// and can be shared by several.
+//
+// Every lookup rebuilds the program from its bytecode, so callers get code
+// objects of their own, which they can run, and eval can quicken, while
+// other threads use the same entry. Rebuilding costs a copy of the words and
+// one interning per name, far less than lexing, parsing and compiling.
+
+#ifndef CACHE_HPP
+#define CACHE_HPP
+
+#include "bytecode.hpp"
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Definition of CompileCache
+// Safe to use from any number of threads. Two threads that miss on the same
+// source at once both compile it; the second result replaces the first.
+class CompileCache {
+public:
+  using Key = std::array<uint8_t, 32>;
+
+  struct Stats {
+    uint64_t hits = 0;      // found in memory
+    uint64_t diskHits = 0;  // found in the directory
+    uint64_t misses = 0;    // compiled
+    uint64_t evictions = 0; // dropped from memory to stay under the bound
+    size_t entries = 0;     // in memory now
+    size_t bytes = 0;       // of bytecode in memory now
+  };
+
+private:
+  // Shared, so that a lookup can rebuild a program after letting go of the
+  // lock even if the entry is evicted meanwhile
+  using Words = std::shared_ptr<const std::vector<uint32_t>>;
+  struct Entry {
+    Key key;
+    Words words;
+  };
+  struct KeyHash {
+    size_t operator()(const Key &key) const;
+  };
+
+  size_t maxBytes;
+  std::string directory;
+  mutable std::mutex mutex;
+  std::list<Entry> entries; // most recently used first
+  std::unordered_map<Key, std::list<Entry>::iterator, KeyHash> index;
+  Stats counts;
+
+  std::string path(const Key &key) const;
+  void insert(const Key &key, Words words);
+
+public:
+  // Keeps up to maxBytes of bytecode in memory and, unless directory is
+  // empty, a file per program in directory, which must exist
+  explicit CompileCache(size_t maxBytes, std::string directory = "");
+  CompileCache(const CompileCache &) = delete;
+  CompileCache &operator=(const CompileCache &) = delete;
+
+  // The compiled top-level forms of source, from the cache if it has them.
+  // Throws a runtime_error on a syntax error; failures are not cached.
+  bytecode::Program compile(std::string_view source);
+
+  Stats stats() const;
+  // Empties the memory tier; files and counters are kept
+  void clear();
+
+  // SHA-256 of source, and its spelling in hex, which names the file
+  static Key key(std::string_view source);
+  static std::string hex(const Key &key);
+};
+
+#endif
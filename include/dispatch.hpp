@@ -0,0 +1,42 @@
+// dispatch.hpp
+// The dispatch loop shared by the interpreters of the stack and the register
+// machine. Each loop names its current instruction ins, its instruction
+// pointer pc and, with computed gotos, its table of handlers dispatch_table.
+
+#ifndef DISPATCH_HPP
+#define DISPATCH_HPP
+
+#include "interpreter.hpp"
+
+#ifdef INTERP_STATS
+#define COUNT_DISPATCH() (interpreter::dispatchCount++)
+#else
+#define COUNT_DISPATCH() ((void)0)
+#endif
+
+// Dispatch is direct-threaded through a table of label addresses where the
+// compiler supports it (GCC and clang), and a plain switch otherwise. Define
+// INTERP_NO_COMPUTED_GOTO to force the switch. Every code object ends with a
+// return, so fetching needs no bounds check.
+//
+// A computed goto out of a handler does not run destructors, so handlers must
+// not have a Value (or anything else with a destructor) in scope when they
+// DISPATCH(); handlers that need such locals keep them in an inner block.
+#if defined(__GNUC__) && !defined(INTERP_NO_COMPUTED_GOTO)
+#define INTERP_COMPUTED_GOTO
+#endif
+
+#ifdef INTERP_COMPUTED_GOTO
+#define TARGET(op) TARGET_##op:
+#define DISPATCH()                                                             \
+  do {                                                                         \
+    ins = *pc++;                                                               \
+    COUNT_DISPATCH();                                                          \
+    goto *dispatch_table[static_cast<int>(ins.opCode())];                      \
+  } while (0)
+#else
+#define TARGET(op) case decltype(ins.opCode())::op:
+#define DISPATCH() continue
+#endif
+
+#endif
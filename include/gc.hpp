@@ -0,0 +1,118 @@
+// gc.hpp
+// The collector of reference cycles among heap objects. Values are reference
+// counted, which frees an object as soon as the last Value referring to it
+// goes, but not a closure that reaches itself through a cell, as one stored
+// in a variable it captures does:
+//
+//   (lambda (f n) (val f (lambda (i) (if i (f (- i 1)) n))))
+//
+// Every heap object is tracked in one of GENERATIONS generations of a Heap:
+// the heap of the thread that made it, or the one made current by a
+// Heap::Scope, such as the heap of an isolate (see isolate.hpp). An object
+// must only be used by one thread at a time, the one using its heap. A
+// collection of a generation and the younger ones subtracts the references
+// their objects hold to each other from their reference counts. Whatever is
+// left comes from outside: from the operand stacks and frames of the
+// machines, environments, older objects and host code. Those objects are the
+// roots; the ones not reachable from them are garbage, whose cycles are
+// broken so that reference counting frees them.
+//
+// New objects go into generation 0 and move up one generation every time
+// they survive a collection. Generation 0 is collected after every threshold
+// allocations, and each older generation after OLDER_EVERY collections of the
+// one below it, so objects that live long are looked at rarely.
+//
+// The collector neither allocates nor moves objects: they are made with new
+// and freed by reference counting, and the stacks are never scanned, since
+// the roots are found by what the counts leave over.
+
+#ifndef GC_HPP
+#define GC_HPP
+
+#include "ast.hpp"
+#include <cstddef>
+#include <cstdint>
+
+namespace gc {
+constexpr int GENERATIONS = 3;
+constexpr int OLDER_EVERY = 10;
+
+struct Stats {
+  size_t objects = 0; // tracked now
+  size_t bytes = 0;   // taken by them, not counting what they point to
+  uint64_t collections[GENERATIONS] = {}; // by oldest generation collected
+  uint64_t freed = 0;       // objects freed by collections
+  double lastPause = 0;     // seconds
+  double longestPause = 0;  // seconds
+  double totalPause = 0;    // seconds
+};
+
+// Definition of Heap
+// Nothing in a heap needs a destructor, so the heap of a thread stays usable
+// while other thread_locals, such as the stacks of the machines, release
+// their objects at thread exit. A heap that goes away before its objects do
+// must let go of them first.
+class Heap {
+private:
+  static constexpr int REACHABLE = -1;
+
+  HeapObject *generations[GENERATIONS] = {};
+  // Allocations since generation 0 was collected, then collections of the
+  // generation below since each older one was
+  int counts[GENERATIONS] = {};
+  bool collecting = false;
+  int threshold_ = 700;
+  Stats stats_;
+
+  void link(HeapObject *object, int generation);
+  static void unlink(HeapObject *object);
+  void track(HeapObject *object);
+  void untrack(HeapObject *object);
+
+  friend class ::HeapObject;
+
+public:
+  Heap() = default;
+  Heap(const Heap &) = delete;
+  Heap &operator=(const Heap &) = delete;
+
+  // See the functions below, which act on the current heap
+  size_t collect(int generation = GENERATIONS - 1);
+  const Stats &stats() const { return stats_; }
+  void setThreshold(int allocations) { threshold_ = allocations; }
+  int threshold() const { return threshold_; }
+
+  // Stops tracking the objects of the heap, which are never collected from
+  // then on and are freed when their last reference goes
+  void release();
+
+  // The heap that new objects of this thread are tracked in
+  static Heap &current();
+
+  // Makes heap current for the thread while it is alive
+  class Scope {
+  private:
+    Heap *previous;
+
+  public:
+    explicit Scope(Heap &heap);
+    ~Scope();
+    Scope(const Scope &) = delete;
+    Scope &operator=(const Scope &) = delete;
+  };
+};
+
+// Collects generation and the younger ones of the current heap and returns
+// the number of objects freed. By default the whole heap is collected.
+size_t collect(int generation = GENERATIONS - 1);
+
+// The current heap
+Stats stats();
+
+// Number of allocations in the current heap between collections of
+// generation 0; 0 turns automatic collection off
+void setThreshold(int allocations);
+int threshold();
+} // namespace gc
+
+#endif
@@ -2,18 +2,61 @@
 #define INTERPRETER_HPP
 
 #include "ast.hpp"
+#include <memory>
 #include <vector>
 
 namespace interpreter {
-using Code = std::vector<Instruction>;
+using Code = CodeObject;
 
-// Function to compile expression into bytecode
-Code compile(Expression& exp);
+// Folds constant subexpressions of exp before it is compiled
+std::unique_ptr<Expression> fold(std::unique_ptr<Expression> exp);
+
+// Function to compile expression into bytecode. exp is only read, and is
+// compiled as it is.
+Code compile(Expression &exp, CompileOptions options = CompileOptions());
+// Takes exp over and compiles it, folding it first if options say so
+Code compile(std::unique_ptr<Expression> exp,
+             CompileOptions options = CompileOptions());
+
+// Number of slots in the operand stack shared by all frames of a thread
+constexpr int STACK_SIZE = 1 << 16;
 
 // Function to evaluate bytecode
-ValueType eval(Code &bytecode, Environment &env);
+Value eval(const Code &bytecode, Environment &env);
+
+// Calls function, a Function or a Builtin, with args and returns its result.
+// Like eval, it must not be run by a builtin on the thread of the eval that
+// called the builtin.
+Value call(const Value &function, const std::vector<Value> &args,
+           Environment &env);
+
+// The machines a program can run on: the stack machine of eval, or the
+// register machine of evalRegisters (see register.hpp)
+enum class Engine { Stack, Register };
+
+// Compiles program for engine and runs it
+Value run(Expression &program, Environment &env,
+          Engine engine = Engine::Stack);
+
+// Maximum number of nested calls before eval throws instead of overflowing
+void setRecursionLimit(int limit);
+int recursionLimit();
+
+// Whether eval compiles hot function bodies to machine code (see jit.hpp).
+// Off unless INTERP_JIT is set to something other than 0.
+void setJitEnabled(bool enabled);
+bool jitEnabled();
+
+// Number of calls after which a function body is compiled
+void setJitThreshold(int calls);
+int jitThreshold();
+
+#ifdef INTERP_STATS
+// Number of instructions dispatched by eval on this thread since it started
+extern thread_local unsigned long long dispatchCount;
+#endif
 } // namespace interpreter
 
-// TODO: Add print functions for Expression and ValueType
+// TODO: Add print functions for Expression and Value
 
 #endif
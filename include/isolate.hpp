@@ -0,0 +1,78 @@
+// isolate.hpp
+// Independent interpreters for running many scripts at once. An isolate owns
+// the global bindings of the programs it runs and the heap their objects are
+// tracked in, so isolates on different threads share no mutable state and
+// take no locks. The stack is the one of the thread running the isolate:
+// eval runs to completion and leaves it empty, so a worker thread needs one
+// stack however many isolates it runs.
+//
+// Isolates can run the same compiled program without copying it once it is
+// shared. Sharing is a step of its own, taken once before the program is
+// handed to other threads. It strips the code objects of the caches eval
+// fills in while it runs, and undoes the calls it quickened, so that eval
+// only reads them:
+//
+//   bytecode::Program program = bytecode::compile(source);
+//   interpreter::share(program);
+//   // on any number of threads at once
+//   interpreter::Isolate isolate;
+//   Value result = isolate.run(program);
+//
+// Shared code is a little slower on one thread: it looks globals up by
+// hashing their names every time, and its calls are not quickened. Code the
+// calling thread may still be running, such as the body of a function
+// passed to a builtin, is not shared but copied, see sharedCopy.
+
+#ifndef ISOLATE_HPP
+#define ISOLATE_HPP
+
+#include "bytecode.hpp"
+#include "gc.hpp"
+#include "interpreter.hpp"
+
+namespace interpreter {
+// Makes the code of program, and every lambda body in it, safe to run on any
+// number of threads at once. Changes the code, so it must be called before
+// the program is handed to other threads and while no frame is running it;
+// calling it again on shared code does nothing, even while other threads run
+// it. With the JIT on, the bodies it supports are compiled now, since shared
+// code no longer counts its calls.
+void share(const bytecode::Program &program);
+void share(const Code &code);
+// Code with the same behaviour that is safe to run on any number of threads
+// at once: code itself if it is shared, otherwise a shared copy of it and of
+// its lambda bodies. code is only read, so the calling thread may be in the
+// middle of running it.
+std::shared_ptr<const Code> sharedCopy(const std::shared_ptr<const Code> &code);
+
+// Definition of Isolate
+// Used by one thread at a time, which is also the only one that may touch
+// the values it returns. Objects still referenced from outside when the
+// isolate is destroyed are let go by its heap and freed with their last
+// reference.
+class Isolate {
+private:
+  gc::Heap heap_;
+  Environment globals_;
+
+public:
+  Isolate() = default;
+  ~Isolate();
+  Isolate(const Isolate &) = delete;
+  Isolate &operator=(const Isolate &) = delete;
+
+  // Runs the forms of program one after the other on the calling thread.
+  // Returns the value of the last form, or -1 if there are none. Code that is
+  // not shared must not be run by another thread at the same time.
+  Value run(const bytecode::Program &program);
+  Value eval(const Code &code);
+  // Calls function, which has to be a value of this isolate, see call in
+  // interpreter.hpp
+  Value call(const Value &function, const std::vector<Value> &args);
+
+  Environment &globals() { return globals_; }
+  gc::Heap &heap() { return heap_; }
+};
+} // namespace interpreter
+
+#endif
@@ -0,0 +1,57 @@
+// jit.hpp
+// A baseline JIT for the stack machine. Once a function has been called often
+// enough, eval translates its body to x86-64 machine code, one template per
+// instruction: the operand stack becomes the native stack, and arithmetic,
+// jumps and local loads run as straight-line code with no dispatch.
+//
+// Only leaf bodies are compiled: the parameters, constants, arithmetic and
+// jumps, with no vals, calls, globals or closures. Whenever an operand is not
+// an integer the native code bails out, and eval runs the body again in the
+// interpreter, which raises the error. Such bodies have no side effects, so
+// running them twice is safe.
+//
+// The JIT exists on Linux x86-64 only; elsewhere compileNative always fails and
+// every function is interpreted.
+
+#ifndef JIT_HPP
+#define JIT_HPP
+
+#include "ast.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// Definition of NativeCode
+// Machine code in pages of its own, writable while it is copied in and then
+// executable only.
+class NativeCode {
+private:
+  void *memory;
+  size_t length;
+
+public:
+  // The code takes the locals of the frame and stores the result through
+  // its second argument. It returns false if it bailed out.
+  using Entry = bool (*)(const Value *locals, int32_t *result);
+
+  NativeCode(const std::vector<uint8_t> &bytes);
+  ~NativeCode();
+  NativeCode(const NativeCode &) = delete;
+  NativeCode &operator=(const NativeCode &) = delete;
+
+  size_t size() const { return length; }
+  bool call(const Value *locals, int32_t &result) const {
+    return reinterpret_cast<Entry>(memory)(locals, &result);
+  }
+};
+
+namespace interpreter {
+// Whether the JIT can translate the body of code
+bool jitSupports(const CodeObject &code);
+
+// Translates the body of code to machine code, or returns null if it cannot
+std::shared_ptr<const NativeCode> compileNative(const CodeObject &code);
+} // namespace interpreter
+
+#endif
@@ -1,5 +1,11 @@
+#ifndef LEXER_HPP
+#define LEXER_HPP
+
+#include "symbol.hpp"
 #include <iostream>
+#include <optional>
 #include <string>
+#include <string_view>
 #include <vector>
 
 enum class TokenType {
@@ -23,8 +29,9 @@ enum class TokenType {
 
 struct Token {
   TokenType token;
-  std::string value;
+  std::string_view value; // the lexeme, within the source of the Lexer
   int line;
+  Symbol symbol; // interned value of identifiers and keywords
 };
 
 // Overload << operator for TokenType
@@ -69,13 +76,36 @@ inline void printTokens(const std::vector<Token> &tokens) {
   }
 }
 
+// Definition of SourceFile
+// A file mapped read-only into memory. Its text stays valid, and can be lexed
+// in place, for as long as the SourceFile lives.
+class SourceFile {
+private:
+  void *data = nullptr;
+  size_t length = 0;
+
+public:
+  // Throws a runtime_error if the file cannot be opened or mapped
+  explicit SourceFile(const std::string &path);
+  ~SourceFile();
+  SourceFile(const SourceFile &) = delete;
+  SourceFile &operator=(const SourceFile &) = delete;
+
+  std::string_view text() const {
+    return std::string_view(static_cast<const char *>(data), length);
+  }
+};
+
+// Tokens refer to the characters of the source rather than copying them, so
+// they are only valid while the Lexer, or the SourceFile it reads, is alive.
 class Lexer {
 private:
   int start = 0;
   int current = 0;
   int line = 1;
-  std::string source;
-  std::vector<Token> tokens;
+  std::string owned;       // the source, if the Lexer was given a string
+  std::string_view source; // the text being lexed
+  std::optional<Token> pending; // the token lexToken produced, if any
   bool hadError = false;
 
   void lexToken();
@@ -83,17 +113,36 @@ private:
   bool match(char expected);
   char peek();
   void addToken(TokenType t);
-  void addToken(TokenType t, std::string value);
+  void addToken(TokenType t, std::string_view value);
+  void addToken(TokenType t, std::string_view value, Symbol symbol);
   bool isAtEnd();
   bool isDigit(char c);
   bool isAlpha(char c);
-  bool isAlphaNumeric(char c);
   void string();
   void number();
   void identifier();
 
+  // Lexes source, a piece of a larger text that starts on line
+  Lexer(std::string_view source, int line);
+
 public:
   Lexer(std::string source);
+  // Lexes the mapped text of file in place, without copying it
+  Lexer(const SourceFile &file);
+  Lexer(const Lexer &) = delete;
+  Lexer &operator=(const Lexer &) = delete;
+
+  // All the tokens of the source, ending with Eof
   std::vector<Token> lex();
+  // The same tokens as lex, lexed on up to threads threads (by default one per
+  // core). The source is split into chunks at newlines that are outside
+  // strings and comments and at paren depth 0, so every chunk holds whole
+  // top-level forms and starts on a known line. scan::setLevel must not be
+  // called while it runs.
+  std::vector<Token> lexParallel(unsigned threads = 0);
+  // The next token of the source, lexed on demand; Eof once it is used up
+  Token next();
   bool lexError();
-};
\ No newline at end of file
+};
+
+#endif
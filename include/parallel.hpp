@@ -0,0 +1,117 @@
+// parallel.hpp
+// Data-parallel builtins for scripts that apply a pure function to many
+// independent inputs, run on a pool of worker threads:
+//
+//   (pmap f n)                  a function of i, for i from 0 to n - 1, that
+//                               returns (f i), like a vector
+//   (preduce combine init f n)  init combined with (f 0) ... (f n - 1)
+//
+// Values are not shared between threads, so every worker runs in an isolate
+// of its own (see isolate.hpp) on copies of the functions it is given, of the
+// cells they capture and of the globals their code names. Their code is
+// copied once and shared by the workers (see sharedCopy), which leaves the
+// code of the caller as it is. Changes f makes to the variables it captures
+// stay in the copies; f and combine must return integers, and cannot call
+// pmap or preduce themselves.
+//
+// The n calls are split in halves down to chunks of at most grain(n) calls.
+// The chunks depend on n alone, not on the number of workers or on which
+// worker ran which, so the results are the same on any pool. pmap keeps them
+// in the order of i. preduce folds each chunk from its first call onwards,
+// then folds init with the results of the chunks in order, which is the left
+// fold of the calls whenever combine is associative.
+//
+// Only the stack machine calls builtins.
+
+#ifndef PARALLEL_HPP
+#define PARALLEL_HPP
+
+#include "ast.hpp"
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace parallel {
+// Definition of Pool
+// Worker threads that run loops over ranges of indices. Every worker has a
+// deque of ranges. It takes ranges from the back of its own and, once that is
+// empty, steals from the front of the others', where the largest ones are. A
+// range longer than the grain is split in halves: the upper half goes to the
+// back of the deque and the worker goes on with the lower half.
+class Pool {
+public:
+  // Called with the index of the worker and the range it is to run
+  using Body = std::function<void(unsigned worker, int begin, int end)>;
+
+private:
+  struct Range {
+    int begin;
+    int end;
+  };
+  struct Worker {
+    std::mutex mutex; // guards ranges
+    std::deque<Range> ranges;
+    std::thread thread;
+  };
+
+  std::vector<std::unique_ptr<Worker>> workers;
+  std::mutex running; // held by run, which runs one loop at a time
+
+  std::mutex mutex; // guards the fields below, and wakes the threads
+  std::condition_variable wake;
+  std::condition_variable idle; // ranges were pushed or the loop is done
+  std::condition_variable done;
+  uint64_t loop = 0; // number of loops started
+  bool stopping = false;
+  const Body *body = nullptr;
+  int grain = 1;
+  std::exception_ptr error;
+  int errorAt = 0; // the first index of the range that threw error
+
+  // Indices of the running loop whose calls have not returned
+  std::atomic<int> remaining{0};
+  // Ranges in all the deques, changed under the mutex of the deque
+  std::atomic<int> queued{0};
+
+  void work(unsigned index);
+  void push(unsigned index, Range range);
+  bool take(unsigned index, Range &range);
+
+public:
+  explicit Pool(unsigned threads);
+  ~Pool();
+  Pool(const Pool &) = delete;
+  Pool &operator=(const Pool &) = delete;
+
+  unsigned size() const { return workers.size(); }
+
+  // Calls body for ranges that cover 0 to n - 1 once, none longer than
+  // grain, and returns when every call has returned. If calls throw, the
+  // exception of the one whose range starts lowest is rethrown.
+  void run(int n, int grain, const Body &body);
+};
+
+// Number of workers of the pool of the builtins: INTERP_THREADS in the
+// environment, or one per core. The pool is made again when it changes, which
+// must not happen while a builtin is running.
+void setThreads(unsigned threads);
+unsigned threads();
+
+// The pool of the builtins
+Pool &pool();
+
+// The longest chunk n calls are split into
+int grain(int n);
+
+// Binds pmap and preduce in env
+void define(Environment &env);
+} // namespace parallel
+
+#endif
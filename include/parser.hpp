@@ -0,0 +1,59 @@
+// parser.hpp
+// A recursive descent parser from the tokens of a Lexer to the AST. It pulls
+// tokens one at a time and hands out one top-level form at a time, so a
+// program can be compiled and run form by form while the rest of it is still
+// being read, and only one form is ever held as tokens and nodes.
+//
+//   expression := number | identifier | "(" form ")"
+//   form       := ("+" | "-" | "*") expression expression+
+//               | "lambda" "(" identifier* ")" expression
+//               | expression+
+//
+// Arithmetic with more than two operands associates to the left. Every other
+// list is kept as an ExpressionList, which the compilers read as val, if or a
+// call.
+
+#ifndef PARSER_HPP
+#define PARSER_HPP
+
+#include "ast.hpp"
+#include "interpreter.hpp"
+#include "lexer.hpp"
+#include <memory>
+#include <string>
+
+class Parser {
+private:
+  Lexer &lexer;
+  Token current; // the next token, not consumed yet
+
+  void advance();
+  void expect(TokenType type, const std::string &message);
+  [[noreturn]] void error(const std::string &message) const;
+  std::unique_ptr<Expression> expression();
+  std::unique_ptr<Expression> form();
+  std::unique_ptr<Expression> arithmetic(char op);
+  std::unique_ptr<Expression> lambda();
+
+public:
+  Parser(Lexer &lexer);
+
+  // The next top-level form, or null once the source is used up. Throws a
+  // runtime_error on a syntax error.
+  std::unique_ptr<Expression> next();
+};
+
+namespace interpreter {
+// Parses source and runs its top-level forms one after the other on engine,
+// each in an arena of its own. Returns the value of the last form, or -1 if
+// there are none.
+Value runSource(std::string source, Environment &env,
+                Engine engine = Engine::Stack);
+
+// Like runSource, for the file at path. The file is mapped into memory and
+// lexed in place rather than read into a string.
+Value runFile(const std::string &path, Environment &env,
+              Engine engine = Engine::Stack);
+} // namespace interpreter
+
+#endif
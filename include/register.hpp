@@ -0,0 +1,207 @@
+// register.hpp
+// The register machine: a second backend that compiles the same AST to
+// three-address code and runs it in its own dispatch loop. Every frame owns a
+// window of registers: the parameters and vals of a lambda take the low
+// registers and temporaries come above them, so operands are read in place
+// rather than pushed and popped. `(+ a b)` on two locals is one ADD.
+
+#ifndef REGISTER_HPP
+#define REGISTER_HPP
+
+#include "ast.hpp"
+#include <memory>
+#include <memory_resource>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+// Available register opcodes. R[x] is register x of the running frame, K[x]
+// entry x of the constant pool.
+//
+//   MOVE A B            R[A] = R[B]
+//   LOAD_CONST A Bx     R[A] = K[Bx]
+//   LOAD_NAME A Bx      R[A] = the global names[Bx]
+//   STORE_NAME A Bx     the global names[Bx] = R[A]
+//   LOAD_UPVALUE A B    R[A] = the value of the function's upvalue B
+//   MAKE_CELL A         R[A] = a new cell holding R[A]
+//   LOAD_CELL A B       R[A] = the value of the cell in R[B]
+//   STORE_CELL A B      the value of the cell in R[A] = R[B]
+//   ADD A B C           R[A] = R[B] + R[C], and SUB and MUL alike
+//   ADD_CONST A B C     R[A] = R[B] + K[C], and SUB_CONST and MUL_CONST alike
+//   JUMP sBx            pc += sBx
+//   JUMP_IF_TRUE A sBx  if R[A] is not 0, pc += sBx
+//   MAKE_FUNCTION A Bx  R[A] = a closure over functions[Bx]
+//   CALL_FUNCTION A B   R[A] = R[A](R[A + 1], ..., R[A + B])
+//   TAIL_CALL A B       return R[A](R[A + 1], ..., R[A + B]), reusing the frame
+//   RETURN A            return R[A]
+//
+// An expression without a value, such as a val, reads as -1 where a value is
+// needed, which is what the stack machine returns for it.
+#define REGISTER_OPCODES(X)                                                    \
+  X(MOVE)                                                                      \
+  X(LOAD_CONST)                                                                \
+  X(LOAD_NAME)                                                                 \
+  X(STORE_NAME)                                                                \
+  X(LOAD_UPVALUE)                                                              \
+  X(MAKE_CELL)                                                                 \
+  X(LOAD_CELL)                                                                 \
+  X(STORE_CELL)                                                                \
+  X(ADD)                                                                       \
+  X(SUB)                                                                       \
+  X(MUL)                                                                       \
+  X(ADD_CONST)                                                                 \
+  X(SUB_CONST)                                                                 \
+  X(MUL_CONST)                                                                 \
+  X(JUMP)                                                                      \
+  X(JUMP_IF_TRUE)                                                              \
+  X(MAKE_FUNCTION)                                                             \
+  X(CALL_FUNCTION)                                                             \
+  X(TAIL_CALL)                                                                 \
+  X(RETURN)
+
+enum class RegOpCode {
+#define OPCODE_ENUM(op) op,
+  REGISTER_OPCODES(OPCODE_ENUM)
+#undef OPCODE_ENUM
+};
+
+std::ostream &operator<<(std::ostream &os, const RegOpCode &opCode);
+
+// Definition of RegisterInstruction
+// A 32-bit word: an 8-bit opcode and three 8-bit operands A, B and C. B and C
+// together also read as one 16-bit operand, unsigned as Bx and signed as sBx.
+class RegisterInstruction {
+private:
+  uint32_t word;
+
+public:
+  static constexpr int MAX_REGISTER = 0xff;
+
+  RegisterInstruction(RegOpCode op, int a, int b, int c);
+  // A and a 16-bit operand, either Bx or sBx
+  RegisterInstruction(RegOpCode op, int a, int bx);
+
+  RegOpCode opCode() const { return static_cast<RegOpCode>(word & 0xff); }
+  int a() const { return (word >> 8) & 0xff; }
+  int b() const { return (word >> 16) & 0xff; }
+  int c() const { return word >> 24; }
+  int bx() const { return word >> 16; }
+  int sbx() const { return static_cast<int32_t>(word) >> 16; }
+
+  bool operator==(const RegisterInstruction &other) const {
+    return word == other.word;
+  }
+
+  friend std::ostream &operator<<(std::ostream &os,
+                                  const RegisterInstruction &instr);
+};
+
+// Definition of RegisterCode
+// The register counterpart of CodeObject: the side tables are the same, and
+// instead of an operand stack depth it records the size of the register
+// window a frame needs.
+class RegisterCode {
+public:
+  std::vector<RegisterInstruction> instructions;
+  std::vector<int> constants;
+  std::vector<Symbol> names;
+  std::vector<Symbol> params;
+  std::vector<std::shared_ptr<const RegisterCode>> functions;
+  int numLocals = 0;    // registers of the parameters, then the vals
+  int numRegisters = 0; // the locals, then the temporaries
+  std::vector<Upvalue> upvalues;
+  mutable std::vector<NameCache> nameCaches; // by name, filled in by eval
+
+  size_t size() const { return instructions.size(); }
+  const RegisterInstruction &operator[](size_t i) const {
+    return instructions[i];
+  }
+
+  friend std::ostream &operator<<(std::ostream &os, const RegisterCode &code);
+};
+
+// Definition of RegisterFunction
+// A closure of the register machine. It is a different kind of heap object
+// than Function, so neither machine can call the functions of the other.
+class RegisterFunction : public HeapObject {
+public:
+  RegisterFunction(std::shared_ptr<const RegisterCode> code)
+      : HeapObject(Kind::RegisterFunction), code(std::move(code)) {}
+
+  std::shared_ptr<const RegisterCode> code;
+  std::vector<Value> upvalues; // cells, in the order of code->upvalues
+
+  void trace(Tracer &tracer) override {
+    for (const Value &upvalue : upvalues)
+      tracer.visit(upvalue);
+  }
+  void clear() override { upvalues.clear(); }
+};
+
+inline RegisterFunction *Value::asRegisterFunction() const {
+  return static_cast<RegisterFunction *>(object());
+}
+
+// Compiles an expression to register code. Names resolve as in the Compiler;
+// before a lambda is compiled its body is scanned for the vals it binds, which
+// get the registers after the parameters, and for the variables that nested
+// lambdas may capture, which are kept in cells.
+class RegisterCompiler : public ExpressionVisitor {
+private:
+  // As in the Compiler, the tables of a unit are allocated in an arena
+  struct Unit {
+    RegisterCode *code;
+    std::pmr::unordered_map<int, int> constantIndex;
+    std::pmr::unordered_map<Symbol, int> nameIndex;
+    std::pmr::unordered_map<Symbol, int> slots; // every binding of the lambda
+    std::pmr::unordered_map<Symbol, int> localIndex; // the ones bound so far
+    std::pmr::unordered_map<Symbol, int> upvalueIndex;
+    std::pmr::unordered_set<Symbol> captured;
+    int top = 0; // first free register
+
+    Unit(RegisterCode *code, std::pmr::memory_resource *memory)
+        : code(code), constantIndex(memory), nameIndex(memory), slots(memory),
+          localIndex(memory), upvalueIndex(memory), captured(memory) {}
+  };
+  Arena arena;
+  std::vector<Unit> units;
+
+  // The register a visit should leave its value in, or -1 for any, and the
+  // register the value ended up in, or -1 if the expression has none
+  int target = -1;
+  int result = -1;
+
+  void emit(RegisterInstruction ins);
+  int constant(int value);
+  int name(Symbol name);
+  int upvalue(int unit, Symbol name);
+  int allocate();
+  int dest();
+  int operand(Expression &exp);
+  void into(Expression &exp, int reg);
+  void call(const std::vector<std::unique_ptr<Expression>> &exps, bool tail);
+  void compileReturn(Expression &exp, bool inLambda);
+  int jump(RegOpCode op, int a);
+  void patch(int at);
+
+public:
+  // Compile a top-level expression into a new code object
+  RegisterCode compile(Expression &exp);
+
+  void visit(Constant &constant) override;
+  void visit(BinaryOperation &binaryOperation) override;
+  void visit(StringConstant &stringConstant) override;
+  void visit(ExpressionList &expressionList) override;
+  void visit(Lambda &lambda) override;
+};
+
+namespace interpreter {
+// Function to compile expression into register code
+RegisterCode compileRegisters(Expression &exp);
+
+// Function to evaluate register code. Shares the recursion limit and the
+// stack size of eval.
+Value evalRegisters(const RegisterCode &code, Environment &env);
+} // namespace interpreter
+
+#endif
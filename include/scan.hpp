@@ -0,0 +1,39 @@
+// scan.hpp
+// The inner loops of the Lexer: skipping runs of characters of one class. On
+// x86 they test 16 (SSE2) or 32 (AVX2) characters per step, falling back to a
+// character at a time near the end of the text and on other machines. The
+// widest level the CPU supports is picked at start-up.
+
+#ifndef SCAN_HPP
+#define SCAN_HPP
+
+#include <cstddef>
+
+namespace scan {
+enum class Level { Scalar, SSE2, AVX2 };
+
+// The level in use, and the widest one this CPU supports
+Level level();
+Level supported();
+
+// Switches to level, or to the widest supported one below it. Meant for tests
+// and benchmarks; it must not be called while other threads are lexing.
+void setLevel(Level level);
+
+// Each function scans text[from, end) and returns the index of the first
+// character that does not belong to the run, or end.
+
+// Spaces, tabs, carriage returns and newlines; adds the newlines to lines
+size_t whitespace(const char *text, size_t from, size_t end, int &lines);
+
+// Letters, digits and underscores
+size_t identifier(const char *text, size_t from, size_t end);
+
+// Decimal digits
+size_t digits(const char *text, size_t from, size_t end);
+
+// Anything up to the first c; adds the newlines skipped to lines
+size_t until(const char *text, size_t from, size_t end, char c, int &lines);
+} // namespace scan
+
+#endif
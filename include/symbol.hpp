@@ -0,0 +1,41 @@
+// symbol.hpp
+
+#ifndef SYMBOL_HPP
+#define SYMBOL_HPP
+
+#include <cstdint>
+#include <deque>
+#include <iostream>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+// An interned name. Every spelling of an identifier maps to one Symbol for
+// the lifetime of the process, so names compare and hash as integers and the
+// characters of each distinct name are stored once.
+enum class Symbol : uint32_t {};
+
+// Definition of SymbolTable
+// The process-wide table of interned names, safe to use from any thread.
+class SymbolTable {
+private:
+  std::shared_mutex mutex;
+  std::deque<std::string> names; // indexed by Symbol, never moves
+  std::unordered_map<std::string_view, Symbol> symbols;
+
+  static SymbolTable &instance();
+
+public:
+  // Symbol for name, adding it to the table if it is new
+  static Symbol intern(std::string_view name);
+
+  // Spelling of an interned symbol
+  static const std::string &name(Symbol symbol);
+};
+
+inline std::ostream &operator<<(std::ostream &os, Symbol symbol) {
+  return os << SymbolTable::name(symbol);
+}
+
+#endif // SYMBOL_HPP
@@ -0,0 +1,52 @@
+#include "../include/arena.hpp"
+#include "../include/ast.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <new>
+
+namespace {
+thread_local Arena *currentArena = nullptr;
+
+// Every node is preceded by the arena it came from, or null if it came from
+// the heap, so that delete knows whether to free it
+constexpr size_t NODE_HEADER = alignof(std::max_align_t);
+} // namespace
+
+void *Arena::do_allocate(size_t bytes, size_t alignment) {
+  uintptr_t at = (reinterpret_cast<uintptr_t>(next) + alignment - 1) &
+                 ~static_cast<uintptr_t>(alignment - 1);
+  if (next == nullptr || at + bytes > reinterpret_cast<uintptr_t>(end)) {
+    // Requests larger than a block get a block of their own
+    size_t size = std::max(blockSize, bytes + alignment);
+    blocks.push_back(std::unique_ptr<char[]>(new char[size]));
+    next = blocks.back().get();
+    end = next + size;
+    at = (reinterpret_cast<uintptr_t>(next) + alignment - 1) &
+         ~static_cast<uintptr_t>(alignment - 1);
+  }
+  next = reinterpret_cast<char *>(at + bytes);
+  used += bytes;
+  return reinterpret_cast<void *>(at);
+}
+
+Arena *Arena::current() { return currentArena; }
+
+Arena::Scope::Scope(Arena &arena) : previous(currentArena) {
+  currentArena = &arena;
+}
+
+Arena::Scope::~Scope() { currentArena = previous; }
+
+void *Expression::operator new(size_t size) {
+  Arena *arena = currentArena;
+  void *memory = arena ? arena->allocate(NODE_HEADER + size, NODE_HEADER)
+                       : ::operator new(NODE_HEADER + size);
+  *static_cast<Arena **>(memory) = arena;
+  return static_cast<char *>(memory) + NODE_HEADER;
+}
+
+void Expression::operator delete(void *node) {
+  void *memory = static_cast<char *>(node) - NODE_HEADER;
+  if (*static_cast<Arena **>(memory) == nullptr)
+    ::operator delete(memory);
+}
@@ -7,6 +7,20 @@ std::ostream &operator<<(std::ostream &os, Expression &expr) {
   return os;
 }
 
+const char *ExpressionList::malformed() const {
+  static const Symbol val = SymbolTable::intern("val");
+  static const Symbol if_ = SymbolTable::intern("if");
+
+  if (expressions.empty())
+    return "Empty list";
+  auto *head = dynamic_cast<const StringConstant *>(expressions[0].get());
+  if (head && head->getSymbol() == val && expressions.size() != 3)
+    return "Expected a name and a value after val";
+  if (head && head->getSymbol() == if_ && expressions.size() != 4)
+    return "Expected a condition and two arms after if";
+  return nullptr;
+}
+
 void PrintVisitor::visit(Constant &constant) { os << constant.getValue(); }
 
 void PrintVisitor::visit(StringConstant &stringConstant) {
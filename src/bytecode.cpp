@@ -0,0 +1,260 @@
+#include "../include/bytecode.hpp"
+#include "../include/arena.hpp"
+#include "../include/lexer.hpp"
+#include "../include/parser.hpp"
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+static_assert(sizeof(Instruction) == sizeof(uint32_t) &&
+                  std::is_trivially_copyable<Instruction>::value,
+              "instructions are stored as single words");
+static_assert(sizeof(int) == sizeof(uint32_t), "constants are single words");
+
+bytecode::Program bytecode::compile(std::string source) {
+  Lexer lexer(std::move(source));
+  Parser parser(lexer);
+  Program program;
+  while (true) {
+    Arena arena;
+    std::unique_ptr<Expression> form;
+    {
+      Arena::Scope scope(arena);
+      form = parser.next();
+    }
+    if (!form)
+      break;
+    program.push_back(std::make_shared<const interpreter::Code>(
+        interpreter::compile(std::move(form))));
+  }
+  return program;
+}
+
+namespace {
+// Flattens code objects into the words of a file
+class Writer {
+private:
+  std::vector<uint32_t> symbolWords;
+  std::vector<uint32_t> codeWords;
+  std::unordered_map<Symbol, uint32_t> symbols;
+  std::unordered_map<const CodeObject *, uint32_t> codes;
+
+public:
+  uint32_t symbol(Symbol symbol) {
+    auto found = symbols.find(symbol);
+    if (found != symbols.end())
+      return found->second;
+    const std::string &name = SymbolTable::name(symbol);
+    size_t start = symbolWords.size();
+    symbolWords.push_back(name.size());
+    symbolWords.resize(start + 1 + (name.size() + 3) / 4);
+    std::memcpy(symbolWords.data() + start + 1, name.data(), name.size());
+    uint32_t index = symbols.size();
+    symbols[symbol] = index;
+    return index;
+  }
+
+  // Index of code, writing its lambda bodies and then code itself if they are
+  // not in the file yet
+  uint32_t code(const CodeObject &code) {
+    auto found = codes.find(&code);
+    if (found != codes.end())
+      return found->second;
+    std::vector<uint32_t> functions;
+    for (const auto &function : code.functions)
+      functions.push_back(this->code(*function));
+
+    std::vector<uint32_t> &out = codeWords;
+    out.insert(out.end(),
+               {uint32_t(code.stackSize), uint32_t(code.numLocals),
+                uint32_t(code.callCaches.size()),
+                uint32_t(code.instructions.size()),
+                uint32_t(code.constants.size()), uint32_t(code.names.size()),
+                uint32_t(code.params.size()), uint32_t(functions.size()),
+                uint32_t(code.upvalues.size())});
+    // Quickened calls go back to the generic ones; the caches they relied on
+    // are not saved
+    for (Instruction ins : code.instructions) {
+      if (ins.opCode() == OpCode::CALL_KNOWN)
+        ins = Instruction(OpCode::CALL_FUNCTION, ins.first(), ins.second());
+      else if (ins.opCode() == OpCode::TAIL_CALL_KNOWN)
+        ins = Instruction(OpCode::TAIL_CALL, ins.first(), ins.second());
+      uint32_t word;
+      std::memcpy(&word, &ins, sizeof(word));
+      out.push_back(word);
+    }
+    for (int constant : code.constants)
+      out.push_back(constant);
+    for (Symbol name : code.names)
+      out.push_back(symbol(name));
+    for (Symbol param : code.params)
+      out.push_back(symbol(param));
+    out.insert(out.end(), functions.begin(), functions.end());
+    for (const Upvalue &upvalue : code.upvalues) {
+      out.push_back(upvalue.isLocal);
+      out.push_back(upvalue.index);
+    }
+
+    uint32_t index = codes.size();
+    codes[&code] = index;
+    return index;
+  }
+
+  std::vector<uint32_t> file(const std::vector<uint32_t> &forms) {
+    std::vector<uint32_t> words = {bytecode::MAGIC,
+                                   bytecode::VERSION,
+                                   uint32_t(OPCODE_COUNT),
+                                   uint32_t(symbols.size()),
+                                   uint32_t(codes.size()),
+                                   uint32_t(forms.size())};
+    words.insert(words.end(), symbolWords.begin(), symbolWords.end());
+    words.insert(words.end(), codeWords.begin(), codeWords.end());
+    words.insert(words.end(), forms.begin(), forms.end());
+    return words;
+  }
+};
+
+// Reads the words of a file, throwing if it ends too soon
+class Reader {
+private:
+  const uint32_t *next;
+  const uint32_t *end;
+  const std::string &what;
+
+public:
+  Reader(std::string_view text, const std::string &what)
+      : next(reinterpret_cast<const uint32_t *>(text.data())),
+        end(next + text.size() / sizeof(uint32_t)), what(what) {
+    if (text.size() % sizeof(uint32_t) != 0)
+      corrupt();
+  }
+
+  [[noreturn]] void corrupt() const {
+    throw std::runtime_error("Corrupt bytecode in " + what);
+  }
+
+  // The next count words
+  const uint32_t *take(size_t count) {
+    if (static_cast<size_t>(end - next) < count)
+      corrupt();
+    const uint32_t *words = next;
+    next += count;
+    return words;
+  }
+  uint32_t word() { return *take(1); }
+  // A word that must be below limit
+  uint32_t index(uint32_t limit) {
+    uint32_t value = word();
+    if (value >= limit)
+      corrupt();
+    return value;
+  }
+  bool atEnd() const { return next == end; }
+};
+} // namespace
+
+std::vector<uint32_t> bytecode::serialize(const Program &program) {
+  Writer writer;
+  std::vector<uint32_t> forms;
+  for (const auto &form : program)
+    forms.push_back(writer.code(*form));
+  return writer.file(forms);
+}
+
+void bytecode::save(const Program &program, const std::string &path) {
+  std::vector<uint32_t> words = serialize(program);
+  std::ofstream out(path, std::ios::binary | std::ios::trunc);
+  out.write(reinterpret_cast<const char *>(words.data()),
+            words.size() * sizeof(uint32_t));
+  // Closed before it is checked, as the last of the words may only be
+  // written then. A file that was cut short is not left behind.
+  out.close();
+  if (out.fail()) {
+    std::error_code error;
+    if (std::filesystem::is_regular_file(path, error))
+      std::filesystem::remove(path, error);
+    throw std::runtime_error("Unable to write " + path);
+  }
+}
+
+bytecode::Program bytecode::deserialize(std::string_view data,
+                                        const std::string &what) {
+  Reader in(data, what);
+  const uint32_t *header = in.take(6);
+  if (header[0] != MAGIC) {
+    throw std::runtime_error(what + " is not bytecode");
+  }
+  if (header[1] != VERSION || header[2] != uint32_t(OPCODE_COUNT)) {
+    throw std::runtime_error(what + " was written by another version");
+  }
+  uint32_t symbolCount = header[3];
+  uint32_t codeCount = header[4];
+  uint32_t formCount = header[5];
+
+  std::vector<Symbol> symbols;
+  for (uint32_t i = 0; i < symbolCount; i++) {
+    uint32_t length = in.word();
+    const char *name = reinterpret_cast<const char *>(
+        in.take((static_cast<size_t>(length) + 3) / 4));
+    symbols.push_back(SymbolTable::intern(std::string_view(name, length)));
+  }
+
+  std::vector<std::shared_ptr<CodeObject>> codes;
+  for (uint32_t i = 0; i < codeCount; i++) {
+    auto code = std::make_shared<CodeObject>();
+    const uint32_t *sizes = in.take(9);
+    code->stackSize = sizes[0];
+    code->numLocals = sizes[1];
+    code->callCaches.resize(sizes[2]);
+
+    const auto *instructions =
+        reinterpret_cast<const Instruction *>(in.take(sizes[3]));
+    code->instructions.assign(instructions, instructions + sizes[3]);
+    for (Instruction ins : code->instructions) {
+      if (static_cast<int>(ins.opCode()) >= OPCODE_COUNT)
+        in.corrupt();
+    }
+    const auto *constants = reinterpret_cast<const int *>(in.take(sizes[4]));
+    code->constants.assign(constants, constants + sizes[4]);
+    for (uint32_t j = 0; j < sizes[5]; j++)
+      code->names.push_back(symbols[in.index(symbolCount)]);
+    for (uint32_t j = 0; j < sizes[6]; j++)
+      code->params.push_back(symbols[in.index(symbolCount)]);
+    // Bodies come before the code that makes them
+    for (uint32_t j = 0; j < sizes[7]; j++)
+      code->functions.push_back(codes[in.index(i)]);
+    for (uint32_t j = 0; j < sizes[8]; j++) {
+      bool isLocal = in.word();
+      code->upvalues.push_back(Upvalue{isLocal, int(in.word())});
+    }
+
+    code->nameCaches.assign(code->names.size(), NameCache());
+    code->id = CodeObject::freshId();
+    codes.push_back(std::move(code));
+  }
+
+  Program program;
+  for (uint32_t i = 0; i < formCount; i++)
+    program.push_back(codes[in.index(codeCount)]);
+  if (!in.atEnd())
+    in.corrupt();
+  return program;
+}
+
+bytecode::Program bytecode::load(const std::string &path) {
+  SourceFile file(path);
+  return deserialize(file.text(), path);
+}
+
+Value bytecode::run(const Program &program, Environment &env) {
+  Value result(-1);
+  for (const auto &form : program)
+    result = interpreter::eval(*form, env);
+  return result;
+}
@@ -0,0 +1,240 @@
+#include "../include/cache.hpp"
+#include "../include/lexer.hpp"
+#include <atomic>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+// SHA-256, as specified in FIPS 180-4
+namespace {
+class Sha256 {
+private:
+  static constexpr uint32_t K[64] = {
+      0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+      0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+      0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+      0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+      0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+      0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+      0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+      0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+      0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+      0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+      0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+  uint32_t state[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                       0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+
+  static uint32_t rotate(uint32_t x, int n) {
+    return (x >> n) | (x << (32 - n));
+  }
+
+  void block(const uint8_t *data) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++) {
+      w[i] = uint32_t(data[4 * i]) << 24 | uint32_t(data[4 * i + 1]) << 16 |
+             uint32_t(data[4 * i + 2]) << 8 | uint32_t(data[4 * i + 3]);
+    }
+    for (int i = 16; i < 64; i++) {
+      uint32_t s0 = rotate(w[i - 15], 7) ^ rotate(w[i - 15], 18) ^
+                    (w[i - 15] >> 3);
+      uint32_t s1 = rotate(w[i - 2], 17) ^ rotate(w[i - 2], 19) ^
+                    (w[i - 2] >> 10);
+      w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+    for (int i = 0; i < 64; i++) {
+      uint32_t s1 = rotate(e, 6) ^ rotate(e, 11) ^ rotate(e, 25);
+      uint32_t choose = (e & f) ^ (~e & g);
+      uint32_t t1 = h + s1 + choose + K[i] + w[i];
+      uint32_t s0 = rotate(a, 2) ^ rotate(a, 13) ^ rotate(a, 22);
+      uint32_t majority = (a & b) ^ (a & c) ^ (b & c);
+      uint32_t t2 = s0 + majority;
+      h = g;
+      g = f;
+      f = e;
+      e = d + t1;
+      d = c;
+      c = b;
+      b = a;
+      a = t1 + t2;
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    state[5] += f;
+    state[6] += g;
+    state[7] += h;
+  }
+
+public:
+  CompileCache::Key digest(std::string_view text) {
+    const uint8_t *data = reinterpret_cast<const uint8_t *>(text.data());
+    size_t whole = text.size() / 64 * 64;
+    for (size_t i = 0; i < whole; i += 64)
+      block(data + i);
+
+    // The rest, a one bit, zeros and the length in bits fill one or two
+    // more blocks
+    uint8_t tail[128] = {};
+    size_t rest = text.size() - whole;
+    std::memcpy(tail, data + whole, rest);
+    tail[rest] = 0x80;
+    size_t blocks = rest + 9 <= 64 ? 1 : 2;
+    uint64_t bits = static_cast<uint64_t>(text.size()) * 8;
+    for (int i = 0; i < 8; i++)
+      tail[blocks * 64 - 1 - i] = uint8_t(bits >> (8 * i));
+    for (size_t i = 0; i < blocks; i++)
+      block(tail + 64 * i);
+
+    CompileCache::Key key;
+    for (int i = 0; i < 32; i++)
+      key[i] = uint8_t(state[i / 4] >> (24 - 8 * (i % 4)));
+    return key;
+  }
+};
+} // namespace
+
+CompileCache::Key CompileCache::key(std::string_view source) {
+  return Sha256().digest(source);
+}
+
+std::string CompileCache::hex(const Key &key) {
+  static const char digits[] = "0123456789abcdef";
+  std::string text;
+  for (uint8_t byte : key) {
+    text += digits[byte >> 4];
+    text += digits[byte & 0xf];
+  }
+  return text;
+}
+
+size_t CompileCache::KeyHash::operator()(const Key &key) const {
+  // The key is already a good hash
+  size_t hash;
+  std::memcpy(&hash, key.data(), sizeof(hash));
+  return hash;
+}
+
+CompileCache::CompileCache(size_t maxBytes, std::string directory)
+    : maxBytes(maxBytes), directory(std::move(directory)) {}
+
+std::string CompileCache::path(const Key &key) const {
+  return (std::filesystem::path(directory) / (hex(key) + ".lbc")).string();
+}
+
+// Called with the mutex held
+void CompileCache::insert(const Key &key, Words words) {
+  size_t bytes = words->size() * sizeof(uint32_t);
+  auto found = index.find(key);
+  if (found != index.end()) {
+    counts.bytes -= found->second->words->size() * sizeof(uint32_t);
+    entries.erase(found->second);
+    index.erase(found);
+  }
+  // A program bigger than the whole cache would only evict everything else
+  if (bytes > maxBytes)
+    return;
+  entries.push_front(Entry{key, std::move(words)});
+  index[key] = entries.begin();
+  counts.bytes += bytes;
+  while (counts.bytes > maxBytes) {
+    Entry &last = entries.back();
+    counts.bytes -= last.words->size() * sizeof(uint32_t);
+    index.erase(last.key);
+    entries.pop_back();
+    counts.evictions++;
+  }
+}
+
+static std::string_view text(const std::vector<uint32_t> &words) {
+  return std::string_view(reinterpret_cast<const char *>(words.data()),
+                          words.size() * sizeof(uint32_t));
+}
+
+bytecode::Program CompileCache::compile(std::string_view source) {
+  Key key = CompileCache::key(source);
+
+  Words words;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto found = index.find(key);
+    if (found != index.end()) {
+      entries.splice(entries.begin(), entries, found->second);
+      counts.hits++;
+      words = found->second->words;
+    }
+  }
+  if (words)
+    return bytecode::deserialize(text(*words), "the compile cache");
+
+  if (!directory.empty()) {
+    std::string file = path(key);
+    try {
+      SourceFile mapped(file);
+      bytecode::Program program = bytecode::deserialize(mapped.text(), file);
+      auto copy = std::make_shared<std::vector<uint32_t>>(
+          mapped.text().size() / sizeof(uint32_t));
+      std::memcpy(copy->data(), mapped.text().data(), mapped.text().size());
+      std::lock_guard<std::mutex> lock(mutex);
+      counts.diskHits++;
+      insert(key, std::move(copy));
+      return program;
+    } catch (const std::runtime_error &) {
+      // Not there yet, or left by another version: compiled and written anew
+    }
+  }
+
+  bytecode::Program program = bytecode::compile(std::string(source));
+  words = std::make_shared<std::vector<uint32_t>>(bytecode::serialize(program));
+  if (!directory.empty()) {
+    // Written under a name of its own and renamed into place, so that other
+    // threads and processes never map a partly written file. A directory that
+    // cannot be written to only loses the disk tier.
+    static std::atomic<uint64_t> writes{0};
+    std::string file = path(key);
+    std::string temporary = file + "." + std::to_string(getpid()) + "." +
+                            std::to_string(writes++) + ".tmp";
+    std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+    out.write(text(*words).data(), text(*words).size());
+    // Closed before it is checked, as the end of the file may only be
+    // written then
+    out.close();
+    bool written = !out.fail();
+    std::error_code error;
+    if (written)
+      std::filesystem::rename(temporary, file, error);
+    if (!written || error)
+      std::filesystem::remove(temporary, error);
+  }
+
+  std::lock_guard<std::mutex> lock(mutex);
+  counts.misses++;
+  insert(key, std::move(words));
+  return program;
+}
+
+CompileCache::Stats CompileCache::stats() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  Stats stats = counts;
+  stats.entries = entries.size();
+  return stats;
+}
+
+void CompileCache::clear() {
+  std::lock_guard<std::mutex> lock(mutex);
+  entries.clear();
+  index.clear();
+  counts.bytes = 0;
+}
@@ -1,40 +1,82 @@
 #include "../include/ast.hpp"
+#include <atomic>
 #include <stdexcept>
 #include <string>
 
-Environment::Environment() { Environment(Table(), nullptr); }
+// Shapes are unique across all environments of the process; 0 is never used,
+// so an empty NameCache never matches
+static uint64_t newShape() {
+  static std::atomic<uint64_t> next{1};
+  return next++;
+}
+
+Environment::Environment() : shape_(newShape()) {}
+
+Environment::Environment(Table env) : table(env), shape_(newShape()) {}
+
+Environment::Environment(const Environment &other)
+    : table(other.table), shape_(newShape()) {}
+
+Environment::Environment(Environment &&other)
+    : table(std::move(other.table)), shape_(newShape()) {
+  other.shape_ = newShape();
+}
+
+Environment &Environment::operator=(const Environment &other) {
+  table = other.table;
+  shape_ = newShape();
+  return *this;
+}
+
+Environment &Environment::operator=(Environment &&other) {
+  table = std::move(other.table);
+  shape_ = newShape();
+  other.shape_ = newShape();
+  return *this;
+}
 
-Environment::Environment(Table env, Environment *parent = nullptr)
-    : table(env), parent(parent) {}
+Value *Environment::find(Symbol name) {
+  auto it = table.find(name);
+  return it == table.end() ? nullptr : &it->second;
+}
 
-void Environment::define(std::string name, ValueType value) {
-  this->table.insert_or_assign(name, value);
+void Environment::define(Symbol name, Value value) {
+  this->table.insert_or_assign(name, std::move(value));
 }
 
-void Environment::assign(std::string name, ValueType value) {
+void Environment::define(const std::string &name, Value value) {
+  define(SymbolTable::intern(name), std::move(value));
+}
+
+void Environment::assign(Symbol name, Value value) {
   Table &env = resolve(name);
-  env.insert_or_assign(name, value);
+  env.insert_or_assign(name, std::move(value));
 }
 
-ValueType Environment::lookup(std::string name) {
+void Environment::assign(const std::string &name, Value value) {
+  assign(SymbolTable::intern(name), std::move(value));
+}
+
+Value Environment::lookup(Symbol name) {
   auto val = resolve(name).find(name);
   return val->second;
 }
 
-Table &Environment::resolve(std::string name) {
+Value Environment::lookup(const std::string &name) {
+  return lookup(SymbolTable::intern(name));
+}
+
+Table &Environment::resolve(Symbol name) {
   auto val = this->table.find(name);
   if (val != this->table.end()) {
     return this->table;
   }
 
-  if (this->parent == nullptr) {
-    throw std::runtime_error("Unable to resolve name");
-  }
-
-  return (*this->parent).resolve(name);
+  throw std::runtime_error("Unable to resolve name " +
+                           SymbolTable::name(name));
 }
 
-bool Environment::isDefined(std::string name) {
+bool Environment::isDefined(Symbol name) {
   try {
     resolve(name);
     return true;
@@ -43,39 +85,21 @@ bool Environment::isDefined(std::string name) {
   }
 }
 
-// Define << operator for ValueType
-std::ostream &operator<<(std::ostream &os, const ValueType &value) {
-  struct Printer : public boost::static_visitor<> {
-    std::ostream &os;
-
-    explicit Printer(std::ostream &_os) : os(_os) {}
-
-    void operator()(int i) const { os << i; }
-
-    void operator()(const std::string &s) const { os << s; }
-
-    void operator()(const std::vector<std::string> &vec) const {
-      os << "[ ";
-      for (const auto &str : vec) {
-        os << str << " ";
-      }
-      os << "]";
-    }
-
-    void operator()(const std::shared_ptr<Function> &func) const {
-      os << *func;
-    }
-
-    void operator()(const boost::recursive_wrapper<std::vector<Instruction>>
-                        &wrapper) const {
-      os << "Vector of Instructions: ";
-      for (const auto &inst : wrapper.get()) {
-        os << inst << " ";
-      }
-    }
-  };
+bool Environment::isDefined(const std::string &name) {
+  return isDefined(SymbolTable::intern(name));
+}
 
-  boost::apply_visitor(Printer(os), value);
+// Define << operator for Value
+std::ostream &operator<<(std::ostream &os, const Value &value) {
+  if (value.isInt()) {
+    os << value.asInt();
+  } else if (value.isFunction()) {
+    os << *value.asFunction();
+  } else if (value.isRegisterFunction()) {
+    os << "RegisterFunction";
+  } else if (value.isBuiltin()) {
+    os << "Builtin {" << value.asBuiltin()->name << "}";
+  }
   return os;
 }
 
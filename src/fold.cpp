@@ -0,0 +1,75 @@
+#include "../include/ast.hpp"
+#include "../include/interpreter.hpp"
+#include <memory>
+#include <utility>
+
+std::unique_ptr<Expression> interpreter::fold(std::unique_ptr<Expression> exp) {
+  ConstantFolder folder;
+  return folder.run(std::move(exp));
+}
+
+std::unique_ptr<Expression>
+ConstantFolder::run(std::unique_ptr<Expression> exp) {
+  fold(exp);
+  return exp;
+}
+
+// Fold the subtree in exp, replacing it if it simplifies
+void ConstantFolder::fold(std::unique_ptr<Expression> &exp) {
+  replacement.reset();
+  exp->accept(*this);
+  if (replacement)
+    exp = std::move(replacement);
+}
+
+void ConstantFolder::visit(Constant &) {}
+
+void ConstantFolder::visit(StringConstant &) {}
+
+void ConstantFolder::visit(BinaryOperation &binOp) {
+  fold(binOp.getLeftPtr());
+  fold(binOp.getRightPtr());
+
+  auto *left = dynamic_cast<Constant *>(binOp.getLeftPtr().get());
+  auto *right = dynamic_cast<Constant *>(binOp.getRightPtr().get());
+  if (!left || !right)
+    return;
+
+  // Same wrapping arithmetic as the interpreter
+  Value a(left->getValue());
+  Value b(right->getValue());
+  switch (binOp.getOperator()) {
+  case '+':
+    replacement = std::make_unique<Constant>(Value::add(a, b).asInt());
+    break;
+  case '-':
+    replacement = std::make_unique<Constant>(Value::sub(a, b).asInt());
+    break;
+  case '*':
+    replacement = std::make_unique<Constant>(Value::mul(a, b).asInt());
+    break;
+  }
+}
+
+void ConstantFolder::visit(ExpressionList &list) {
+  auto &exps = list.getExpressions();
+  for (auto &exp : exps) {
+    fold(exp);
+  }
+
+  static const Symbol if_ = SymbolTable::intern("if");
+  if (exps.size() != 4)
+    return;
+  auto *head = dynamic_cast<StringConstant *>(exps[0].get());
+  if (!head || head->getSymbol() != if_)
+    return;
+
+  // Any non-zero integer is true
+  auto *cond = dynamic_cast<Constant *>(exps[1].get());
+  if (cond)
+    replacement = std::move(exps[cond->getValue() ? 2 : 3]);
+}
+
+void ConstantFolder::visit(Lambda &lambda) {
+  fold(lambda.getBodyPtr());
+}
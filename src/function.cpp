@@ -1,22 +1,16 @@
 #include "../include/ast.hpp"
 
-Function::Function(std::vector<std::string> params,
-                   std::vector<Instruction> body, Environment env)
-    : params(params), body(body), env(env) {}
+Function::Function(std::shared_ptr<const CodeObject> code)
+    : HeapObject(Kind::Function), code(code) {}
+
+void Function::trace(Tracer &tracer) {
+  for (const Value &upvalue : upvalues)
+    tracer.visit(upvalue);
+}
 
 std::ostream &operator<<(std::ostream &os, const Function &f) {
   os << "Function {";
-  os << "params: ";
-  for (const auto &param : f.params) {
-    os << param << ", ";
-  }
-  os << "body: ";
-  for (const auto &inst : f.body) {
-    os << inst << ", ";
-  }
-  os << "env: " << f.env;
+  os << "code: " << *f.code;
   os << "}";
   return os;
-
-  return os;
 }
\ No newline at end of file
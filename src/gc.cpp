@@ -0,0 +1,207 @@
+#include "../include/gc.hpp"
+#include "../include/register.hpp"
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+namespace gc {
+namespace {
+// Both are trivially destructible, see Heap
+thread_local Heap threadHeap;
+thread_local Heap *currentHeap = nullptr;
+
+// The bytes an object of kind takes, not counting what it points to
+size_t sizeOf(HeapObject::Kind kind) {
+  switch (kind) {
+  case HeapObject::Kind::Function:
+    return sizeof(Function);
+  case HeapObject::Kind::Cell:
+    return sizeof(Cell);
+  case HeapObject::Kind::RegisterFunction:
+    return sizeof(RegisterFunction);
+  case HeapObject::Kind::Builtin:
+    return sizeof(Builtin);
+  }
+  return 0;
+}
+} // namespace
+
+Heap &Heap::current() { return currentHeap ? *currentHeap : threadHeap; }
+
+Heap::Scope::Scope(Heap &heap) : previous(currentHeap) { currentHeap = &heap; }
+
+Heap::Scope::~Scope() { currentHeap = previous; }
+
+void Heap::link(HeapObject *object, int generation) {
+  HeapObject *&head = generations[generation];
+  object->generation = generation;
+  object->gcPrev = &head;
+  object->gcNext = head;
+  if (head)
+    head->gcPrev = &object->gcNext;
+  head = object;
+}
+
+void Heap::unlink(HeapObject *object) {
+  if (!object->gcPrev)
+    return;
+  *object->gcPrev = object->gcNext;
+  if (object->gcNext)
+    object->gcNext->gcPrev = object->gcPrev;
+  object->gcPrev = nullptr;
+  object->gcNext = nullptr;
+}
+
+// Tracks a new object, collecting first if it is time to
+void Heap::track(HeapObject *object) {
+  if (threshold_ > 0 && ++counts[0] > threshold_ && !collecting) {
+    int generation = 0;
+    while (generation + 1 < GENERATIONS &&
+           counts[generation + 1] >= OLDER_EVERY)
+      generation++;
+    collect(generation);
+  }
+  object->heap = this;
+  link(object, 0);
+  stats_.objects++;
+  stats_.bytes += sizeOf(object->kind);
+}
+
+void Heap::untrack(HeapObject *object) {
+  unlink(object);
+  object->heap = nullptr;
+  stats_.objects--;
+  stats_.bytes -= sizeOf(object->kind);
+}
+
+void Heap::release() {
+  for (HeapObject *&head : generations) {
+    while (head)
+      untrack(head);
+  }
+}
+
+size_t Heap::collect(int oldest) {
+  if (oldest < 0 || oldest >= GENERATIONS)
+    oldest = GENERATIONS - 1;
+  if (collecting)
+    return 0;
+  collecting = true;
+  auto start = std::chrono::steady_clock::now();
+
+  // The younger generations join the oldest one collected, so an object is
+  // part of the collection if it is in a generation up to oldest
+  std::vector<HeapObject *> objects;
+  for (int generation = 0; generation <= oldest; generation++) {
+    for (HeapObject *object = generations[generation]; object;
+         object = object->gcNext)
+      objects.push_back(object);
+  }
+
+  // References from outside the collection are what remains of the counts
+  // once the ones between its objects are taken off. An object that is not
+  // referenced at all is still being built, and is kept. Objects of other
+  // heaps are never part of the collection.
+  for (HeapObject *object : objects)
+    object->gcRefs = object->refCount == 0 ? 1 : object->refCount;
+  struct Subtract : Tracer {
+    Heap *heap;
+    int oldest;
+    Subtract(Heap *heap, int oldest) : heap(heap), oldest(oldest) {}
+    void visit(HeapObject *object) override {
+      if (object->heap == heap && object->generation <= oldest)
+        object->gcRefs--;
+    }
+  } subtract(this, oldest);
+  for (HeapObject *object : objects)
+    object->trace(subtract);
+
+  // Everything reachable from an object referenced from outside is live
+  struct Mark : Tracer {
+    Heap *heap;
+    int oldest;
+    std::vector<HeapObject *> pending;
+    Mark(Heap *heap, int oldest) : heap(heap), oldest(oldest) {}
+    void visit(HeapObject *object) override {
+      if (object->heap == heap && object->generation <= oldest &&
+          object->gcRefs != REACHABLE) {
+        object->gcRefs = REACHABLE;
+        pending.push_back(object);
+      }
+    }
+  } mark(this, oldest);
+  for (HeapObject *object : objects) {
+    if (object->gcRefs > 0) {
+      object->gcRefs = REACHABLE;
+      mark.pending.push_back(object);
+    }
+  }
+  while (!mark.pending.empty()) {
+    HeapObject *object = mark.pending.back();
+    mark.pending.pop_back();
+    object->trace(mark);
+  }
+
+  // The rest only refer to each other. Holding a reference to each keeps
+  // them all alive while their cycles are broken; dropping it frees them.
+  std::vector<HeapObject *> garbage;
+  for (HeapObject *object : objects) {
+    if (object->gcRefs != REACHABLE)
+      garbage.push_back(object);
+  }
+  for (HeapObject *object : garbage)
+    object->refCount++;
+  for (HeapObject *object : garbage)
+    object->clear();
+  for (HeapObject *object : garbage) {
+    if (--object->refCount == 0)
+      delete object;
+  }
+
+  // The survivors move up a generation
+  int next = oldest + 1 < GENERATIONS ? oldest + 1 : oldest;
+  for (int generation = 0; generation <= oldest; generation++) {
+    HeapObject *object = generations[generation];
+    generations[generation] = nullptr;
+    while (object) {
+      HeapObject *following = object->gcNext;
+      link(object, next);
+      object = following;
+    }
+  }
+
+  for (int generation = 0; generation <= oldest; generation++)
+    counts[generation] = 0;
+  if (oldest + 1 < GENERATIONS)
+    counts[oldest + 1]++;
+  double pause = std::chrono::duration<double>(
+                     std::chrono::steady_clock::now() - start)
+                     .count();
+  stats_.collections[oldest]++;
+  stats_.freed += garbage.size();
+  stats_.lastPause = pause;
+  stats_.longestPause = std::max(stats_.longestPause, pause);
+  stats_.totalPause += pause;
+  collecting = false;
+  return garbage.size();
+}
+
+size_t collect(int generation) { return Heap::current().collect(generation); }
+
+Stats stats() { return Heap::current().stats(); }
+
+void setThreshold(int allocations) {
+  Heap::current().setThreshold(allocations);
+}
+
+int threshold() { return Heap::current().threshold(); }
+} // namespace gc
+
+HeapObject::HeapObject(Kind kind) : kind(kind) {
+  gc::Heap::current().track(this);
+}
+
+HeapObject::~HeapObject() {
+  if (heap)
+    heap->untrack(this);
+}
@@ -1,84 +1,90 @@
 #include "../include/ast.hpp"
+#include <atomic>
 #include <iostream>
 #include <memory>
+#include <stdexcept>
 
 // Overload the << operator for the OpCode enum class
 std::ostream &operator<<(std::ostream &os, const OpCode &opCode) {
   switch (opCode) {
-  case OpCode::LOAD_CONST:
-    os << "LOAD_CONST";
-    break;
-  case OpCode::STORE_NAME:
-    os << "STORE_NAME";
-    break;
-  case OpCode::LOAD_NAME:
-    os << "LOAD_NAME";
-    break;
-  case OpCode::RELATIVE_JUMP:
-    os << "RELATIVE_JUMP";
-    break;
-  case OpCode::RELATIVE_JUMP_IF_TRUE:
-    os << "RELATIVE_JUMP_IF_TRUE";
-    break;
-  case OpCode::MAKE_FUNCTION:
-    os << "MAKE_FUNCTION";
-    break;
-  case OpCode::CALL_FUNCTION:
-    os << "CALL_FUNCTION";
-    break;
-  case OpCode::ADD:
-    os << "ADD";
-    break;
-  case OpCode::SUB:
-    os << "SUB";
-    break;
-  case OpCode::MUL:
-    os << "MUL";
+#define OPCODE_NAME(op)                                                        \
+  case OpCode::op:                                                             \
+    os << #op;                                                                 \
     break;
+    OPCODES(OPCODE_NAME)
+#undef OPCODE_NAME
   }
   return os;
 }
 
-Instruction::Instruction(OpCode op, ValueType arg) : opCode(op), arg(arg) {}
+Instruction::Instruction(OpCode op, int arg) {
+  if (arg < MIN_ARG || arg > MAX_ARG) {
+    throw std::runtime_error("Instruction operand out of range");
+  }
+  word = (static_cast<uint32_t>(arg) << 8) | static_cast<uint32_t>(op);
+}
 
-bool Instruction::operator==(const Instruction &other) const {
-  return (this->opCode == other.opCode) && (this->arg == other.arg);
+Instruction::Instruction(OpCode op, int first, int second) {
+  if (!fits(first, second)) {
+    throw std::runtime_error("Instruction operand out of range");
+  }
+  word = (static_cast<uint32_t>(second) << 16) |
+         (static_cast<uint32_t>(first) << 8) | static_cast<uint32_t>(op);
 }
 
-// Define the InstructionPrinter visitor
-struct InstructionPrinter : public boost::static_visitor<void> {
-  std::ostream &os_;
+bool Instruction::operator==(const Instruction &other) const {
+  return this->word == other.word;
+}
 
-  InstructionPrinter(std::ostream &os) : os_(os) {}
+std::ostream &operator<<(std::ostream &os, const Instruction &instr) {
+  os << "Instruction(opCode=" << instr.opCode() << ", arg=" << instr.arg()
+     << ")";
+  return os;
+}
 
-  void operator()(const int &i) const { os_ << "int: " << i; }
+uint64_t CodeObject::freshId() {
+  static std::atomic<uint64_t> next{1};
+  return next++;
+}
 
-  void operator()(const std::string &s) const { os_ << "std::string: " << s; }
+void CodeObject::clear() {
+  instructions.clear();
+  constants.clear();
+  names.clear();
+  params.clear();
+  functions.clear();
+  stackSize = 0;
+  numLocals = 0;
+  upvalues.clear();
+  nameCaches.clear();
+  callCaches.clear();
+  jit = JitState();
+  shared.set = false;
+  id = 0;
+}
 
-  void operator()(const std::vector<std::string> &v) const {
-    os_ << "[";
-    for (const auto &param : v) {
-      os_ << param << ", ";
-    }
-    os_ << "]";
+std::ostream &operator<<(std::ostream &os, const CodeObject &code) {
+  os << "CodeObject {locals: " << code.numLocals
+     << ", upvalues: " << code.upvalues.size() << ", params: [";
+  for (const auto &param : code.params) {
+    os << param << ", ";
   }
-
-  void operator()(const std::shared_ptr<Function> ptr) const {
-    os_ << ptr.get();
+  os << "], constants: [";
+  for (const auto &constant : code.constants) {
+    os << constant << ", ";
   }
-
-  void operator()(const std::vector<Instruction> &instructions) const {
-    os_ << "Instructions: [";
-    for (const auto &instr : instructions) {
-      os_ << instr << " ";
-    }
-    os_ << "]\n";
+  os << "], names: [";
+  for (const auto &name : code.names) {
+    os << name << ", ";
   }
-};
-
-std::ostream &operator<<(std::ostream &os, const Instruction &instr) {
-  os << "Instruction(opCode=" << instr.opCode << ", arg=";
-  boost::apply_visitor(InstructionPrinter(os), instr.arg);
-  os << ")";
+  os << "], instructions: [";
+  for (const auto &instr : code.instructions) {
+    os << instr << ", ";
+  }
+  os << "], functions: [";
+  for (const auto &function : code.functions) {
+    os << *function << ", ";
+  }
+  os << "]}";
   return os;
 }
@@ -1,7 +1,9 @@
 #include "../include/interpreter.hpp"
 #include "../include/ast.hpp"
+#include "../include/dispatch.hpp"
+#include "../include/jit.hpp"
+#include "../include/register.hpp"
 #include <memory>
-#include <stack>
 #include <stdexcept>
 #include <string>
 #include <unordered_map>
@@ -11,252 +13,905 @@
 //   Compiler compiler;
 // }
 
-interpreter::Code interpreter::compile(Expression &e) {
-  Compiler compiler;
-  return e.accept(compiler);
+interpreter::Code interpreter::compile(Expression &e,
+                                       CompileOptions options) {
+  Compiler compiler(options);
+  return compiler.compile(e);
 }
 
-std::vector<Instruction> Compiler::visit(Constant &constant) {
-  std::vector<Instruction> ins;
-  ins.push_back(Instruction(OpCode::LOAD_CONST, constant.getValue()));
-  return ins;
+interpreter::Code interpreter::compile(std::unique_ptr<Expression> exp,
+                                       CompileOptions options) {
+  if (options.fold)
+    exp = fold(std::move(exp));
+  return compile(*exp, options);
 }
 
-std::vector<Instruction> Compiler::visit(StringConstant &constant) {
-  std::vector<Instruction> ins;
-  ins.push_back(Instruction(OpCode::LOAD_NAME, constant.getValue()));
-  return ins;
+Value interpreter::run(Expression &program, Environment &env, Engine engine) {
+  if (engine == Engine::Register) {
+    return evalRegisters(compileRegisters(program), env);
+  }
+  return eval(compile(program), env);
 }
 
-std::vector<Instruction> Compiler::visit(BinaryOperation &binOp) {
-  std::vector<Instruction> ins;
+CodeObject Compiler::compile(Expression &exp) {
+  CodeObject code;
+  units.push_back(Unit(&code, &arena));
+  exp.accept(*this);
+  finish(code);
+  units.pop_back();
+  return code;
+}
 
-  char op = binOp.getOperator();
-  std::vector<Instruction> left_compiled = binOp.getLeft().accept(*this);
-  std::vector<Instruction> right_compiled = binOp.getRight().accept(*this);
-  ins.insert(ins.end(), left_compiled.begin(), left_compiled.end());
-  ins.insert(ins.end(), right_compiled.begin(), right_compiled.end());
+// Net effect of an instruction on the depth of the operand stack
+static int stackEffect(Instruction ins) {
+  switch (ins.opCode()) {
+  case OpCode::LOAD_CONST:
+  case OpCode::LOAD_NAME:
+  case OpCode::LOAD_LOCAL:
+  case OpCode::LOAD_CELL:
+  case OpCode::LOAD_UPVALUE:
+  case OpCode::MAKE_FUNCTION:
+    return 1;
+  case OpCode::LOAD_LOCAL_LOCAL:
+    return 2;
+  case OpCode::RELATIVE_JUMP:
+  case OpCode::MAKE_CELL:
+  case OpCode::ADD_CONST:
+  case OpCode::SUB_CONST:
+  case OpCode::MUL_CONST:
+  case OpCode::ADD_LOCAL:
+  case OpCode::SUB_LOCAL:
+  case OpCode::MUL_LOCAL:
+  case OpCode::ADD_NAME:
+  case OpCode::SUB_NAME:
+  case OpCode::MUL_NAME:
+  case OpCode::JUMP_IF_LOCAL:
+    return 0;
+  case OpCode::CALL_FUNCTION:
+  case OpCode::TAIL_CALL:
+  case OpCode::CALL_KNOWN:
+  case OpCode::TAIL_CALL_KNOWN:
+    // Pops the callee and the arguments, pushes the result
+    return -ins.first();
+  default:
+    return -1;
+  }
+}
 
-  if (op == '+') {
-    Instruction add(OpCode::ADD, 0);
-    ins.push_back(add);
+// Terminates the body of a code object with RETURN, optimizes it and records
+// the deepest the operand stack can get while running it, following both
+// successors of every conditional jump.
+void Compiler::finish(CodeObject &code) {
+  code.instructions.push_back(Instruction(OpCode::RETURN, 0));
+  if (options.peephole)
+    peephole(code.instructions);
+  code.nameCaches.assign(code.names.size(), NameCache());
+  code.id = CodeObject::freshId();
+
+  std::vector<int> depth(code.size(), -1);
+  std::vector<int> worklist = {0};
+  depth[0] = 0;
+  while (!worklist.empty()) {
+    int pc = worklist.back();
+    worklist.pop_back();
+
+    Instruction instr = code[pc];
+    int after = depth[pc] + stackEffect(instr);
+    code.stackSize = std::max(code.stackSize, std::max(depth[pc], after));
+
+    std::vector<int> successors;
+    switch (instr.opCode()) {
+    case OpCode::RETURN:
+    case OpCode::TAIL_CALL:
+    case OpCode::TAIL_CALL_KNOWN:
+      break;
+    case OpCode::RELATIVE_JUMP:
+      successors = {pc + 1 + instr.arg()};
+      break;
+    case OpCode::RELATIVE_JUMP_IF_TRUE:
+      successors = {pc + 1, pc + 1 + instr.arg()};
+      break;
+    case OpCode::JUMP_IF_LOCAL:
+      successors = {pc + 1, pc + 1 + instr.second()};
+      break;
+    default:
+      successors = {pc + 1};
+      break;
+    }
 
-  } else if (op == '-') {
-    Instruction sub(OpCode::SUB, 0);
-    ins.push_back(sub);
+    for (int next : successors) {
+      if (depth[next] == -1) {
+        depth[next] = after;
+        worklist.push_back(next);
+      }
+    }
+  }
+}
 
-  } else if (op == '*') {
-    Instruction mul(OpCode::MUL, 0);
-    ins.push_back(mul);
+// Turns calls whose result is returned straight away, possibly after jumping
+// out of an arm of an if, into TAIL_CALLs. The body ends where finish will
+// append its RETURN.
+static void markTailCalls(std::vector<Instruction> &ins) {
+  int end = ins.size();
+  for (int pc = 0; pc < end; pc++) {
+    if (ins[pc].opCode() != OpCode::CALL_FUNCTION)
+      continue;
+
+    // Jumps emitted by the compiler only go forward
+    int next = pc + 1;
+    while (next < end && ins[next].opCode() == OpCode::RELATIVE_JUMP)
+      next += 1 + ins[next].arg();
+    if (next == end)
+      ins[pc] = Instruction(OpCode::TAIL_CALL, ins[pc].first(),
+                            ins[pc].second());
   }
+}
+
+// Index of value in the constant pool of the innermost code object
+int Compiler::constant(int value) {
+  Unit &unit = units.back();
+  auto it = unit.constantIndex.find(value);
+  if (it != unit.constantIndex.end())
+    return it->second;
+
+  int index = unit.code->constants.size();
+  unit.code->constants.push_back(value);
+  unit.constantIndex.insert({value, index});
+  return index;
+}
+
+// Index of name in the name table of the innermost code object
+int Compiler::name(Symbol name) {
+  Unit &unit = units.back();
+  auto it = unit.nameIndex.find(name);
+  if (it != unit.nameIndex.end())
+    return it->second;
+
+  int index = unit.code->names.size();
+  unit.code->names.push_back(name);
+  unit.nameIndex.insert({name, index});
+  return index;
+}
+
+// Slot of a variable bound in the innermost lambda, allocated on first use
+int Compiler::declareLocal(Symbol name) {
+  Unit &unit = units.back();
+  auto it = unit.localIndex.find(name);
+  if (it != unit.localIndex.end())
+    return it->second;
+
+  int slot = unit.code->numLocals++;
+  unit.localIndex.insert({name, slot});
+  unit.captured.push_back(false);
+  return slot;
+}
+
+// Index of the upvalue through which the lambda of units[unit] reaches a
+// variable bound in an enclosing lambda, or -1 if there is none. Resolving it
+// adds the upvalue to every lambda in between and marks the variable captured.
+int Compiler::upvalue(int unit, Symbol name) {
+  // The outermost unit is the top level, whose bindings are globals
+  if (unit <= 1)
+    return -1;
+
+  Unit &current = units[unit];
+  auto cached = current.upvalueIndex.find(name);
+  if (cached != current.upvalueIndex.end())
+    return cached->second;
+
+  Unit &enclosing = units[unit - 1];
+  Upvalue up;
+  auto local = enclosing.localIndex.find(name);
+  if (local != enclosing.localIndex.end()) {
+    enclosing.captured[local->second] = true;
+    up = Upvalue{true, local->second};
+  } else {
+    int index = upvalue(unit - 1, name);
+    if (index == -1)
+      return -1;
+    up = Upvalue{false, index};
+  }
+
+  int index = current.code->upvalues.size();
+  current.code->upvalues.push_back(up);
+  current.upvalueIndex.insert({name, index});
+  return index;
+}
+
+// Instruction loading name: LOAD_LOCAL if it is bound in the innermost lambda,
+// LOAD_UPVALUE if in an enclosing one, LOAD_NAME otherwise
+Instruction Compiler::load(Symbol name) {
+  int current = units.size() - 1;
+  if (current > 0) {
+    auto it = units[current].localIndex.find(name);
+    if (it != units[current].localIndex.end())
+      return Instruction(OpCode::LOAD_LOCAL, it->second);
+
+    int index = upvalue(current, name);
+    if (index != -1)
+      return Instruction(OpCode::LOAD_UPVALUE, index);
+  }
+
+  return Instruction(OpCode::LOAD_NAME, this->name(name));
+}
+
+void Compiler::emit(Instruction ins) {
+  units.back().code->instructions.push_back(ins);
+}
+
+int Compiler::jump(OpCode op) {
+  std::vector<Instruction> &ins = units.back().code->instructions;
+  ins.push_back(Instruction(op, 0));
+  return ins.size() - 1;
+}
+
+void Compiler::patch(int label) {
+  std::vector<Instruction> &ins = units.back().code->instructions;
+  int offset = ins.size() - (label + 1);
+  ins[label] = Instruction(ins[label].opCode(), offset);
+}
+
+void Compiler::visit(Constant &constant) {
+  emit(Instruction(OpCode::LOAD_CONST, this->constant(constant.getValue())));
+}
+
+void Compiler::visit(StringConstant &constant) {
+  emit(load(constant.getSymbol()));
+}
+
+// Compiles exp for the value it leaves on the stack. A val stores its value
+// and leaves nothing, so -1 stands in for it, as on the register machine.
+void Compiler::value(Expression &exp) {
+  static const Symbol val = SymbolTable::intern("val");
+
+  exp.accept(*this);
+  auto *list = dynamic_cast<ExpressionList *>(&exp);
+  auto *head =
+      list ? dynamic_cast<StringConstant *>(list->getExpressions()[0].get())
+           : nullptr;
+  if (head && head->getSymbol() == val)
+    emit(Instruction(OpCode::LOAD_CONST, constant(-1)));
+}
 
-  return ins;
+void Compiler::visit(BinaryOperation &binOp) {
+  value(binOp.getLeft());
+  value(binOp.getRight());
+
+  char op = binOp.getOperator();
+  if (op == '+') {
+    emit(Instruction(OpCode::ADD, 0));
+  } else if (op == '-') {
+    emit(Instruction(OpCode::SUB, 0));
+  } else if (op == '*') {
+    emit(Instruction(OpCode::MUL, 0));
+  }
 }
 
-std::vector<Instruction> Compiler::visit(ExpressionList &list) {
-  std::vector<Instruction> ins;
+void Compiler::visit(ExpressionList &list) {
   const auto &exps = list.getExpressions();
+  if (const char *problem = list.malformed()) {
+    throw std::runtime_error(problem);
+  }
+
+  static const Symbol val = SymbolTable::intern("val");
+  static const Symbol if_ = SymbolTable::intern("if");
 
   auto &first = exps[0];
   const StringConstant *strConstPtr =
       dynamic_cast<const StringConstant *>(first.get());
-  if (strConstPtr && strConstPtr->getValue() == "val") {
+  if (strConstPtr && strConstPtr->getSymbol() == val) {
     auto &name = exps[1];
     const StringConstant *strConstPtr =
         dynamic_cast<const StringConstant *>(name.get());
 
     if (strConstPtr) {
-      Instruction store(OpCode::STORE_NAME, strConstPtr->getValue());
-
-      auto &subexp = exps[2];
-      std::vector<Instruction> subexp_code = subexp.get()->accept(*this);
-
-      ins.insert(ins.end(), subexp_code.begin(), subexp_code.end());
-      ins.push_back(store);
+      value(*exps[2]);
+
+      // Inside a lambda val binds a local, at the top level a global. The
+      // name is declared after compiling the value, which still sees any
+      // outer binding of it.
+      Symbol var = strConstPtr->getSymbol();
+      emit(units.size() > 1
+               ? Instruction(OpCode::STORE_LOCAL, declareLocal(var))
+               : Instruction(OpCode::STORE_NAME, this->name(var)));
     } else {
       throw std::runtime_error("Unsupported instruction");
     }
 
-  } else if (strConstPtr && strConstPtr->getValue() == "if") {
-    // Compile condition, true and false branches
-    auto &cond = exps[1];
-    std::vector<Instruction> cond_code = cond.get()->accept(*this);
+  } else if (strConstPtr && strConstPtr->getSymbol() == if_) {
+    // The condition, then the false arm, which the jump to the true arm
+    // skips, and the jump over the true arm at its end
+    value(*exps[1]);
+    int to_true = jump(OpCode::RELATIVE_JUMP_IF_TRUE);
+    value(*exps[3]);
+    int to_end = jump(OpCode::RELATIVE_JUMP);
+    patch(to_true);
+    value(*exps[2]);
+    patch(to_end);
 
-    auto &true_branch = exps[2];
-    std::vector<Instruction> true_code = true_branch.get()->accept(*this);
+  } else {
+    // Function call: the head evaluates to the callee, which may be a lambda
+    // that is immediately applied or a name bound to a function, and the
+    // arguments follow it
+    for (const auto &exp : exps) {
+      value(*exp);
+    }
 
-    auto &false_branch = exps[3];
-    std::vector<Instruction> false_code = false_branch.get()->accept(*this);
+    // Every call gets a cache of its own for eval to quicken it
+    CodeObject *code = units.back().code;
+    emit(Instruction(OpCode::CALL_FUNCTION, exps.size() - 1,
+                     code->callCaches.size()));
+    code->callCaches.push_back(CallCache());
+  }
+}
 
-    // Construct relative jumps
-    Instruction jmp_to_end(OpCode::RELATIVE_JUMP,
-                           static_cast<int>(true_code.size()));
-    Instruction jmp_to_true(OpCode::RELATIVE_JUMP_IF_TRUE,
-                            static_cast<int>(false_code.size()) + 1);
+void Compiler::visit(Lambda &lambda) {
+  // Compile the body into its own code object
+  // Parameters take the first slots of the frame
+  auto code = std::make_shared<CodeObject>();
+  units.push_back(Unit(code.get(), &arena));
+  for (const auto &param : lambda.getParams()) {
+    if (units.back().localIndex.count(param.getSymbol())) {
+      throw std::runtime_error("Duplicate parameter " + param.getValue());
+    }
+    code->params.push_back(param.getSymbol());
+    declareLocal(param.getSymbol());
+  }
+  lambda.getBody().accept(*this);
+
+  // Captured variables are only known once the whole body is compiled: access
+  // them through the cell, and move them into cells on entry. Jumps are
+  // relative, so putting the MAKE_CELLs in front keeps them valid.
+  Unit &unit = units.back();
+  std::vector<Instruction> &body = code->instructions;
+  std::vector<Instruction> cells;
+  for (int slot = 0; slot < code->numLocals; slot++) {
+    if (unit.captured[slot])
+      cells.push_back(Instruction(OpCode::MAKE_CELL, slot));
+  }
+  if (!cells.empty()) {
+    for (Instruction &instr : body) {
+      if (instr.opCode() == OpCode::LOAD_LOCAL && unit.captured[instr.arg()]) {
+        instr = Instruction(OpCode::LOAD_CELL, instr.arg());
+      } else if (instr.opCode() == OpCode::STORE_LOCAL &&
+                 unit.captured[instr.arg()]) {
+        instr = Instruction(OpCode::STORE_CELL, instr.arg());
+      }
+    }
+    body.insert(body.begin(), cells.begin(), cells.end());
+  }
+  markTailCalls(body);
+  finish(*code);
+  units.pop_back();
 
-    // Put instructions together
-    ins.insert(ins.end(), cond_code.begin(), cond_code.end());
-    ins.push_back(jmp_to_true);
-    ins.insert(ins.end(), false_code.begin(), false_code.end());
-    ins.push_back(jmp_to_end);
-    ins.insert(ins.end(), true_code.begin(), true_code.end());
+  // Register it with the enclosing code object
+  auto &functions = units.back().code->functions;
+  int index = functions.size();
+  functions.push_back(code);
 
-  } else {
-    // TODO: This allows function calls where functions are defined and immediately applied.
-    // Extend to allow previously defined functions to be called.
-    const Lambda *lambdaPtr = dynamic_cast<const Lambda *>(first.get());
-    if (lambdaPtr) {
-      std::vector<Instruction> lambda_code = exps.at(0)->accept(*this);
-      ins.insert(ins.end(), lambda_code.begin(), lambda_code.end());
-
-      // args
-      for (int i = 1; i < exps.size(); i++) {
-        std::vector<Instruction> arg_code = exps[i]->accept(*this);
-        ins.insert(ins.end(), arg_code.begin(), arg_code.end());
-      }
+  emit(Instruction(OpCode::MAKE_FUNCTION, index));
+}
 
-      Instruction call(OpCode::CALL_FUNCTION, exps.size() - 1);
-      ins.push_back(call);
+namespace {
+// An activation record. Frames live on an explicit frame stack, and all of
+// them share one contiguous operand stack: the callee of a call sits in the
+// slot just below its locals, the arguments followed by the slots for its
+// vals, and then come the operands of the call.
+struct Frame {
+  const CodeObject *code;
+  const Instruction *pc; // return address while a callee is running
+  Function *function;    // null for the top level
+  Value *locals;         // first local slot
+  Value *operands;       // first operand slot
+};
+
+// Stack and frames are allocated once per thread and reused across calls to
+// eval, so a call costs a few pointer bumps rather than an allocation.
+struct Machine {
+  std::unique_ptr<Value[]> stack{new Value[interpreter::STACK_SIZE]};
+  std::vector<Frame> frames;
+  int recursionLimit = 10000;
+};
+
+thread_local Machine machine;
+} // namespace
+
+void interpreter::setRecursionLimit(int limit) {
+  machine.recursionLimit = limit;
+  machine.frames = std::vector<Frame>();
+}
 
-    } else {
-      throw std::runtime_error("Unsupported instruction");
+int interpreter::recursionLimit() { return machine.recursionLimit; }
+
+#ifdef INTERP_STATS
+thread_local unsigned long long interpreter::dispatchCount = 0;
+#endif
+
+// Runs the machine code of callee on the arguments at args, compiling the
+// body once it has been called jitThreshold times. Returns false if the body
+// has to be interpreted instead.
+static bool callNative(const CodeObject *callee, const Value *args,
+                       int32_t &result) {
+  JitState &jit = callee->jit;
+  if (!jit.native) {
+    if (jit.attempted || ++jit.calls < interpreter::jitThreshold())
+      return false;
+    jit.attempted = true;
+    jit.native = interpreter::compileNative(*callee);
+    if (!jit.native)
+      return false;
+  }
+  return jit.native->call(args, result);
+}
+
+// The result of a call run natively replaces the callee and the arguments
+#define RETURN_NATIVE(args, result)                                            \
+  do {                                                                         \
+    while (sp > (args))                                                        \
+      *--sp = Value();                                                         \
+    sp[-1] = Value(result);                                                    \
+  } while (0)
+
+// A builtin runs in C++; its result replaces the callee and the arguments
+#define CALL_BUILTIN(args, nargs)                                              \
+  do {                                                                         \
+    Value result = (args)[-1].asBuiltin()->body((args), (nargs), env);         \
+    while (sp > (args))                                                        \
+      *--sp = Value();                                                         \
+    sp[-1] = std::move(result);                                                \
+  } while (0)
+
+// Calls are quickened: once a call site has found a function of the right
+// arity, it is rewritten in place to a variant that only checks that the
+// callee is the same code object again. On a miss it is rewritten back to the
+// generic call, which runs instead, and the site stays generic from then on.
+// Code objects built by hand rather than by the Compiler, and code shared by
+// isolates (see isolate.hpp), have no call caches and are never quickened.
+#define QUICKEN_CALL(op, callee, frameSize)                                    \
+  do {                                                                         \
+    if (!code->callCaches.empty() && (callee)->id != 0 &&                      \
+        !code->callCaches[ins.second()].generic) {                             \
+      CallCache &site = code->callCaches[ins.second()];                        \
+      site.callee = (callee)->id;                                              \
+      site.frameSize = (frameSize);                                            \
+      code->instructions[pc - 1 - code->instructions.data()] =                 \
+          Instruction(op, ins.first(), ins.second());                          \
+    }                                                                          \
+  } while (0)
+
+#define DEOPTIMIZE_CALL(op)                                                    \
+  do {                                                                         \
+    code->callCaches[ins.second()].generic = true;                             \
+    code->instructions[pc - 1 - code->instructions.data()] =                   \
+        Instruction(op, ins.first(), ins.second());                            \
+    pc--;                                                                      \
+  } while (0)
+
+// Pushes a frame for callee, whose arguments are at args and whose locals and
+// operands take frameSize slots
+#define PUSH_FRAME(fn, callee, args, nargs, frameSize)                         \
+  do {                                                                         \
+    if (static_cast<int>(frames.size()) > machine.recursionLimit) {            \
+      throw std::runtime_error("Maximum recursion depth exceeded");            \
+    }                                                                          \
+    if (stack_end - (args) < (frameSize)) {                                    \
+      throw std::runtime_error("Stack overflow");                              \
+    }                                                                          \
+    /* The arguments become the first locals, the slots for vals follow */    \
+    for (int i = (nargs); i < (callee)->numLocals; i++) {                      \
+      PUSH(Value());                                                           \
+    }                                                                          \
+    frame->pc = pc;                                                            \
+    frames.push_back(Frame{(callee), nullptr, (fn), (args), sp});              \
+    frame = &frames.back();                                                    \
+    code = (callee);                                                           \
+    pc = code->instructions.data();                                            \
+  } while (0)
+
+// Replaces the running function and its locals by callee and its arguments
+#define REUSE_FRAME(fn, callee, args, nargs, frameSize)                        \
+  do {                                                                         \
+    if (stack_end - frame->locals < (frameSize)) {                             \
+      throw std::runtime_error("Stack overflow");                              \
+    }                                                                          \
+    /* The callee is moved over the running function first, which keeps fn   \
+       alive while the old locals are released */                             \
+    for (int i = -1; i < (nargs); i++) {                                       \
+      frame->locals[i] = std::move((args)[i]);                                 \
+    }                                                                          \
+    Value *top = frame->locals + (nargs);                                      \
+    while (sp > top)                                                           \
+      *--sp = Value();                                                         \
+    for (int i = (nargs); i < (callee)->numLocals; i++) {                      \
+      PUSH(Value());                                                           \
+    }                                                                          \
+    frame->code = (callee);                                                    \
+    frame->function = (fn);                                                    \
+    frame->operands = sp;                                                      \
+    code = (callee);                                                           \
+    pc = code->instructions.data();                                            \
+  } while (0)
+
+// The global name at index i of code. Code shared by isolates has no name
+// caches and looks the name up every time.
+#define GLOBAL(i)                                                              \
+  (code->nameCaches.empty()                                                    \
+       ? NameCache().lookup(env, code->names[i])                               \
+       : code->nameCaches[i].lookup(env, code->names[i]))
+
+#define PUSH(value) (*sp++ = (value))
+#define POP() (std::move(*--sp))
+#define TOP() (sp[-1])
+
+// Runs bytecode, with callee and its nargs arguments on the operand stack
+// first if callee is not null
+static Value execute(const CodeObject &bytecode, Environment &env,
+                     const Value *callee, const Value *args, int nargs) {
+  using interpreter::STACK_SIZE;
+  std::vector<Frame> &frames = machine.frames;
+  Value *stack = machine.stack.get();
+  Value *const stack_end = stack + STACK_SIZE;
+  frames.clear();
+  frames.reserve(machine.recursionLimit + 1);
+
+  if (bytecode.stackSize > STACK_SIZE) {
+    throw std::runtime_error("Stack overflow");
+  }
+  frames.push_back(Frame{&bytecode, nullptr, nullptr, stack, stack});
+
+  // An error leaves the values of the frames it unwinds on the stack. They
+  // are released on the way out rather than by whichever eval on the thread
+  // runs next, which may belong to another isolate (see isolate.hpp).
+  struct Unwind {
+    std::vector<Frame> &frames;
+    ~Unwind() {
+      if (frames.empty())
+        return;
+      const Frame &top = frames.back();
+      Value *end = top.operands + top.code->stackSize;
+      for (Value *slot = frames.front().locals; slot < end; slot++)
+        *slot = Value();
+      frames.clear();
     }
+  } unwind{frames};
+
+  // The state of the running frame is kept in locals
+  Frame *frame = &frames.back();
+  const CodeObject *code = &bytecode;
+  const Instruction *pc = code->instructions.data();
+  Value *sp = stack;
+  if (callee) {
+    PUSH(*callee);
+    for (int i = 0; i < nargs; i++)
+      PUSH(args[i]);
+  }
+  Instruction ins(OpCode::LOAD_CONST, 0);
+  // Read once, so that calls do not have to
+  const bool jit = interpreter::jitEnabled();
+
+#ifdef INTERP_COMPUTED_GOTO
+  static void *dispatch_table[] = {
+#define OPCODE_LABEL(op) &&TARGET_##op,
+      OPCODES(OPCODE_LABEL)
+#undef OPCODE_LABEL
+  };
+
+  DISPATCH();
+#else
+  for (;;) {
+    ins = *pc++;
+    COUNT_DISPATCH();
+
+    switch (ins.opCode()) {
+#endif
+
+  TARGET(LOAD_CONST) {
+    PUSH(code->constants[ins.arg()]);
+    DISPATCH();
   }
 
-  return ins;
-}
+  TARGET(LOAD_NAME) {
+    // Find global name in environment and push corresponding value onto stack
+    PUSH(GLOBAL(ins.arg()));
+    DISPATCH();
+  }
+
+  TARGET(STORE_NAME) {
+    // Get value from top of stack and add a binding for it in the
+    // environment
+    env.define(code->names[ins.arg()], POP());
+    DISPATCH();
+  }
 
-std::vector<Instruction> Compiler::visit(Lambda &lambda) {
-  std::vector<Instruction> ins;
-  auto &params = lambda.getParams();
-  std::vector<std::string> paramStrings;
-  for (const auto param : params) {
-    paramStrings.push_back(param.getValue());
+  TARGET(LOAD_LOCAL) {
+    PUSH(frame->locals[ins.arg()]);
+    DISPATCH();
   }
 
-  // Instruction for loading parameters
-  Instruction load_params(OpCode::LOAD_CONST, paramStrings);
+  TARGET(STORE_LOCAL) {
+    frame->locals[ins.arg()] = POP();
+    DISPATCH();
+  }
 
-  // Instruction for loading body
-  auto &body = lambda.getBody();
-  std::vector<Instruction> body_ins = body.accept(*this);
-  Instruction load_body(OpCode::LOAD_CONST, body_ins);
+  TARGET(MAKE_CELL) {
+    // Move a captured variable into a cell that closures can share
+    frame->locals[ins.arg()] = new Cell(std::move(frame->locals[ins.arg()]));
+    DISPATCH();
+  }
 
-  Instruction mk_function(OpCode::MAKE_FUNCTION, 1);
+  TARGET(LOAD_CELL) {
+    PUSH(frame->locals[ins.arg()].asCell()->value);
+    DISPATCH();
+  }
 
-  // Put instructions together
-  ins.push_back(load_params);
-  ins.push_back(load_body);
-  ins.push_back(mk_function);
+  TARGET(STORE_CELL) {
+    frame->locals[ins.arg()].asCell()->value = POP();
+    DISPATCH();
+  }
 
-  return ins;
-}
+  TARGET(LOAD_UPVALUE) {
+    PUSH(frame->function->upvalues[ins.arg()].asCell()->value);
+    DISPATCH();
+  }
+
+  TARGET(RELATIVE_JUMP_IF_TRUE) {
+    if (!TOP().isInt()) {
+      throw std::runtime_error("Condition is not an integer");
+    }
+    if ((--sp)->asInt())
+      pc += ins.arg();
+    DISPATCH();
+  }
 
-ValueType interpreter::eval(Code &bytecode, Environment &env) {
-  int program_counter = 0;
-  std::stack<ValueType> stack;
-
-  while (program_counter < bytecode.size()) {
-    Instruction ins = bytecode[program_counter];
-    auto op = ins.opCode;
-    program_counter++;
-
-    if (op == OpCode::LOAD_CONST) {
-      stack.push(ins.arg);
-    } else if (op == OpCode::LOAD_NAME) {
-      // Find name in environment and push corresponding value onto stack
-      if (ins.arg.type() == typeid(std::string)) {
-        auto val = env.lookup(boost::get<std::string>(ins.arg));
-        stack.push(val);
-      } else {
-        throw std::runtime_error("Unsupported instruction");
+  TARGET(RELATIVE_JUMP) {
+    pc += ins.arg();
+    DISPATCH();
+  }
+
+  TARGET(MAKE_FUNCTION) {
+    {
+      // A closure shares the cells of the variables it captures with the
+      // frame, or the function, it is created in
+      const auto &function = code->functions[ins.arg()];
+      Function *closure = new Function(function);
+      PUSH(closure);
+      closure->upvalues.reserve(function->upvalues.size());
+      for (const Upvalue &up : function->upvalues) {
+        closure->upvalues.push_back(up.isLocal
+                                        ? frame->locals[up.index]
+                                        : frame->function->upvalues[up.index]);
       }
-    } else if (op == OpCode::STORE_NAME) {
-      // Get name from top of stack and add a binding for it in the
-      // environment
-      auto name = stack.top();
-      stack.pop();
-
-      if (ins.arg.type() == typeid(std::string)) {
-        env.define(boost::get<std::string>(ins.arg), name);
-      } else {
-        throw std::runtime_error("Unsupported instruction");
+    }
+    DISPATCH();
+  }
+
+  TARGET(CALL_FUNCTION) {
+    {
+      int nargs = ins.first();
+      Value *args = sp - nargs;
+      if (!args[-1].isFunction()) {
+        if (args[-1].isBuiltin()) {
+          CALL_BUILTIN(args, nargs);
+          DISPATCH();
+        }
+        throw std::runtime_error("Called object is not a function");
       }
-    } else if (op == OpCode::RELATIVE_JUMP_IF_TRUE) {
-      auto cond = stack.top();
-      stack.pop();
-
-      if (boost::get<int>(cond))
-        program_counter += boost::get<int>(ins.arg);
-
-    } else if (op == OpCode::RELATIVE_JUMP) {
-      program_counter += boost::get<int>(ins.arg);
-    } else if (op == OpCode::MAKE_FUNCTION) {
-      int nargs = boost::get<int>(ins.arg);
-      std::vector<Instruction> body_code =
-          boost::get<std::vector<Instruction>>(stack.top());
-      stack.pop();
-      std::vector<std::string> params =
-          boost::get<std::vector<std::string>>(stack.top());
-      stack.pop();
-
-      Function f(params, body_code, env);
-      stack.push(std::make_shared<Function>(f));
-    } else if (op == OpCode::CALL_FUNCTION) {
-      // Pop args off stack
-      std::vector<ValueType> args;
-      int nargs = boost::get<int>(ins.arg);
-      for (int i = 0; i < nargs; i++) {
-        args.push_back(stack.top());
-        stack.pop();
+      Function *fn = args[-1].asFunction();
+      const CodeObject *callee = fn->code.get();
+      if (nargs != static_cast<int>(callee->params.size())) {
+        throw std::runtime_error("Wrong number of arguments");
       }
+      int frameSize = callee->numLocals + callee->stackSize;
+      QUICKEN_CALL(OpCode::CALL_KNOWN, callee, frameSize);
+      int32_t result;
+      if (jit && callNative(callee, args, result)) {
+        RETURN_NATIVE(args, result);
+        DISPATCH();
+      }
+      PUSH_FRAME(fn, callee, args, nargs, frameSize);
+    }
+    DISPATCH();
+  }
 
-      // Pop function
-      auto fn = stack.top();
-      std::shared_ptr<Function> fn_ptr =
-          boost::get<std::shared_ptr<Function>>(fn);
-
-      // Make function environment
-      std::unordered_map<std::string, ValueType> actuals_record;
-      for (int i = 0; i < args.size(); i++) {
-        std::string param = fn_ptr->params.at(i);
-        ValueType arg = args.at(i);
-        actuals_record.insert_or_assign(param, arg);
+  TARGET(TAIL_CALL) {
+    {
+      // Only emitted in lambda bodies: the callee and the arguments replace
+      // the running function and its locals, and the frame is reused
+      int nargs = ins.first();
+      Value *args = sp - nargs;
+      if (!args[-1].isFunction()) {
+        if (args[-1].isBuiltin()) {
+          CALL_BUILTIN(args, nargs);
+          DISPATCH();
+        }
+        throw std::runtime_error("Called object is not a function");
+      }
+      Function *fn = args[-1].asFunction();
+      const CodeObject *callee = fn->code.get();
+      if (nargs != static_cast<int>(callee->params.size())) {
+        throw std::runtime_error("Wrong number of arguments");
       }
-      Environment fn_env = Environment(actuals_record, &fn_ptr->env);
-
-      // Evaluate function and push result on to the stack
-      ValueType result = eval(fn_ptr->body, fn_env);
-      stack.push(result);
-
-    } else if (op == OpCode::ADD) {
-      int operand2 = boost::get<int>(stack.top());
-      stack.pop();
-      int operand1 = boost::get<int>(stack.top());
-      stack.pop();
-      stack.push(operand1 + operand2);
-
-    } else if (op == OpCode::SUB) {
-      int operand2 = boost::get<int>(stack.top());
-      stack.pop();
-      int operand1 = boost::get<int>(stack.top());
-      stack.pop();
-      stack.push(operand1 - operand2);
-
-    } else if (op == OpCode::MUL) {
-      int operand2 = boost::get<int>(stack.top());
-      stack.pop();
-      int operand1 = boost::get<int>(stack.top());
-      stack.pop();
-      stack.push(operand1 * operand2);
+      int frameSize = callee->numLocals + callee->stackSize;
+      QUICKEN_CALL(OpCode::TAIL_CALL_KNOWN, callee, frameSize);
+      // The code after a tail call only returns the result
+      int32_t result;
+      if (jit && callNative(callee, args, result)) {
+        RETURN_NATIVE(args, result);
+        DISPATCH();
+      }
+      REUSE_FRAME(fn, callee, args, nargs, frameSize);
+    }
+    DISPATCH();
+  }
 
-    } else {
+  TARGET(RETURN) {
+    {
+      Value result = sp > frame->operands ? POP() : Value(-1);
+      if (frames.size() == 1) {
+        frames.clear();
+        return result;
+      }
+
+      // Release the locals, replace the callee slot with the result and
+      // resume the caller
+      while (sp >= frame->locals)
+        *--sp = Value();
+      frames.pop_back();
+      frame = &frames.back();
+      code = frame->code;
+      pc = frame->pc;
+      PUSH(std::move(result));
+    }
+    DISPATCH();
+  }
+
+  // Integer operands need no release, so arithmetic works in place
+  TARGET(ADD) {
+    if (!Value::bothInts(sp[-2], sp[-1])) {
+      throw std::runtime_error("Operands are not integers");
+    }
+    sp[-2] = Value::add(sp[-2], sp[-1]);
+    sp--;
+    DISPATCH();
+  }
+
+  TARGET(SUB) {
+    if (!Value::bothInts(sp[-2], sp[-1])) {
+      throw std::runtime_error("Operands are not integers");
+    }
+    sp[-2] = Value::sub(sp[-2], sp[-1]);
+    sp--;
+    DISPATCH();
+  }
+
+  TARGET(MUL) {
+    if (!Value::bothInts(sp[-2], sp[-1])) {
+      throw std::runtime_error("Operands are not integers");
+    }
+    sp[-2] = Value::mul(sp[-2], sp[-1]);
+    sp--;
+    DISPATCH();
+  }
+
+  // Superinstructions: an arithmetic operation whose right operand is a
+  // constant, a local or a global, loading two locals at once, and branching
+  // on a local
+#define ARITHMETIC_WITH(op, fn, operand)                                       \
+  TARGET(op) {                                                                 \
+    {                                                                          \
+      const Value &right = operand;                                            \
+      if (!Value::bothInts(TOP(), right)) {                                    \
+        throw std::runtime_error("Operands are not integers");                 \
+      }                                                                        \
+      TOP() = Value::fn(TOP(), right);                                         \
+    }                                                                          \
+    DISPATCH();                                                                \
+  }
+
+  ARITHMETIC_WITH(ADD_CONST, add, Value(code->constants[ins.arg()]))
+  ARITHMETIC_WITH(SUB_CONST, sub, Value(code->constants[ins.arg()]))
+  ARITHMETIC_WITH(MUL_CONST, mul, Value(code->constants[ins.arg()]))
+  ARITHMETIC_WITH(ADD_LOCAL, add, frame->locals[ins.arg()])
+  ARITHMETIC_WITH(SUB_LOCAL, sub, frame->locals[ins.arg()])
+  ARITHMETIC_WITH(MUL_LOCAL, mul, frame->locals[ins.arg()])
+  ARITHMETIC_WITH(ADD_NAME, add, GLOBAL(ins.arg()))
+  ARITHMETIC_WITH(SUB_NAME, sub, GLOBAL(ins.arg()))
+  ARITHMETIC_WITH(MUL_NAME, mul, GLOBAL(ins.arg()))
+#undef ARITHMETIC_WITH
+
+  TARGET(LOAD_LOCAL_LOCAL) {
+    PUSH(frame->locals[ins.first()]);
+    PUSH(frame->locals[ins.second()]);
+    DISPATCH();
+  }
+
+  TARGET(JUMP_IF_LOCAL) {
+    if (!frame->locals[ins.first()].isInt()) {
+      throw std::runtime_error("Condition is not an integer");
+    }
+    if (frame->locals[ins.first()].asInt())
+      pc += ins.second();
+    DISPATCH();
+  }
+
+  TARGET(CALL_KNOWN) {
+    {
+      // A call site that has only seen one callee; its arity is known to match
+      int nargs = ins.first();
+      Value *args = sp - nargs;
+      const CallCache &site = code->callCaches[ins.second()];
+      if (!args[-1].isFunction() ||
+          args[-1].asFunction()->code->id != site.callee) {
+        DEOPTIMIZE_CALL(OpCode::CALL_FUNCTION);
+        DISPATCH();
+      }
+      Function *fn = args[-1].asFunction();
+      const CodeObject *callee = fn->code.get();
+      int32_t result;
+      if (jit && callNative(callee, args, result)) {
+        RETURN_NATIVE(args, result);
+        DISPATCH();
+      }
+      PUSH_FRAME(fn, callee, args, nargs, site.frameSize);
+    }
+    DISPATCH();
+  }
+
+  TARGET(TAIL_CALL_KNOWN) {
+    {
+      int nargs = ins.first();
+      Value *args = sp - nargs;
+      const CallCache &site = code->callCaches[ins.second()];
+      if (!args[-1].isFunction() ||
+          args[-1].asFunction()->code->id != site.callee) {
+        DEOPTIMIZE_CALL(OpCode::TAIL_CALL);
+        DISPATCH();
+      }
+      Function *fn = args[-1].asFunction();
+      const CodeObject *callee = fn->code.get();
+      int32_t result;
+      if (jit && callNative(callee, args, result)) {
+        RETURN_NATIVE(args, result);
+        DISPATCH();
+      }
+      REUSE_FRAME(fn, callee, args, nargs, site.frameSize);
+    }
+    DISPATCH();
+  }
+
+#ifndef INTERP_COMPUTED_GOTO
+    default:
       throw std::runtime_error("Unsupported instruction");
     }
   }
+#endif
+}
 
-  if (!stack.empty())
-    return stack.top();
-  else
-    return -1;
+Value interpreter::eval(const Code &bytecode, Environment &env) {
+  return execute(bytecode, env, nullptr, nullptr, 0);
+}
+
+// The code that call runs for nargs arguments, which finds the callee and
+// the arguments on the stack. It has no call cache, so it is never quickened.
+static const CodeObject &callCode(int nargs) {
+  thread_local std::vector<std::unique_ptr<CodeObject>> codes;
+  if (codes.size() <= static_cast<size_t>(nargs))
+    codes.resize(nargs + 1);
+  if (!codes[nargs]) {
+    auto code = std::make_unique<CodeObject>();
+    code->instructions = {Instruction(OpCode::CALL_FUNCTION, nargs, 0),
+                          Instruction(OpCode::RETURN, 0)};
+    code->stackSize = nargs + 1;
+    codes[nargs] = std::move(code);
+  }
+  return *codes[nargs];
+}
+
+Value interpreter::call(const Value &function, const std::vector<Value> &args,
+                        Environment &env) {
+  if (!Instruction::fits(args.size(), 0)) {
+    throw std::runtime_error("Too many arguments");
+  }
+  const CodeObject &code = callCode(args.size());
+  return execute(code, env, &function, args.data(), args.size());
 }
@@ -0,0 +1,75 @@
+#include "../include/isolate.hpp"
+#include "../include/jit.hpp"
+
+void interpreter::share(const Code &code) {
+  // Code that is shared already may be running on other threads, so it is
+  // only read; its lambda bodies were shared along with it
+  if (code.shared.set.load(std::memory_order_acquire))
+    return;
+
+  // Quickened calls rely on the call caches, which go
+  for (Instruction &ins : code.instructions) {
+    if (ins.opCode() == OpCode::CALL_KNOWN)
+      ins = Instruction(OpCode::CALL_FUNCTION, ins.first(), ins.second());
+    else if (ins.opCode() == OpCode::TAIL_CALL_KNOWN)
+      ins = Instruction(OpCode::TAIL_CALL, ins.first(), ins.second());
+  }
+  code.nameCaches.clear();
+  code.callCaches.clear();
+  if (!code.jit.attempted && jitEnabled())
+    code.jit.native = compileNative(code);
+  code.jit.attempted = true;
+
+  for (const auto &function : code.functions)
+    share(*function);
+  code.shared.set.store(true, std::memory_order_release);
+}
+
+std::shared_ptr<const interpreter::Code>
+interpreter::sharedCopy(const std::shared_ptr<const Code> &code) {
+  if (code->shared.set.load(std::memory_order_acquire))
+    return code;
+
+  auto copy = std::make_shared<Code>();
+  copy->instructions = code->instructions;
+  copy->constants = code->constants;
+  copy->names = code->names;
+  copy->params = code->params;
+  for (const auto &function : code->functions)
+    copy->functions.push_back(sharedCopy(function));
+  copy->stackSize = code->stackSize;
+  copy->numLocals = code->numLocals;
+  copy->upvalues = code->upvalues;
+  copy->id = CodeObject::freshId();
+  share(*copy);
+  return copy;
+}
+
+void interpreter::share(const bytecode::Program &program) {
+  for (const auto &form : program)
+    share(*form);
+}
+
+interpreter::Isolate::~Isolate() {
+  // The bindings go first, then the cycles among what they held
+  gc::Heap::Scope scope(heap_);
+  globals_ = Environment();
+  heap_.collect();
+  heap_.release();
+}
+
+Value interpreter::Isolate::run(const bytecode::Program &program) {
+  gc::Heap::Scope scope(heap_);
+  return bytecode::run(program, globals_);
+}
+
+Value interpreter::Isolate::eval(const Code &code) {
+  gc::Heap::Scope scope(heap_);
+  return interpreter::eval(code, globals_);
+}
+
+Value interpreter::Isolate::call(const Value &function,
+                                 const std::vector<Value> &args) {
+  gc::Heap::Scope scope(heap_);
+  return interpreter::call(function, args, globals_);
+}
@@ -0,0 +1,321 @@
+#include "../include/jit.hpp"
+#include "../include/interpreter.hpp"
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#if defined(__x86_64__) && defined(__linux__)
+#define INTERP_JIT_X86_64
+#include <sys/mman.h>
+#endif
+
+namespace {
+// INTERP_JIT=1 in the environment turns the JIT on at start-up
+bool jitFromEnvironment() {
+  const char *setting = std::getenv("INTERP_JIT");
+  return setting != nullptr && std::string(setting) != "0";
+}
+
+bool jitOn = jitFromEnvironment();
+int jitCalls = 1000;
+} // namespace
+
+void interpreter::setJitEnabled(bool enabled) { jitOn = enabled; }
+bool interpreter::jitEnabled() { return jitOn; }
+void interpreter::setJitThreshold(int calls) { jitCalls = calls; }
+int interpreter::jitThreshold() { return jitCalls; }
+
+bool interpreter::jitSupports(const CodeObject &code) {
+  if (code.numLocals != static_cast<int>(code.params.size()) ||
+      !code.upvalues.empty()) {
+    return false;
+  }
+  for (Instruction ins : code.instructions) {
+    switch (ins.opCode()) {
+    case OpCode::LOAD_CONST:
+    case OpCode::LOAD_LOCAL:
+    case OpCode::LOAD_LOCAL_LOCAL:
+    case OpCode::ADD:
+    case OpCode::SUB:
+    case OpCode::MUL:
+    case OpCode::ADD_CONST:
+    case OpCode::SUB_CONST:
+    case OpCode::MUL_CONST:
+    case OpCode::ADD_LOCAL:
+    case OpCode::SUB_LOCAL:
+    case OpCode::MUL_LOCAL:
+    case OpCode::RELATIVE_JUMP:
+    case OpCode::RELATIVE_JUMP_IF_TRUE:
+    case OpCode::JUMP_IF_LOCAL:
+    case OpCode::RETURN:
+      break;
+    default:
+      return false;
+    }
+  }
+  return true;
+}
+
+#ifdef INTERP_JIT_X86_64
+
+static_assert(sizeof(Value) == 8, "the JIT reads locals as 64-bit words");
+
+NativeCode::NativeCode(const std::vector<uint8_t> &bytes)
+    : length(bytes.size()) {
+  memory = mmap(nullptr, length, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (memory == MAP_FAILED) {
+    throw std::runtime_error("Unable to allocate native code");
+  }
+  std::memcpy(memory, bytes.data(), length);
+  if (mprotect(memory, length, PROT_READ | PROT_EXEC) != 0) {
+    munmap(memory, length);
+    throw std::runtime_error("Unable to make native code executable");
+  }
+}
+
+NativeCode::~NativeCode() { munmap(memory, length); }
+
+namespace {
+// Emits the machine code of one body. Values on the operand stack are kept
+// untagged, one per 64-bit slot of the native stack; rdi holds the locals and
+// rbx the stack pointer at entry.
+class Assembler {
+private:
+  std::vector<uint8_t> out;
+  std::vector<std::pair<size_t, int>> jumps; // rel32 field, target pc
+  std::vector<size_t> bails;                 // rel32 fields
+
+  void bytes(std::initializer_list<uint8_t> list) {
+    out.insert(out.end(), list);
+  }
+  void imm32(int32_t value) {
+    for (int i = 0; i < 4; i++)
+      out.push_back(static_cast<uint32_t>(value) >> (8 * i));
+  }
+  void patch(size_t at, size_t target) {
+    int32_t rel = static_cast<int32_t>(target - (at + 4));
+    std::memcpy(&out[at], &rel, 4);
+  }
+
+public:
+  // rax (or rcx) = the integer in local slot, bailing out unless it is one
+  void loadLocal(int slot, bool intoRcx = false) {
+    int32_t disp = slot * static_cast<int32_t>(sizeof(Value));
+    if (intoRcx) {
+      bytes({0x48, 0x8B, 0x8F}); // mov rcx, [rdi + disp32]
+      imm32(disp);
+      bytes({0xF6, 0xC1, 0x01}); // test cl, 1
+    } else {
+      bytes({0x48, 0x8B, 0x87}); // mov rax, [rdi + disp32]
+      imm32(disp);
+      bytes({0xA8, 0x01}); // test al, 1
+    }
+    bytes({0x0F, 0x84}); // jz bail
+    bails.push_back(out.size());
+    imm32(0);
+    if (intoRcx)
+      bytes({0x48, 0xC1, 0xF9, 0x20}); // sar rcx, 32
+    else
+      bytes({0x48, 0xC1, 0xF8, 0x20}); // sar rax, 32
+  }
+
+  void pushRax() { bytes({0x50}); }
+  void popRax() { bytes({0x58}); }
+  void popRcx() { bytes({0x59}); }
+  void pushImm(int32_t value) {
+    bytes({0x68}); // push imm32
+    imm32(value);
+  }
+
+  // eax = eax op ecx
+  void arithmetic(OpCode op) {
+    switch (op) {
+    case OpCode::ADD:
+      bytes({0x01, 0xC8}); // add eax, ecx
+      break;
+    case OpCode::SUB:
+      bytes({0x29, 0xC8}); // sub eax, ecx
+      break;
+    default:
+      bytes({0x0F, 0xAF, 0xC1}); // imul eax, ecx
+      break;
+    }
+  }
+
+  // eax = eax op value
+  void arithmeticImm(OpCode op, int32_t value) {
+    switch (op) {
+    case OpCode::ADD:
+      bytes({0x05}); // add eax, imm32
+      break;
+    case OpCode::SUB:
+      bytes({0x2D}); // sub eax, imm32
+      break;
+    default:
+      bytes({0x69, 0xC0}); // imul eax, eax, imm32
+      break;
+    }
+    imm32(value);
+  }
+
+  void jump(int target) {
+    bytes({0xE9}); // jmp rel32
+    jumps.push_back({out.size(), target});
+    imm32(0);
+  }
+
+  // Jumps to target unless eax is 0
+  void jumpIfEax(int target) {
+    bytes({0x85, 0xC0}); // test eax, eax
+    bytes({0x0F, 0x85}); // jnz rel32
+    jumps.push_back({out.size(), target});
+    imm32(0);
+  }
+
+  void prologue() {
+    bytes({0x53});             // push rbx
+    bytes({0x48, 0x89, 0xE3}); // mov rbx, rsp
+  }
+
+  void epilogue() {
+    bytes({0x48, 0x89, 0xDC}); // mov rsp, rbx
+    bytes({0x5B});             // pop rbx
+    bytes({0xC3});             // ret
+  }
+
+  // Stores the top of the stack, or -1 if it is empty, and returns true
+  void ret() {
+    bytes({0xB8});             // mov eax, -1
+    imm32(-1);
+    bytes({0x48, 0x39, 0xDC}); // cmp rsp, rbx
+    bytes({0x74, 0x01});       // je over the pop
+    popRax();
+    bytes({0x89, 0x06}); // mov [rsi], eax
+    bytes({0xB8});       // mov eax, 1
+    imm32(1);
+    epilogue();
+  }
+
+  size_t position() const { return out.size(); }
+
+  // Emits the bail-out path and resolves every jump, given the offset of
+  // every instruction
+  std::vector<uint8_t> finish(const std::vector<size_t> &offsets) {
+    size_t bail = out.size();
+    bytes({0x31, 0xC0}); // xor eax, eax
+    epilogue();
+    for (size_t at : bails)
+      patch(at, bail);
+    for (auto &jump : jumps)
+      patch(jump.first, offsets[jump.second]);
+    return std::move(out);
+  }
+};
+
+OpCode baseOperation(OpCode op) {
+  switch (op) {
+  case OpCode::ADD_CONST:
+  case OpCode::ADD_LOCAL:
+    return OpCode::ADD;
+  case OpCode::SUB_CONST:
+  case OpCode::SUB_LOCAL:
+    return OpCode::SUB;
+  case OpCode::MUL_CONST:
+  case OpCode::MUL_LOCAL:
+    return OpCode::MUL;
+  default:
+    return op;
+  }
+}
+} // namespace
+
+std::shared_ptr<const NativeCode>
+interpreter::compileNative(const CodeObject &code) {
+  if (!jitSupports(code))
+    return nullptr;
+
+  Assembler as;
+  std::vector<size_t> offsets(code.size());
+  as.prologue();
+  for (size_t pc = 0; pc < code.size(); pc++) {
+    offsets[pc] = as.position();
+    Instruction ins = code[pc];
+    int next = pc + 1;
+    switch (ins.opCode()) {
+    case OpCode::LOAD_CONST:
+      as.pushImm(code.constants[ins.arg()]);
+      break;
+    case OpCode::LOAD_LOCAL:
+      as.loadLocal(ins.arg());
+      as.pushRax();
+      break;
+    case OpCode::LOAD_LOCAL_LOCAL:
+      as.loadLocal(ins.first());
+      as.pushRax();
+      as.loadLocal(ins.second());
+      as.pushRax();
+      break;
+    case OpCode::ADD:
+    case OpCode::SUB:
+    case OpCode::MUL:
+      as.popRcx();
+      as.popRax();
+      as.arithmetic(ins.opCode());
+      as.pushRax();
+      break;
+    case OpCode::ADD_CONST:
+    case OpCode::SUB_CONST:
+    case OpCode::MUL_CONST:
+      as.popRax();
+      as.arithmeticImm(baseOperation(ins.opCode()),
+                       code.constants[ins.arg()]);
+      as.pushRax();
+      break;
+    case OpCode::ADD_LOCAL:
+    case OpCode::SUB_LOCAL:
+    case OpCode::MUL_LOCAL:
+      as.loadLocal(ins.arg(), true);
+      as.popRax();
+      as.arithmetic(baseOperation(ins.opCode()));
+      as.pushRax();
+      break;
+    case OpCode::RELATIVE_JUMP:
+      as.jump(next + ins.arg());
+      break;
+    case OpCode::RELATIVE_JUMP_IF_TRUE:
+      as.popRax();
+      as.jumpIfEax(next + ins.arg());
+      break;
+    case OpCode::JUMP_IF_LOCAL:
+      as.loadLocal(ins.first());
+      as.jumpIfEax(next + ins.second());
+      break;
+    case OpCode::RETURN:
+      as.ret();
+      break;
+    default:
+      return nullptr;
+    }
+  }
+  return std::make_shared<const NativeCode>(as.finish(offsets));
+}
+
+#else
+
+NativeCode::NativeCode(const std::vector<uint8_t> &bytes)
+    : memory(nullptr), length(bytes.size()) {
+  throw std::runtime_error("Native code is not supported on this platform");
+}
+
+NativeCode::~NativeCode() {}
+
+std::shared_ptr<const NativeCode>
+interpreter::compileNative(const CodeObject &code) {
+  return nullptr;
+}
+
+#endif
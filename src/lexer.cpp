@@ -1,6 +1,16 @@
 #include "../include/lexer.hpp"
 #include "../include/error.hpp"
+#include "../include/scan.hpp"
+#include <algorithm>
+#include <fcntl.h>
+#include <iterator>
+#include <stdexcept>
 #include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <utility>
 #include <vector>
 
 // Lexer
@@ -25,21 +35,23 @@ void Lexer::lexToken() {
     addToken(TokenType::Star);
     break;
 
-  // Linebreaks and whitespace
+  // Linebreaks and whitespace, skipped as a whole run
   case ' ':
   case '\r':
   case '\t':
-    // Ignore whitespace.
-    break;
-  case '\n':
-    line++;
+  case '\n': {
+    int newlines = 0;
+    current = scan::whitespace(source.data(), start, source.length(), newlines);
+    line += newlines;
     break;
+  }
 
   // Comments
   case '/':
     if (match('/')) {
-      while (peek() != '\n' && !isAtEnd())
-        advance();
+      int newlines = 0;
+      current = scan::until(source.data(), current, source.length(), '\n',
+                            newlines);
     } else {
       Error::report(line, "Division operator currently not supported");
       this->hadError = true;
@@ -65,7 +77,7 @@ void Lexer::lexToken() {
 }
 
 char Lexer::advance() {
-  char currentChar = source.at(current);
+  char currentChar = source[current];
   this->current++;
   return currentChar;
 }
@@ -73,7 +85,7 @@ char Lexer::advance() {
 bool Lexer::match(char expected) {
   if (isAtEnd())
     return false;
-  if (source.at(current) != expected)
+  if (source[current] != expected)
     return false;
 
   this->current++;
@@ -84,17 +96,25 @@ char Lexer::peek() {
   if (isAtEnd())
     return '\0';
   else
-    return source.at(current);
+    return source[current];
 }
 
 void Lexer::addToken(TokenType token) { addToken(token, ""); }
 
-void Lexer::addToken(TokenType token, std::string value) {
-  Token t = Token{.token = token, .value = value, .line = line};
-  this->tokens.push_back(t);
+void Lexer::addToken(TokenType token, std::string_view value) {
+  pending = Token{
+      .token = token, .value = value, .line = line, .symbol = Symbol()};
 }
 
-bool Lexer::isAtEnd() { return current >= source.length(); }
+void Lexer::addToken(TokenType token, std::string_view value,
+                     Symbol symbol) {
+  pending =
+      Token{.token = token, .value = value, .line = line, .symbol = symbol};
+}
+
+bool Lexer::isAtEnd() {
+  return current >= static_cast<int>(source.length());
+}
 
 bool Lexer::isDigit(char c) { return c >= '0' && c <= '9'; }
 
@@ -102,15 +122,12 @@ bool Lexer::isAlpha(char c) {
   return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c == '_');
 }
 
-bool Lexer::isAlphaNumeric(char c) { return (isAlpha(c) || isDigit(c)); }
-
 void Lexer::string() {
   // Go till end of string
   // Escape sequences not supported
-  while (peek() != '"' && !isAtEnd()) {
-    if (peek() == '\n') line++;
-    advance();
-  }
+  int newlines = 0;
+  current = scan::until(source.data(), current, source.length(), '"', newlines);
+  line += newlines;
 
   if (isAtEnd()) {
     Error::report(line, "Unterminated string");
@@ -122,14 +139,13 @@ void Lexer::string() {
   advance();
 
   // Get string literal
-  std::string value = this->source.substr(start + 1, current - 1);
+  std::string_view value = source.substr(start + 1, current - start - 2);
   addToken(TokenType::StrConstant, value);
 }
 
 void Lexer::number() {
   // Go till end of number
-  while (isDigit(peek()) && !isAtEnd())
-    advance();
+  current = scan::digits(source.data(), current, source.length());
 
   if (isAtEnd()) {
     Error::report(line, "Lisp program should end with ')'");
@@ -137,12 +153,12 @@ void Lexer::number() {
     return;
   }
 
-  std::string value = source.substr(start, current);
+  std::string_view value = source.substr(start, current - start);
   addToken(TokenType::Constant, value);
 }
 
 void Lexer::identifier() {
-  while (isAlphaNumeric(peek()) && !isAtEnd()) advance();
+  current = scan::identifier(source.data(), current, source.length());
 
   if (isAtEnd()) {
     Error::report(line, "Lisp program should end with ')'");
@@ -151,27 +167,166 @@ void Lexer::identifier() {
   }
 
   // Check for reserved keywords
-  std::string text = source.substr(start, current);
-  if (text == "lambda") {
-    addToken(TokenType::Lambda, text);
+  std::string_view text = source.substr(start, current - start);
+  Symbol symbol = SymbolTable::intern(text);
+  static const Symbol lambda = SymbolTable::intern("lambda");
+  if (symbol == lambda) {
+    addToken(TokenType::Lambda, text, symbol);
   } else {
-    addToken(TokenType::Identifier, text);
+    addToken(TokenType::Identifier, text, symbol);
+  }
+}
+
+Lexer::Lexer(std::string source) : owned(std::move(source)) {
+  this->source = owned;
+}
+
+Lexer::Lexer(const SourceFile &file) : source(file.text()) {}
+
+Lexer::Lexer(std::string_view source, int line) : line(line), source(source) {}
+
+SourceFile::SourceFile(const std::string &path) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    throw std::runtime_error("Unable to open " + path);
+  }
+  struct stat info;
+  if (fstat(fd, &info) != 0) {
+    close(fd);
+    throw std::runtime_error("Unable to read " + path);
+  }
+  length = info.st_size;
+  // An empty file cannot be mapped, and has nothing to map
+  if (length > 0) {
+    data = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+      close(fd);
+      throw std::runtime_error("Unable to map " + path);
+    }
+    madvise(data, length, MADV_SEQUENTIAL);
   }
+  close(fd);
 }
 
-Lexer::Lexer(std::string source) {
-  this->source = source;
+SourceFile::~SourceFile() {
+  if (length > 0)
+    munmap(data, length);
 }
 
 std::vector<Token> Lexer::lex() {
-  while (current < source.length()) {
+  std::vector<Token> tokens;
+  do {
+    tokens.push_back(next());
+  } while (tokens.back().token != TokenType::Eof);
+  return tokens;
+}
+
+Token Lexer::next() {
+  // Whitespace, comments and errors produce no token
+  while (!pending && current < static_cast<int>(source.length())) {
     // At beginning of next lexeme
     start = current;
     Lexer::lexToken();
   }
-  
-  tokens.push_back(
-      Token{.token = TokenType::Eof, .value = "", .line = line});
+
+  if (!pending) {
+    return Token{.token = TokenType::Eof,
+                 .value = "",
+                 .line = line,
+                 .symbol = Symbol()};
+  }
+  Token token = std::move(*pending);
+  pending.reset();
+  return token;
+}
+
+// Chunks smaller than this are not worth a thread
+static constexpr size_t MIN_CHUNK = 64 * 1024;
+
+namespace {
+struct Chunk {
+  size_t begin;
+  int line;
+};
+} // namespace
+
+// Cuts text, which starts on line, into chunks of about size characters. Each
+// chunk but the first starts right after a newline that is outside strings
+// and comments and not inside any parens. Only the characters that change
+// that state are looked at, so this is much quicker than lexing.
+static std::vector<Chunk> split(std::string_view text, int line, size_t size) {
+  std::vector<Chunk> chunks = {{0, line}};
+  const char *data = text.data();
+  size_t end = text.length();
+  int depth = 0;
+  int newlines = 0;
+  for (size_t i = 0; i < end; i++) {
+    switch (data[i]) {
+    case '(':
+      depth++;
+      break;
+    case ')':
+      depth--;
+      break;
+    case '"':
+      i = scan::until(data, i + 1, end, '"', line);
+      break;
+    case '/':
+      // Stop on the newline, which is looked at next
+      if (i + 1 < end && data[i + 1] == '/')
+        i = scan::until(data, i + 2, end, '\n', newlines) - 1;
+      break;
+    case '\n':
+      line++;
+      if (depth <= 0 && i + 1 - chunks.back().begin >= size && i + 1 < end)
+        chunks.push_back({i + 1, line});
+      break;
+    }
+  }
+  return chunks;
+}
+
+std::vector<Token> Lexer::lexParallel(unsigned threads) {
+  if (threads == 0)
+    threads = std::max(1u, std::thread::hardware_concurrency());
+  std::string_view text = source.substr(current);
+  std::vector<Chunk> chunks =
+      split(text, line, std::max(MIN_CHUNK, text.length() / threads));
+
+  // The calling thread lexes the first chunk
+  std::vector<std::vector<Token>> parts(chunks.size());
+  std::vector<char> errors(chunks.size());
+  auto lexChunk = [&](size_t i) {
+    size_t end = i + 1 < chunks.size() ? chunks[i + 1].begin : text.length();
+    Lexer lexer(text.substr(chunks[i].begin, end - chunks[i].begin),
+                chunks[i].line);
+    parts[i] = lexer.lex();
+    errors[i] = lexer.lexError();
+  };
+  // The workers only read the scanners picked at start-up (see scan.cpp) and
+  // the symbol table, which locks
+  std::vector<std::thread> workers;
+  for (size_t i = 1; i < chunks.size(); i++)
+    workers.emplace_back(lexChunk, i);
+  lexChunk(0);
+  for (std::thread &worker : workers)
+    worker.join();
+
+  // Every part ends with an Eof; only the last one is kept
+  size_t count = 1;
+  for (const std::vector<Token> &part : parts)
+    count += part.size() - 1;
+  std::vector<Token> tokens;
+  tokens.reserve(count);
+  for (std::vector<Token> &part : parts)
+    tokens.insert(tokens.end(), std::make_move_iterator(part.begin()),
+                  std::make_move_iterator(part.end() - 1));
+  tokens.push_back(parts.back().back());
+
+  current = source.length();
+  line = tokens.back().line;
+  hadError = hadError ||
+             std::find(errors.begin(), errors.end(), true) != errors.end();
   return tokens;
 }
 
@@ -0,0 +1,381 @@
+#include "../include/parallel.hpp"
+#include "../include/isolate.hpp"
+#include <algorithm>
+#include <cstdlib>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+
+namespace {
+// Set on the threads of pools, where builtins cannot start another loop
+thread_local bool onWorker = false;
+
+// INTERP_THREADS in the environment sets the size of the pool; by default it
+// has a worker per core
+unsigned threadsFromEnvironment() {
+  const char *setting = std::getenv("INTERP_THREADS");
+  if (setting != nullptr && std::atoi(setting) > 0)
+    return std::atoi(setting);
+  return std::max(1u, std::thread::hardware_concurrency());
+}
+
+std::mutex poolMutex; // guards the two below
+unsigned poolThreads = threadsFromEnvironment();
+std::unique_ptr<parallel::Pool> sharedPool;
+
+// Loops are split into about this many chunks
+constexpr int CHUNKS = 256;
+} // namespace
+
+parallel::Pool::Pool(unsigned threads) {
+  for (unsigned i = 0; i < std::max(1u, threads); i++)
+    workers.push_back(std::make_unique<Worker>());
+  for (unsigned i = 0; i < workers.size(); i++)
+    workers[i]->thread = std::thread([this, i] { work(i); });
+}
+
+parallel::Pool::~Pool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  wake.notify_all();
+  for (auto &worker : workers)
+    worker->thread.join();
+}
+
+// Adds range to the back of the deque of worker index and wakes an idle
+// worker to steal it
+void parallel::Pool::push(unsigned index, Range range) {
+  {
+    std::lock_guard<std::mutex> lock(workers[index]->mutex);
+    workers[index]->ranges.push_back(range);
+    queued++;
+  }
+  // Taken so that a worker about to wait either sees the range or is woken
+  std::lock_guard<std::mutex> lock(mutex);
+  idle.notify_one();
+}
+
+// The next range for worker index: the last of its own, or the first of
+// another's
+bool parallel::Pool::take(unsigned index, Range &range) {
+  for (unsigned i = 0; i < workers.size(); i++) {
+    Worker &worker = *workers[(index + i) % workers.size()];
+    std::lock_guard<std::mutex> lock(worker.mutex);
+    if (worker.ranges.empty())
+      continue;
+    if (i == 0) {
+      range = worker.ranges.back();
+      worker.ranges.pop_back();
+    } else {
+      range = worker.ranges.front();
+      worker.ranges.pop_front();
+    }
+    queued--;
+    return true;
+  }
+  return false;
+}
+
+void parallel::Pool::work(unsigned index) {
+  onWorker = true;
+  uint64_t seen = 0;
+  for (;;) {
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      wake.wait(lock, [&] { return stopping || loop != seen; });
+      if (stopping)
+        return;
+      seen = loop;
+    }
+
+    // Ranges that are taken are run before remaining drops, so there may be
+    // more to take or steal until it reaches 0. A worker that finds none
+    // sleeps until a range is pushed or the loop is done.
+    while (remaining.load() > 0) {
+      Range range;
+      if (!take(index, range)) {
+        std::unique_lock<std::mutex> lock(mutex);
+        idle.wait(lock, [&] {
+          return queued.load() > 0 || remaining.load() == 0;
+        });
+        continue;
+      }
+      while (range.end - range.begin > grain) {
+        int middle = range.begin + (range.end - range.begin) / 2;
+        push(index, Range{middle, range.end});
+        range.end = middle;
+      }
+
+      try {
+        (*body)(index, range.begin, range.end);
+      } catch (...) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!error || range.begin < errorAt) {
+          error = std::current_exception();
+          errorAt = range.begin;
+        }
+      }
+      int length = range.end - range.begin;
+      if (remaining.fetch_sub(length) == length) {
+        std::lock_guard<std::mutex> lock(mutex);
+        idle.notify_all();
+        done.notify_all();
+      }
+    }
+  }
+}
+
+void parallel::Pool::run(int n, int grain, const Body &body) {
+  if (n <= 0)
+    return;
+  std::lock_guard<std::mutex> serial(running);
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    this->body = &body;
+    this->grain = std::max(1, grain);
+    error = nullptr;
+    {
+      std::lock_guard<std::mutex> lock(workers[0]->mutex);
+      workers[0]->ranges.push_back(Range{0, n});
+      queued++;
+    }
+    remaining.store(n);
+    loop++;
+  }
+  wake.notify_all();
+
+  std::unique_lock<std::mutex> lock(mutex);
+  done.wait(lock, [&] { return remaining.load() == 0; });
+  this->body = nullptr;
+  if (error)
+    std::rethrow_exception(std::exchange(error, nullptr));
+}
+
+void parallel::setThreads(unsigned threads) {
+  std::lock_guard<std::mutex> lock(poolMutex);
+  poolThreads = std::max(1u, threads);
+  sharedPool.reset();
+}
+
+unsigned parallel::threads() {
+  std::lock_guard<std::mutex> lock(poolMutex);
+  return poolThreads;
+}
+
+parallel::Pool &parallel::pool() {
+  std::lock_guard<std::mutex> lock(poolMutex);
+  if (!sharedPool)
+    sharedPool = std::make_unique<Pool>(poolThreads);
+  return *sharedPool;
+}
+
+int parallel::grain(int n) { return std::max(1, (n + CHUNKS - 1) / CHUNKS); }
+
+namespace {
+// Copies values of the caller into the heap that is current, that of an
+// isolate, each object once. Functions get a shared copy of their code, made
+// once for all the isolates in codes, since the caller may be running the
+// code itself, and bring along the globals it names.
+class Copier {
+private:
+  Environment &from;
+  Environment &to;
+  std::unordered_map<const CodeObject *, std::shared_ptr<const CodeObject>>
+      &codes;
+  std::unordered_map<HeapObject *, Value> copies;
+  std::unordered_set<const CodeObject *> named;
+
+  void globals(const CodeObject &code) {
+    if (!named.insert(&code).second)
+      return;
+    for (Symbol name : code.names) {
+      Value *global = from.find(name);
+      if (global && !to.find(name)) {
+        Value value = copy(*global);
+        to.define(name, std::move(value));
+      }
+    }
+    for (const auto &function : code.functions)
+      globals(*function);
+  }
+
+  // The copy of object, if it was made already
+  const Value *made(HeapObject *object) const {
+    auto found = copies.find(object);
+    return found == copies.end() ? nullptr : &found->second;
+  }
+
+  Value copy(Function *function) {
+    auto &code = codes[function->code.get()];
+    if (!code)
+      code = interpreter::sharedCopy(function->code);
+    Function *result = new Function(code);
+    copies.emplace(function, Value(result));
+    for (const Value &upvalue : function->upvalues)
+      result->upvalues.push_back(copy(upvalue));
+    globals(*code);
+    return Value(result);
+  }
+
+  Value copy(Cell *cell) {
+    Cell *result = new Cell(Value());
+    copies.emplace(cell, Value(result));
+    result->value = copy(cell->value);
+    return Value(result);
+  }
+
+  Value copy(Builtin *builtin) {
+    Value result(new Builtin(builtin->name, builtin->body));
+    copies.emplace(builtin, result);
+    return result;
+  }
+
+public:
+  Copier(Environment &from, Environment &to,
+         std::unordered_map<const CodeObject *,
+                            std::shared_ptr<const CodeObject>> &codes)
+      : from(from), to(to), codes(codes) {}
+
+  Value copy(const Value &value) {
+    if (value.isInt())
+      return value;
+    if (value.isRegisterFunction()) {
+      throw std::runtime_error(
+          "Functions of the register machine cannot run in parallel");
+    }
+    if (value.isFunction()) {
+      const Value *done = made(value.asFunction());
+      return done ? *done : copy(value.asFunction());
+    }
+    if (value.isBuiltin()) {
+      const Value *done = made(value.asBuiltin());
+      return done ? *done : copy(value.asBuiltin());
+    }
+    const Value *done = made(value.asCell());
+    return done ? *done : copy(value.asCell());
+  }
+};
+
+// An isolate per worker of the pool, holding copies of the values a builtin
+// runs there. Made and destroyed by the caller while the workers are idle.
+class Team {
+private:
+  std::vector<std::unique_ptr<interpreter::Isolate>> isolates;
+  // By worker; destroyed before the isolates they belong to
+  std::vector<std::vector<Value>> copies;
+
+public:
+  Team(unsigned size, Environment &env, const std::vector<Value> &values) {
+    std::unordered_map<const CodeObject *, std::shared_ptr<const CodeObject>>
+        codes;
+    for (unsigned worker = 0; worker < size; worker++) {
+      isolates.push_back(std::make_unique<interpreter::Isolate>());
+      interpreter::Isolate &isolate = *isolates.back();
+      gc::Heap::Scope scope(isolate.heap());
+      Copier copier(env, isolate.globals(), codes);
+      copies.emplace_back();
+      for (const Value &value : values)
+        copies.back().push_back(copier.copy(value));
+    }
+  }
+
+  // Copy i of the values, in the isolate of worker
+  const Value &copy(unsigned worker, int i) const { return copies[worker][i]; }
+
+  // Calls copy i of worker with args and returns its integer result
+  int call(unsigned worker, int i, const std::vector<Value> &args,
+           const char *builtin) {
+    Value result = isolates[worker]->call(copies[worker][i], args);
+    if (!result.isInt()) {
+      throw std::runtime_error(std::string(builtin) +
+                               " needs functions that return integers");
+    }
+    return result.asInt();
+  }
+};
+
+void checkArguments(const char *builtin, int nargs, int expected,
+                    const Value &count) {
+  if (onWorker) {
+    throw std::runtime_error(std::string(builtin) +
+                             " cannot be called from inside pmap or preduce");
+  }
+  if (nargs != expected)
+    throw std::runtime_error("Wrong number of arguments");
+  if (!count.isInt() || count.asInt() < 0) {
+    throw std::runtime_error(std::string(builtin) +
+                             " needs a count that is not negative");
+  }
+}
+
+// (pmap f n)
+Value pmap(const Value *args, int nargs, Environment &env) {
+  checkArguments("pmap", nargs, 2, args[1]);
+  int n = args[1].asInt();
+  auto results = std::make_shared<std::vector<int>>(n);
+  if (n > 0) {
+    parallel::Pool &pool = parallel::pool();
+    Team team(pool.size(), env, {args[0]});
+    pool.run(n, parallel::grain(n), [&](unsigned worker, int begin, int end) {
+      for (int i = begin; i < end; i++)
+        (*results)[i] = team.call(worker, 0, {Value(i)}, "pmap");
+    });
+  }
+
+  return Value(new Builtin(
+      "pmap result", [results](const Value *args, int nargs, Environment &) {
+        if (nargs != 1)
+          throw std::runtime_error("Wrong number of arguments");
+        if (!args[0].isInt() || args[0].asInt() < 0 ||
+            args[0].asInt() >= static_cast<int>(results->size())) {
+          throw std::runtime_error("Index out of range");
+        }
+        return Value((*results)[args[0].asInt()]);
+      }));
+}
+
+// (preduce combine init f n)
+Value preduce(const Value *args, int nargs, Environment &env) {
+  checkArguments("preduce", nargs, 4, args[3]);
+  int n = args[3].asInt();
+  if (n == 0)
+    return args[1];
+
+  // The result of each chunk, at the index it starts at
+  std::vector<int> chunks(n);
+  std::vector<char> starts(n);
+  parallel::Pool &pool = parallel::pool();
+  Team team(pool.size(), env, {args[0], args[1], args[2]});
+  pool.run(n, parallel::grain(n), [&](unsigned worker, int begin, int end) {
+    int result = team.call(worker, 2, {Value(begin)}, "preduce");
+    for (int i = begin + 1; i < end; i++) {
+      int next = team.call(worker, 2, {Value(i)}, "preduce");
+      result = team.call(worker, 0, {Value(result), Value(next)}, "preduce");
+    }
+    chunks[begin] = result;
+    starts[begin] = true;
+  });
+
+  // combine cannot run here, in the middle of the call of preduce, so a
+  // worker folds the chunks
+  int result = 0;
+  pool.run(1, 1, [&](unsigned worker, int, int) {
+    Value folded = team.copy(worker, 1);
+    for (int i = 0; i < n; i++) {
+      if (starts[i])
+        folded = team.call(worker, 0, {folded, Value(chunks[i])}, "preduce");
+    }
+    result = folded.asInt();
+  });
+  return Value(result);
+}
+} // namespace
+
+void parallel::define(Environment &env) {
+  env.define("pmap", Value(new Builtin("pmap", pmap)));
+  env.define("preduce", Value(new Builtin("preduce", preduce)));
+}
@@ -0,0 +1,161 @@
+#include "../include/parser.hpp"
+#include "../include/arena.hpp"
+#include <charconv>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+Parser::Parser(Lexer &lexer) : lexer(lexer), current(lexer.next()) {}
+
+void Parser::advance() {
+  current = lexer.next();
+  if (lexer.lexError()) {
+    error("Invalid token");
+  }
+}
+
+void Parser::expect(TokenType type, const std::string &message) {
+  if (current.token != type) {
+    error(message);
+  }
+  advance();
+}
+
+void Parser::error(const std::string &message) const {
+  throw std::runtime_error("[line: " + std::to_string(current.line) +
+                           "] Error: " + message);
+}
+
+std::unique_ptr<Expression> Parser::next() {
+  if (lexer.lexError()) {
+    error("Invalid token");
+  }
+  if (current.token == TokenType::Eof) {
+    return nullptr;
+  }
+  return expression();
+}
+
+std::unique_ptr<Expression> Parser::expression() {
+  switch (current.token) {
+  case TokenType::Constant: {
+    int value;
+    const char *end = current.value.data() + current.value.size();
+    if (std::from_chars(current.value.data(), end, value).ec != std::errc()) {
+      error("Number out of range");
+    }
+    advance();
+    return std::make_unique<Constant>(value);
+  }
+  case TokenType::Identifier: {
+    Symbol symbol = current.symbol;
+    advance();
+    return std::make_unique<StringConstant>(symbol);
+  }
+  case TokenType::OpenParen: {
+    advance();
+    std::unique_ptr<Expression> exp = form();
+    expect(TokenType::CloseParen, "Expected ')'");
+    return exp;
+  }
+  case TokenType::StrConstant:
+    error("String literals are not supported");
+  case TokenType::Eof:
+    error("Unexpected end of input");
+  default:
+    error("Unexpected token");
+  }
+}
+
+std::unique_ptr<Expression> Parser::form() {
+  switch (current.token) {
+  case TokenType::Plus:
+    advance();
+    return arithmetic('+');
+  case TokenType::Minus:
+    advance();
+    return arithmetic('-');
+  case TokenType::Star:
+    advance();
+    return arithmetic('*');
+  case TokenType::Lambda:
+    advance();
+    return lambda();
+  case TokenType::CloseParen:
+    error("Empty list");
+  default:
+    break;
+  }
+
+  std::vector<std::unique_ptr<Expression>> exps;
+  while (current.token != TokenType::CloseParen) {
+    exps.push_back(expression());
+  }
+  auto list = std::make_unique<ExpressionList>(std::move(exps));
+  if (const char *problem = list->malformed()) {
+    error(problem);
+  }
+  return list;
+}
+
+std::unique_ptr<Expression> Parser::arithmetic(char op) {
+  std::unique_ptr<Expression> left = expression();
+  if (current.token == TokenType::CloseParen) {
+    error(std::string("Expected at least two operands for ") + op);
+  }
+  while (current.token != TokenType::CloseParen) {
+    left = std::make_unique<BinaryOperation>(op, std::move(left),
+                                             expression());
+  }
+  return left;
+}
+
+std::unique_ptr<Expression> Parser::lambda() {
+  expect(TokenType::OpenParen, "Expected '(' before the parameters");
+  std::vector<StringConstant> params;
+  while (current.token == TokenType::Identifier) {
+    params.push_back(StringConstant(current.symbol));
+    advance();
+  }
+  expect(TokenType::CloseParen, "Expected ')' after the parameters");
+  std::unique_ptr<Expression> body = expression();
+  if (current.token != TokenType::CloseParen) {
+    error("Expected a single expression as the body of a lambda");
+  }
+  return std::make_unique<Lambda>(std::move(params), std::move(body));
+}
+
+// Runs the forms lexer reads one after the other
+static Value runForms(Lexer &lexer, Environment &env,
+                      interpreter::Engine engine) {
+  Parser parser(lexer);
+  Value result(-1);
+  while (true) {
+    Arena arena;
+    std::unique_ptr<Expression> form;
+    {
+      Arena::Scope scope(arena);
+      form = parser.next();
+    }
+    if (!form)
+      break;
+    form = interpreter::fold(std::move(form));
+    result = interpreter::run(*form, env, engine);
+  }
+  return result;
+}
+
+Value interpreter::runSource(std::string source, Environment &env,
+                             Engine engine) {
+  Lexer lexer(std::move(source));
+  return runForms(lexer, env, engine);
+}
+
+Value interpreter::runFile(const std::string &path, Environment &env,
+                           Engine engine) {
+  SourceFile file(path);
+  Lexer lexer(file);
+  return runForms(lexer, env, engine);
+}
@@ -0,0 +1,132 @@
+#include "../include/ast.hpp"
+#include <utility>
+#include <vector>
+
+// Whether ins is one of the jumps the Compiler emits
+static bool isJump(Instruction ins) {
+  return ins.opCode() == OpCode::RELATIVE_JUMP ||
+         ins.opCode() == OpCode::RELATIVE_JUMP_IF_TRUE;
+}
+
+// The superinstruction replacing an arithmetic instruction whose right
+// operand is pushed by load, if there is one
+static bool fuseArithmetic(Instruction load, Instruction op, OpCode &fused) {
+  static const OpCode withConst[] = {OpCode::ADD_CONST, OpCode::SUB_CONST,
+                                     OpCode::MUL_CONST};
+  static const OpCode withLocal[] = {OpCode::ADD_LOCAL, OpCode::SUB_LOCAL,
+                                     OpCode::MUL_LOCAL};
+  static const OpCode withName[] = {OpCode::ADD_NAME, OpCode::SUB_NAME,
+                                    OpCode::MUL_NAME};
+
+  int which;
+  switch (op.opCode()) {
+  case OpCode::ADD:
+    which = 0;
+    break;
+  case OpCode::SUB:
+    which = 1;
+    break;
+  case OpCode::MUL:
+    which = 2;
+    break;
+  default:
+    return false;
+  }
+
+  switch (load.opCode()) {
+  case OpCode::LOAD_CONST:
+    fused = withConst[which];
+    return true;
+  case OpCode::LOAD_LOCAL:
+    fused = withLocal[which];
+    return true;
+  case OpCode::LOAD_NAME:
+    fused = withName[which];
+    return true;
+  default:
+    return false;
+  }
+}
+
+// Works on the naive code emitted by the Compiler, whose only jumps are
+// RELATIVE_JUMP and RELATIVE_JUMP_IF_TRUE and only go forward. Jumps are
+// threaded first; pairs are then fused unless the second instruction is a jump
+// target, and the offsets of the remaining jumps are recomputed last.
+void peephole(std::vector<Instruction> &ins) {
+  int size = ins.size();
+
+  // A jump to RETURN returns, a jump to a jump goes straight to its target
+  for (int pc = 0; pc < size; pc++) {
+    if (ins[pc].opCode() != OpCode::RELATIVE_JUMP)
+      continue;
+    int target = pc + 1 + ins[pc].arg();
+    while (ins[target].opCode() == OpCode::RELATIVE_JUMP)
+      target += 1 + ins[target].arg();
+    ins[pc] = ins[target].opCode() == OpCode::RETURN
+                  ? Instruction(OpCode::RETURN, 0)
+                  : Instruction(OpCode::RELATIVE_JUMP, target - pc - 1);
+  }
+
+  std::vector<bool> isTarget(size + 1, false);
+  for (int pc = 0; pc < size; pc++) {
+    if (isJump(ins[pc]))
+      isTarget[pc + 1 + ins[pc].arg()] = true;
+  }
+
+  // Rewrite, remembering where every old instruction went and the old target
+  // of every jump
+  std::vector<Instruction> out;
+  std::vector<int> moved(size + 1);
+  std::vector<int> targets; // by new index, -1 for non-jumps
+  for (int pc = 0; pc < size; pc++) {
+    moved[pc] = out.size();
+    Instruction cur = ins[pc];
+
+    if (cur.opCode() == OpCode::RELATIVE_JUMP && cur.arg() == 0)
+      continue;
+
+    if (pc + 1 < size && !isTarget[pc + 1]) {
+      Instruction next = ins[pc + 1];
+      OpCode fused;
+      bool done = false;
+      if (fuseArithmetic(cur, next, fused)) {
+        out.push_back(Instruction(fused, cur.arg()));
+        targets.push_back(-1);
+        done = true;
+      } else if (cur.opCode() == OpCode::LOAD_LOCAL &&
+                 next.opCode() == OpCode::LOAD_LOCAL &&
+                 Instruction::fits(cur.arg(), next.arg())) {
+        out.push_back(
+            Instruction(OpCode::LOAD_LOCAL_LOCAL, cur.arg(), next.arg()));
+        targets.push_back(-1);
+        done = true;
+      } else if (cur.opCode() == OpCode::LOAD_LOCAL &&
+                 next.opCode() == OpCode::RELATIVE_JUMP_IF_TRUE &&
+                 Instruction::fits(cur.arg(), next.arg())) {
+        // Offsets only shrink, so the final one fits if the old one does
+        out.push_back(Instruction(OpCode::JUMP_IF_LOCAL, cur.arg(), 0));
+        targets.push_back(pc + 2 + next.arg());
+        done = true;
+      }
+      if (done) {
+        moved[++pc] = out.size() - 1;
+        continue;
+      }
+    }
+
+    out.push_back(cur);
+    targets.push_back(isJump(cur) ? pc + 1 + cur.arg() : -1);
+  }
+  moved[size] = out.size();
+
+  for (int pc = 0; pc < static_cast<int>(out.size()); pc++) {
+    if (targets[pc] == -1)
+      continue;
+    int offset = moved[targets[pc]] - pc - 1;
+    out[pc] = out[pc].opCode() == OpCode::JUMP_IF_LOCAL
+                  ? Instruction(OpCode::JUMP_IF_LOCAL, out[pc].first(), offset)
+                  : Instruction(out[pc].opCode(), offset);
+  }
+
+  ins = std::move(out);
+}
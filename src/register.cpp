@@ -0,0 +1,755 @@
+#include "../include/register.hpp"
+#include "../include/ast.hpp"
+#include "../include/dispatch.hpp"
+#include "../include/interpreter.hpp"
+#include <algorithm>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+std::ostream &operator<<(std::ostream &os, const RegOpCode &opCode) {
+  switch (opCode) {
+#define OPCODE_NAME(op)                                                        \
+  case RegOpCode::op:                                                          \
+    os << #op;                                                                 \
+    break;
+    REGISTER_OPCODES(OPCODE_NAME)
+#undef OPCODE_NAME
+  }
+  return os;
+}
+
+RegisterInstruction::RegisterInstruction(RegOpCode op, int a, int b, int c) {
+  if (a < 0 || a > MAX_REGISTER || b < 0 || b > 0xff || c < 0 || c > 0xff) {
+    throw std::runtime_error("Instruction operand out of range");
+  }
+  word = (static_cast<uint32_t>(c) << 24) | (static_cast<uint32_t>(b) << 16) |
+         (static_cast<uint32_t>(a) << 8) | static_cast<uint32_t>(op);
+}
+
+RegisterInstruction::RegisterInstruction(RegOpCode op, int a, int bx) {
+  if (a < 0 || a > MAX_REGISTER || bx < -(1 << 15) || bx > 0xffff) {
+    throw std::runtime_error("Instruction operand out of range");
+  }
+  word = (static_cast<uint32_t>(bx) << 16) | (static_cast<uint32_t>(a) << 8) |
+         static_cast<uint32_t>(op);
+}
+
+std::ostream &operator<<(std::ostream &os, const RegisterInstruction &instr) {
+  os << "RegisterInstruction(opCode=" << instr.opCode() << ", a=" << instr.a()
+     << ", b=" << instr.b() << ", c=" << instr.c() << ")";
+  return os;
+}
+
+std::ostream &operator<<(std::ostream &os, const RegisterCode &code) {
+  os << "RegisterCode {registers: " << code.numRegisters
+     << ", locals: " << code.numLocals << ", instructions: [";
+  for (const auto &instr : code.instructions) {
+    os << instr << ", ";
+  }
+  os << "]}";
+  return os;
+}
+
+namespace {
+const Symbol val = SymbolTable::intern("val");
+const Symbol if_ = SymbolTable::intern("if");
+
+// The names a lambda body binds with val, in the order the Compiler would
+// declare them, without looking into nested lambdas
+class BindingScanner : public ExpressionVisitor {
+public:
+  std::vector<Symbol> bindings;
+
+  void visit(Constant &) override {}
+  void visit(StringConstant &) override {}
+  void visit(Lambda &) override {}
+
+  void visit(BinaryOperation &binOp) override {
+    binOp.getLeft().accept(*this);
+    binOp.getRight().accept(*this);
+  }
+
+  void visit(ExpressionList &list) override {
+    const auto &exps = list.getExpressions();
+    if (exps.empty())
+      return;
+    auto *head = dynamic_cast<StringConstant *>(exps[0].get());
+    auto *var = exps.size() == 3
+                    ? dynamic_cast<StringConstant *>(exps[1].get())
+                    : nullptr;
+    if (head && head->getSymbol() == val && var) {
+      exps[2]->accept(*this);
+      if (std::find(bindings.begin(), bindings.end(), var->getSymbol()) ==
+          bindings.end())
+        bindings.push_back(var->getSymbol());
+      return;
+    }
+    for (const auto &exp : exps) {
+      exp->accept(*this);
+    }
+  }
+};
+
+// Every name mentioned in an expression. Applied to the lambdas nested in a
+// body it over-approximates the variables they capture, which only costs a
+// cell for a variable that did not need one.
+class NameCollector : public ExpressionVisitor {
+public:
+  std::unordered_set<Symbol> names;
+  bool nested = false; // whether the visit is inside a nested lambda
+
+  void visit(Constant &) override {}
+
+  void visit(StringConstant &stringConstant) override {
+    if (nested)
+      names.insert(stringConstant.getSymbol());
+  }
+
+  void visit(BinaryOperation &binOp) override {
+    binOp.getLeft().accept(*this);
+    binOp.getRight().accept(*this);
+  }
+
+  void visit(ExpressionList &list) override {
+    for (const auto &exp : list.getExpressions()) {
+      exp->accept(*this);
+    }
+  }
+
+  void visit(Lambda &lambda) override {
+    bool outer = nested;
+    nested = true;
+    lambda.getBody().accept(*this);
+    nested = outer;
+  }
+};
+
+bool isForm(Expression &exp, Symbol form) {
+  auto *list = dynamic_cast<ExpressionList *>(&exp);
+  if (!list || list->getExpressions().empty())
+    return false;
+  auto *head =
+      dynamic_cast<StringConstant *>(list->getExpressions()[0].get());
+  return head && head->getSymbol() == form;
+}
+} // namespace
+
+RegisterCode interpreter::compileRegisters(Expression &exp) {
+  RegisterCompiler compiler;
+  return compiler.compile(exp);
+}
+
+RegisterCode RegisterCompiler::compile(Expression &exp) {
+  RegisterCode code;
+  units.push_back(Unit(&code, &arena));
+  compileReturn(exp, false);
+  code.nameCaches.assign(code.names.size(), NameCache());
+  units.pop_back();
+  return code;
+}
+
+void RegisterCompiler::emit(RegisterInstruction ins) {
+  units.back().code->instructions.push_back(ins);
+}
+
+// Index of value in the constant pool of the innermost code object
+int RegisterCompiler::constant(int value) {
+  Unit &unit = units.back();
+  auto it = unit.constantIndex.find(value);
+  if (it != unit.constantIndex.end())
+    return it->second;
+
+  int index = unit.code->constants.size();
+  unit.code->constants.push_back(value);
+  unit.constantIndex.insert({value, index});
+  return index;
+}
+
+// Index of name in the name table of the innermost code object
+int RegisterCompiler::name(Symbol name) {
+  Unit &unit = units.back();
+  auto it = unit.nameIndex.find(name);
+  if (it != unit.nameIndex.end())
+    return it->second;
+
+  int index = unit.code->names.size();
+  unit.code->names.push_back(name);
+  unit.nameIndex.insert({name, index});
+  return index;
+}
+
+// Index of the upvalue through which the lambda of units[unit] reaches a
+// variable bound in an enclosing lambda, or -1 if there is none
+int RegisterCompiler::upvalue(int unit, Symbol name) {
+  if (unit <= 1)
+    return -1;
+
+  Unit &current = units[unit];
+  auto cached = current.upvalueIndex.find(name);
+  if (cached != current.upvalueIndex.end())
+    return cached->second;
+
+  Unit &enclosing = units[unit - 1];
+  Upvalue up;
+  auto local = enclosing.localIndex.find(name);
+  if (local != enclosing.localIndex.end()) {
+    up = Upvalue{true, local->second};
+  } else {
+    int index = upvalue(unit - 1, name);
+    if (index == -1)
+      return -1;
+    up = Upvalue{false, index};
+  }
+
+  int index = current.code->upvalues.size();
+  current.code->upvalues.push_back(up);
+  current.upvalueIndex.insert({name, index});
+  return index;
+}
+
+// A fresh temporary above every register in use
+int RegisterCompiler::allocate() {
+  Unit &unit = units.back();
+  if (unit.top > RegisterInstruction::MAX_REGISTER) {
+    throw std::runtime_error("Expression needs too many registers");
+  }
+  int reg = unit.top++;
+  unit.code->numRegisters = std::max(unit.code->numRegisters, unit.top);
+  return reg;
+}
+
+// The register the visited expression should compute its value into
+int RegisterCompiler::dest() { return target >= 0 ? target : allocate(); }
+
+// Compiles exp and returns the register holding its value, which is a local
+// when exp names one. Temporaries the caller no longer needs are released by
+// resetting top.
+int RegisterCompiler::operand(Expression &exp) {
+  target = -1;
+  exp.accept(*this);
+  if (result == -1) {
+    result = allocate();
+    emit(RegisterInstruction(RegOpCode::LOAD_CONST, result, constant(-1)));
+  }
+  return result;
+}
+
+// Compiles exp so that its value ends up in reg
+void RegisterCompiler::into(Expression &exp, int reg) {
+  target = reg;
+  exp.accept(*this);
+  if (result == -1) {
+    emit(RegisterInstruction(RegOpCode::LOAD_CONST, reg, constant(-1)));
+  } else if (result != reg) {
+    emit(RegisterInstruction(RegOpCode::MOVE, reg, result, 0));
+  }
+  result = reg;
+}
+
+// Emits a jump to be patched later and returns its index
+int RegisterCompiler::jump(RegOpCode op, int a) {
+  emit(RegisterInstruction(op, a, 0));
+  return units.back().code->size() - 1;
+}
+
+// Points the jump at index at to the next instruction
+void RegisterCompiler::patch(int at) {
+  RegisterCode &code = *units.back().code;
+  RegisterInstruction ins = code.instructions[at];
+  code.instructions[at] = RegisterInstruction(
+      ins.opCode(), ins.a(), static_cast<int>(code.size()) - at - 1);
+}
+
+// Compiles exp as the value a code object returns. Calls in a lambda become
+// tail calls and an if returns from each arm.
+void RegisterCompiler::compileReturn(Expression &exp, bool inLambda) {
+  int mark = units.back().top;
+  auto *list = dynamic_cast<ExpressionList *>(&exp);
+  if (list && list->malformed()) {
+    throw std::runtime_error(list->malformed());
+  }
+
+  if (isForm(exp, if_)) {
+    const auto &exps = list->getExpressions();
+    int cond = operand(*exps[1]);
+    int to_true = jump(RegOpCode::JUMP_IF_TRUE, cond);
+    units.back().top = mark;
+    compileReturn(*exps[3], inLambda);
+    patch(to_true);
+    compileReturn(*exps[2], inLambda);
+    return;
+  }
+
+  if (inLambda && list && !isForm(exp, val)) {
+    call(list->getExpressions(), true);
+    units.back().top = mark;
+    return;
+  }
+
+  int reg = operand(exp);
+  units.back().top = mark;
+  emit(RegisterInstruction(RegOpCode::RETURN, reg, 0, 0));
+}
+
+// Puts the callee and the arguments in consecutive fresh registers and calls.
+// The temporaries of each, such as those of a nested call, are released
+// before the next is allocated, so they do not come between the registers.
+void RegisterCompiler::call(const std::vector<std::unique_ptr<Expression>> &exps,
+                            bool tail) {
+  int base = allocate();
+  into(*exps[0], base);
+  units.back().top = base + 1;
+  for (size_t i = 1; i < exps.size(); i++) {
+    int reg = allocate();
+    into(*exps[i], reg);
+    units.back().top = reg + 1;
+  }
+  emit(RegisterInstruction(tail ? RegOpCode::TAIL_CALL
+                                : RegOpCode::CALL_FUNCTION,
+                           base, exps.size() - 1, 0));
+  units.back().top = base + 1;
+  result = base;
+}
+
+void RegisterCompiler::visit(Constant &c) {
+  int reg = dest();
+  emit(RegisterInstruction(RegOpCode::LOAD_CONST, reg,
+                           constant(c.getValue())));
+  result = reg;
+}
+
+void RegisterCompiler::visit(StringConstant &s) {
+  Symbol symbol = s.getSymbol();
+  int current = units.size() - 1;
+  if (current > 0) {
+    Unit &unit = units.back();
+    auto it = unit.localIndex.find(symbol);
+    if (it != unit.localIndex.end()) {
+      if (!unit.captured.count(symbol)) {
+        result = it->second;
+        return;
+      }
+      int reg = dest();
+      emit(RegisterInstruction(RegOpCode::LOAD_CELL, reg, it->second, 0));
+      result = reg;
+      return;
+    }
+
+    int index = upvalue(current, symbol);
+    if (index != -1) {
+      int reg = dest();
+      emit(RegisterInstruction(RegOpCode::LOAD_UPVALUE, reg, index, 0));
+      result = reg;
+      return;
+    }
+  }
+
+  int reg = dest();
+  emit(RegisterInstruction(RegOpCode::LOAD_NAME, reg, name(symbol)));
+  result = reg;
+}
+
+void RegisterCompiler::visit(BinaryOperation &binOp) {
+  RegOpCode op, with_const;
+  switch (binOp.getOperator()) {
+  case '+':
+    op = RegOpCode::ADD;
+    with_const = RegOpCode::ADD_CONST;
+    break;
+  case '-':
+    op = RegOpCode::SUB;
+    with_const = RegOpCode::SUB_CONST;
+    break;
+  case '*':
+    op = RegOpCode::MUL;
+    with_const = RegOpCode::MUL_CONST;
+    break;
+  default:
+    throw std::runtime_error("Unsupported instruction");
+  }
+
+  int reg = dest();
+  int mark = units.back().top;
+  int left = operand(binOp.getLeft());
+
+  auto *right_const = dynamic_cast<Constant *>(&binOp.getRight());
+  int k = right_const ? constant(right_const->getValue()) : -1;
+  if (k >= 0 && k <= 0xff) {
+    emit(RegisterInstruction(with_const, reg, left, k));
+  } else {
+    int right = operand(binOp.getRight());
+    emit(RegisterInstruction(op, reg, left, right));
+  }
+  units.back().top = mark;
+  result = reg;
+}
+
+void RegisterCompiler::visit(ExpressionList &list) {
+  const auto &exps = list.getExpressions();
+  if (const char *problem = list.malformed()) {
+    throw std::runtime_error(problem);
+  }
+  int want = target;
+
+  if (isForm(list, val)) {
+    auto *var = dynamic_cast<const StringConstant *>(exps[1].get());
+    if (!var) {
+      throw std::runtime_error("Unsupported instruction");
+    }
+    Symbol symbol = var->getSymbol();
+    int mark = units.back().top;
+
+    if (units.size() > 1) {
+      // The value is computed before the name is declared, so it still sees
+      // any outer binding
+      Unit &unit = units.back();
+      int slot = unit.slots.at(symbol);
+      if (unit.captured.count(symbol)) {
+        int value = operand(*exps[2]);
+        emit(RegisterInstruction(RegOpCode::STORE_CELL, slot, value, 0));
+      } else {
+        into(*exps[2], slot);
+      }
+      units.back().localIndex[symbol] = slot;
+    } else {
+      int value = operand(*exps[2]);
+      emit(RegisterInstruction(RegOpCode::STORE_NAME, value, name(symbol)));
+    }
+    units.back().top = mark;
+    result = -1;
+
+  } else if (isForm(list, if_)) {
+    int reg = want >= 0 ? want : allocate();
+    int mark = units.back().top;
+    int cond = operand(*exps[1]);
+    int to_true = jump(RegOpCode::JUMP_IF_TRUE, cond);
+    units.back().top = mark;
+    into(*exps[3], reg);
+    int to_end = jump(RegOpCode::JUMP, 0);
+    patch(to_true);
+    into(*exps[2], reg);
+    patch(to_end);
+    result = reg;
+
+  } else {
+    call(exps, false);
+  }
+}
+
+void RegisterCompiler::visit(Lambda &lambda) {
+  int reg = dest();
+
+  // Compile the body into its own code object. Parameters take the first
+  // registers, the vals of the body the ones after them.
+  auto code = std::make_shared<RegisterCode>();
+  units.push_back(Unit(code.get(), &arena));
+  Unit &unit = units.back();
+  for (const auto &param : lambda.getParams()) {
+    if (unit.slots.count(param.getSymbol())) {
+      throw std::runtime_error("Duplicate parameter " + param.getValue());
+    }
+    code->params.push_back(param.getSymbol());
+    unit.slots.insert({param.getSymbol(), unit.slots.size()});
+    unit.localIndex.insert({param.getSymbol(), unit.localIndex.size()});
+  }
+  BindingScanner bindings;
+  lambda.getBody().accept(bindings);
+  for (Symbol binding : bindings.bindings) {
+    unit.slots.insert({binding, unit.slots.size()});
+  }
+  NameCollector nested;
+  lambda.getBody().accept(nested);
+  for (const auto &slot : unit.slots) {
+    if (nested.names.count(slot.first))
+      unit.captured.insert(slot.first);
+  }
+
+  code->numLocals = unit.slots.size();
+  if (code->numLocals > RegisterInstruction::MAX_REGISTER + 1) {
+    throw std::runtime_error("Expression needs too many registers");
+  }
+  code->numRegisters = code->numLocals;
+  unit.top = code->numLocals;
+  std::vector<bool> captured(code->numLocals, false);
+  for (const auto &slot : unit.slots) {
+    captured[slot.second] = unit.captured.count(slot.first) > 0;
+  }
+  for (int slot = 0; slot < code->numLocals; slot++) {
+    if (captured[slot])
+      emit(RegisterInstruction(RegOpCode::MAKE_CELL, slot, 0, 0));
+  }
+
+  compileReturn(lambda.getBody(), true);
+  code->nameCaches.assign(code->names.size(), NameCache());
+  units.pop_back();
+
+  // Register it with the enclosing code object
+  auto &functions = units.back().code->functions;
+  int index = functions.size();
+  functions.push_back(code);
+  emit(RegisterInstruction(RegOpCode::MAKE_FUNCTION, reg, index));
+  result = reg;
+}
+
+namespace {
+// An activation record of the register machine. The callee of a call sits in
+// the register just below the window of the frame.
+struct RegisterFrame {
+  const RegisterCode *code;
+  const RegisterInstruction *pc; // return address while a callee is running
+  RegisterFunction *function;    // null for the top level
+  Value *regs;                   // register 0
+};
+
+struct RegisterMachine {
+  std::unique_ptr<Value[]> stack{new Value[interpreter::STACK_SIZE]};
+  std::vector<RegisterFrame> frames;
+};
+
+thread_local RegisterMachine registerMachine;
+} // namespace
+
+Value interpreter::evalRegisters(const RegisterCode &program, Environment &env) {
+  std::vector<RegisterFrame> &frames = registerMachine.frames;
+  Value *stack = registerMachine.stack.get();
+  Value *const stack_end = stack + STACK_SIZE;
+  int limit = recursionLimit();
+  frames.clear();
+  frames.reserve(limit + 1);
+
+  if (program.numRegisters > STACK_SIZE) {
+    throw std::runtime_error("Stack overflow");
+  }
+  frames.push_back(RegisterFrame{&program, nullptr, nullptr, stack});
+
+  // An error leaves the registers of the frames it unwinds holding values.
+  // They are released on the way out, as eval does with its stack.
+  struct Unwind {
+    std::vector<RegisterFrame> &frames;
+    ~Unwind() {
+      if (frames.empty())
+        return;
+      const RegisterFrame &top = frames.back();
+      Value *end = top.regs + top.code->numRegisters;
+      for (Value *slot = frames.front().regs; slot < end; slot++)
+        *slot = Value();
+      frames.clear();
+    }
+  } unwind{frames};
+
+  // The state of the running frame is kept in locals
+  RegisterFrame *frame = &frames.back();
+  const RegisterCode *code = &program;
+  const RegisterInstruction *pc = code->instructions.data();
+  Value *regs = stack;
+  RegisterInstruction ins(RegOpCode::RETURN, 0, 0, 0);
+
+#ifdef INTERP_COMPUTED_GOTO
+  static void *dispatch_table[] = {
+#define OPCODE_LABEL(op) &&TARGET_##op,
+      REGISTER_OPCODES(OPCODE_LABEL)
+#undef OPCODE_LABEL
+  };
+
+  DISPATCH();
+#else
+  for (;;) {
+    ins = *pc++;
+    COUNT_DISPATCH();
+
+    switch (ins.opCode()) {
+#endif
+
+  TARGET(MOVE) {
+    regs[ins.a()] = regs[ins.b()];
+    DISPATCH();
+  }
+
+  TARGET(LOAD_CONST) {
+    regs[ins.a()] = code->constants[ins.bx()];
+    DISPATCH();
+  }
+
+  TARGET(LOAD_NAME) {
+    regs[ins.a()] =
+        code->nameCaches[ins.bx()].lookup(env, code->names[ins.bx()]);
+    DISPATCH();
+  }
+
+  TARGET(STORE_NAME) {
+    env.define(code->names[ins.bx()], regs[ins.a()]);
+    DISPATCH();
+  }
+
+  TARGET(LOAD_UPVALUE) {
+    regs[ins.a()] = frame->function->upvalues[ins.b()].asCell()->value;
+    DISPATCH();
+  }
+
+  TARGET(MAKE_CELL) {
+    regs[ins.a()] = new Cell(std::move(regs[ins.a()]));
+    DISPATCH();
+  }
+
+  TARGET(LOAD_CELL) {
+    regs[ins.a()] = regs[ins.b()].asCell()->value;
+    DISPATCH();
+  }
+
+  TARGET(STORE_CELL) {
+    regs[ins.a()].asCell()->value = regs[ins.b()];
+    DISPATCH();
+  }
+
+#define ARITHMETIC(op, fn, right)                                              \
+  TARGET(op) {                                                                 \
+    {                                                                          \
+      const Value &b = right;                                                  \
+      if (!Value::bothInts(regs[ins.b()], b)) {                                \
+        throw std::runtime_error("Operands are not integers");                 \
+      }                                                                        \
+      regs[ins.a()] = Value::fn(regs[ins.b()], b);                             \
+    }                                                                          \
+    DISPATCH();                                                                \
+  }
+
+  ARITHMETIC(ADD, add, regs[ins.c()])
+  ARITHMETIC(SUB, sub, regs[ins.c()])
+  ARITHMETIC(MUL, mul, regs[ins.c()])
+  ARITHMETIC(ADD_CONST, add, Value(code->constants[ins.c()]))
+  ARITHMETIC(SUB_CONST, sub, Value(code->constants[ins.c()]))
+  ARITHMETIC(MUL_CONST, mul, Value(code->constants[ins.c()]))
+#undef ARITHMETIC
+
+  TARGET(JUMP) {
+    pc += ins.sbx();
+    DISPATCH();
+  }
+
+  TARGET(JUMP_IF_TRUE) {
+    if (!regs[ins.a()].isInt()) {
+      throw std::runtime_error("Condition is not an integer");
+    }
+    if (regs[ins.a()].asInt())
+      pc += ins.sbx();
+    DISPATCH();
+  }
+
+  TARGET(MAKE_FUNCTION) {
+    {
+      const auto &function = code->functions[ins.bx()];
+      RegisterFunction *closure = new RegisterFunction(function);
+      regs[ins.a()] = closure;
+      closure->upvalues.reserve(function->upvalues.size());
+      for (const Upvalue &up : function->upvalues) {
+        closure->upvalues.push_back(up.isLocal
+                                        ? regs[up.index]
+                                        : frame->function->upvalues[up.index]);
+      }
+    }
+    DISPATCH();
+  }
+
+  TARGET(CALL_FUNCTION) {
+    {
+      int nargs = ins.b();
+      Value *callee_slot = regs + ins.a();
+      if (!callee_slot->isRegisterFunction()) {
+        throw std::runtime_error("Called object is not a function");
+      }
+      RegisterFunction *fn = callee_slot->asRegisterFunction();
+      const RegisterCode *callee = fn->code.get();
+      if (nargs != static_cast<int>(callee->params.size())) {
+        throw std::runtime_error("Wrong number of arguments");
+      }
+      if (static_cast<int>(frames.size()) > limit) {
+        throw std::runtime_error("Maximum recursion depth exceeded");
+      }
+      Value *callee_regs = callee_slot + 1;
+      if (stack_end - callee_regs < callee->numRegisters) {
+        throw std::runtime_error("Stack overflow");
+      }
+
+      // Registers of vals may hold dead temporaries of the caller
+      for (int i = nargs; i < callee->numLocals; i++) {
+        callee_regs[i] = Value();
+      }
+
+      frame->pc = pc;
+      frames.push_back(RegisterFrame{callee, nullptr, fn, callee_regs});
+      frame = &frames.back();
+      code = callee;
+      regs = callee_regs;
+      pc = code->instructions.data();
+    }
+    DISPATCH();
+  }
+
+  TARGET(TAIL_CALL) {
+    {
+      // Only emitted in lambda bodies: the callee and the arguments replace
+      // the running function and its parameters
+      int nargs = ins.b();
+      Value *callee_slot = regs + ins.a();
+      if (!callee_slot->isRegisterFunction()) {
+        throw std::runtime_error("Called object is not a function");
+      }
+      RegisterFunction *fn = callee_slot->asRegisterFunction();
+      const RegisterCode *callee = fn->code.get();
+      if (nargs != static_cast<int>(callee->params.size())) {
+        throw std::runtime_error("Wrong number of arguments");
+      }
+      if (stack_end - regs < callee->numRegisters) {
+        throw std::runtime_error("Stack overflow");
+      }
+
+      // The callee is moved over the running function first, which keeps fn
+      // alive while the old registers are released
+      for (int i = -1; i < nargs; i++) {
+        regs[i] = std::move(callee_slot[i + 1]);
+      }
+      int used = std::max(code->numRegisters, callee->numLocals);
+      for (int i = nargs; i < used; i++) {
+        regs[i] = Value();
+      }
+
+      frame->code = callee;
+      frame->function = fn;
+      code = callee;
+      pc = code->instructions.data();
+    }
+    DISPATCH();
+  }
+
+  TARGET(RETURN) {
+    {
+      Value result = std::move(regs[ins.a()]);
+      for (int i = 0; i < code->numRegisters; i++) {
+        regs[i] = Value();
+      }
+      if (frames.size() == 1) {
+        frames.clear();
+        return result;
+      }
+
+      // Replace the callee slot with the result and resume the caller
+      regs[-1] = std::move(result);
+      frames.pop_back();
+      frame = &frames.back();
+      code = frame->code;
+      regs = frame->regs;
+      pc = frame->pc;
+    }
+    DISPATCH();
+  }
+
+#ifndef INTERP_COMPUTED_GOTO
+    default:
+      throw std::runtime_error("Unsupported instruction");
+    }
+  }
+#endif
+}
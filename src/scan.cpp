@@ -0,0 +1,274 @@
+#include "../include/scan.hpp"
+#include <cstdint>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define SCAN_X86
+#include <immintrin.h>
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+// Character at a time, for other machines and the last few characters
+
+static size_t scalarWhitespace(const char *text, size_t i, size_t end,
+                               int &lines) {
+  for (; i < end; i++) {
+    char c = text[i];
+    if (c == '\n')
+      lines++;
+    else if (c != ' ' && c != '\t' && c != '\r')
+      break;
+  }
+  return i;
+}
+
+static bool isDigit(char c) { return c >= '0' && c <= '9'; }
+
+static size_t scalarIdentifier(const char *text, size_t i, size_t end) {
+  for (; i < end; i++) {
+    char c = text[i];
+    if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_' ||
+          isDigit(c)))
+      break;
+  }
+  return i;
+}
+
+static size_t scalarDigits(const char *text, size_t i, size_t end) {
+  while (i < end && isDigit(text[i]))
+    i++;
+  return i;
+}
+
+static size_t scalarUntil(const char *text, size_t i, size_t end, char c,
+                          int &lines) {
+  for (; i < end && text[i] != c; i++) {
+    if (text[i] == '\n')
+      lines++;
+  }
+  return i;
+}
+
+#ifdef SCAN_X86
+
+// Each step loads a block and computes a bit mask of the characters in the
+// run. A full mask moves on to the next block; otherwise the lowest clear bit
+// is where the run ends.
+
+static inline __m128i sseLoad(const char *p) {
+  return _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+}
+
+static inline __m128i sseIs(__m128i c, char x) {
+  return _mm_cmpeq_epi8(c, _mm_set1_epi8(x));
+}
+
+// c - lo is at most span, as unsigned bytes
+static inline __m128i sseInRange(__m128i c, char lo, char span) {
+  __m128i offset = _mm_sub_epi8(c, _mm_set1_epi8(lo));
+  return _mm_cmpeq_epi8(_mm_min_epu8(offset, _mm_set1_epi8(span)), offset);
+}
+
+static size_t sseWhitespace(const char *text, size_t i, size_t end,
+                            int &lines) {
+  for (; i + 16 <= end; i += 16) {
+    __m128i c = sseLoad(text + i);
+    unsigned newlines = _mm_movemask_epi8(sseIs(c, '\n'));
+    unsigned run = _mm_movemask_epi8(
+        _mm_or_si128(_mm_or_si128(sseIs(c, ' '), sseIs(c, '\t')),
+                     _mm_or_si128(sseIs(c, '\r'), sseIs(c, '\n'))));
+    if (run != 0xffff) {
+      unsigned stop = __builtin_ctz(~run);
+      lines += __builtin_popcount(newlines & ((1u << stop) - 1));
+      return i + stop;
+    }
+    lines += __builtin_popcount(newlines);
+  }
+  return scalarWhitespace(text, i, end, lines);
+}
+
+static size_t sseIdentifier(const char *text, size_t i, size_t end) {
+  for (; i + 16 <= end; i += 16) {
+    __m128i c = sseLoad(text + i);
+    __m128i letter = sseInRange(_mm_or_si128(c, _mm_set1_epi8(0x20)), 'a', 25);
+    unsigned run = _mm_movemask_epi8(_mm_or_si128(
+        _mm_or_si128(letter, sseInRange(c, '0', 9)), sseIs(c, '_')));
+    if (run != 0xffff)
+      return i + __builtin_ctz(~run);
+  }
+  return scalarIdentifier(text, i, end);
+}
+
+static size_t sseDigits(const char *text, size_t i, size_t end) {
+  for (; i + 16 <= end; i += 16) {
+    unsigned run = _mm_movemask_epi8(sseInRange(sseLoad(text + i), '0', 9));
+    if (run != 0xffff)
+      return i + __builtin_ctz(~run);
+  }
+  return scalarDigits(text, i, end);
+}
+
+static size_t sseUntil(const char *text, size_t i, size_t end, char x,
+                       int &lines) {
+  for (; i + 16 <= end; i += 16) {
+    __m128i c = sseLoad(text + i);
+    unsigned newlines = _mm_movemask_epi8(sseIs(c, '\n'));
+    unsigned found = _mm_movemask_epi8(sseIs(c, x));
+    if (found != 0) {
+      unsigned stop = __builtin_ctz(found);
+      lines += __builtin_popcount(newlines & ((1u << stop) - 1));
+      return i + stop;
+    }
+    lines += __builtin_popcount(newlines);
+  }
+  return scalarUntil(text, i, end, x, lines);
+}
+
+TARGET_AVX2 static inline __m256i avxLoad(const char *p) {
+  return _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+}
+
+TARGET_AVX2 static inline __m256i avxIs(__m256i c, char x) {
+  return _mm256_cmpeq_epi8(c, _mm256_set1_epi8(x));
+}
+
+TARGET_AVX2 static inline __m256i avxInRange(__m256i c, char lo, char span) {
+  __m256i offset = _mm256_sub_epi8(c, _mm256_set1_epi8(lo));
+  return _mm256_cmpeq_epi8(_mm256_min_epu8(offset, _mm256_set1_epi8(span)),
+                           offset);
+}
+
+TARGET_AVX2 static size_t avxWhitespace(const char *text, size_t i, size_t end,
+                                 int &lines) {
+  for (; i + 32 <= end; i += 32) {
+    __m256i c = avxLoad(text + i);
+    uint32_t newlines = _mm256_movemask_epi8(avxIs(c, '\n'));
+    uint32_t run = _mm256_movemask_epi8(
+        _mm256_or_si256(_mm256_or_si256(avxIs(c, ' '), avxIs(c, '\t')),
+                        _mm256_or_si256(avxIs(c, '\r'), avxIs(c, '\n'))));
+    if (run != 0xffffffff) {
+      unsigned stop = __builtin_ctz(~run);
+      lines += __builtin_popcount(newlines & ((1u << stop) - 1));
+      return i + stop;
+    }
+    lines += __builtin_popcount(newlines);
+  }
+  return sseWhitespace(text, i, end, lines);
+}
+
+TARGET_AVX2 static size_t avxIdentifier(const char *text, size_t i, size_t end) {
+  for (; i + 32 <= end; i += 32) {
+    __m256i c = avxLoad(text + i);
+    __m256i letter =
+        avxInRange(_mm256_or_si256(c, _mm256_set1_epi8(0x20)), 'a', 25);
+    uint32_t run = _mm256_movemask_epi8(_mm256_or_si256(
+        _mm256_or_si256(letter, avxInRange(c, '0', 9)), avxIs(c, '_')));
+    if (run != 0xffffffff)
+      return i + __builtin_ctz(~run);
+  }
+  return sseIdentifier(text, i, end);
+}
+
+TARGET_AVX2 static size_t avxDigits(const char *text, size_t i, size_t end) {
+  for (; i + 32 <= end; i += 32) {
+    uint32_t run = _mm256_movemask_epi8(avxInRange(avxLoad(text + i), '0', 9));
+    if (run != 0xffffffff)
+      return i + __builtin_ctz(~run);
+  }
+  return sseDigits(text, i, end);
+}
+
+TARGET_AVX2 static size_t avxUntil(const char *text, size_t i, size_t end, char x,
+                            int &lines) {
+  for (; i + 32 <= end; i += 32) {
+    __m256i c = avxLoad(text + i);
+    uint32_t newlines = _mm256_movemask_epi8(avxIs(c, '\n'));
+    uint32_t found = _mm256_movemask_epi8(avxIs(c, x));
+    if (found != 0) {
+      unsigned stop = __builtin_ctz(found);
+      lines += __builtin_popcount(newlines & ((1u << stop) - 1));
+      return i + stop;
+    }
+    lines += __builtin_popcount(newlines);
+  }
+  return sseUntil(text, i, end, x, lines);
+}
+
+#endif
+
+namespace {
+struct Scanners {
+  size_t (*whitespace)(const char *, size_t, size_t, int &);
+  size_t (*identifier)(const char *, size_t, size_t);
+  size_t (*digits)(const char *, size_t, size_t);
+  size_t (*until)(const char *, size_t, size_t, char, int &);
+};
+
+const Scanners scalar = {scalarWhitespace, scalarIdentifier, scalarDigits,
+                         scalarUntil};
+#ifdef SCAN_X86
+const Scanners sse2 = {sseWhitespace, sseIdentifier, sseDigits, sseUntil};
+const Scanners avx2 = {avxWhitespace, avxIdentifier, avxDigits, avxUntil};
+#endif
+
+scan::Level detect() {
+#ifdef SCAN_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    return scan::Level::AVX2;
+  if (__builtin_cpu_supports("sse2"))
+    return scan::Level::SSE2;
+#endif
+  return scan::Level::Scalar;
+}
+
+// The scanners of level, which the CPU supports
+const Scanners *scannersFor(scan::Level level) {
+  switch (level) {
+#ifdef SCAN_X86
+  case scan::Level::AVX2:
+    return &avx2;
+  case scan::Level::SSE2:
+    return &sse2;
+#endif
+  default:
+    return &scalar;
+  }
+}
+
+// The level in use and its scanners are set when the program starts, before
+// any thread lexes, and only change in setLevel
+const scan::Level best = detect();
+scan::Level active = best;
+const Scanners *scanners = scannersFor(best);
+
+const Scanners &current() {
+  // Null only while the static objects of other files are being built
+  return scanners ? *scanners : scalar;
+}
+} // namespace
+
+scan::Level scan::level() { return active; }
+scan::Level scan::supported() { return best; }
+
+void scan::setLevel(Level level) {
+  active = level < best ? level : best;
+  scanners = scannersFor(active);
+}
+
+size_t scan::whitespace(const char *text, size_t from, size_t end,
+                        int &lines) {
+  return current().whitespace(text, from, end, lines);
+}
+
+size_t scan::identifier(const char *text, size_t from, size_t end) {
+  return current().identifier(text, from, end);
+}
+
+size_t scan::digits(const char *text, size_t from, size_t end) {
+  return current().digits(text, from, end);
+}
+
+size_t scan::until(const char *text, size_t from, size_t end, char c,
+                   int &lines) {
+  return current().until(text, from, end, c, lines);
+}
@@ -0,0 +1,35 @@
+#include "../include/symbol.hpp"
+#include <mutex>
+
+SymbolTable &SymbolTable::instance() {
+  static SymbolTable table;
+  return table;
+}
+
+Symbol SymbolTable::intern(std::string_view name) {
+  SymbolTable &table = instance();
+  {
+    std::shared_lock<std::shared_mutex> lock(table.mutex);
+    auto it = table.symbols.find(name);
+    if (it != table.symbols.end())
+      return it->second;
+  }
+
+  // Not seen before: look again under the exclusive lock, another thread may
+  // have added it in the meantime
+  std::unique_lock<std::shared_mutex> lock(table.mutex);
+  auto it = table.symbols.find(name);
+  if (it != table.symbols.end())
+    return it->second;
+
+  Symbol symbol = static_cast<Symbol>(table.names.size());
+  const std::string &stored = table.names.emplace_back(name);
+  table.symbols.insert({stored, symbol});
+  return symbol;
+}
+
+const std::string &SymbolTable::name(Symbol symbol) {
+  SymbolTable &table = instance();
+  std::shared_lock<std::shared_mutex> lock(table.mutex);
+  return table.names.at(static_cast<uint32_t>(symbol));
+}
@@ -4,23 +4,28 @@
 
 #include <boost/test/included/unit_test.hpp>
 
+#include "../include/arena.hpp"
+#include "../include/bytecode.hpp"
+#include "../include/cache.hpp"
+#include "../include/gc.hpp"
 #include "../include/lexer.hpp"
+#include "../include/parallel.hpp"
+#include "../include/parser.hpp"
 #include "../include/ast.hpp"
 #include "../include/interpreter.hpp"
+#include "../include/isolate.hpp"
+#include "../include/register.hpp"
+#include "../include/scan.hpp"
 
+#include <filesystem>
+#include <fstream>
+#include <thread>
 #include <vector>
 
-using Code = std::vector<Instruction>;
+using Code = interpreter::Code;
 
-std::ostream &operator<<(std::ostream &os,
-                         const std::vector<Instruction> &vec) {
-  os << "[ ";
-  for (const auto &inst : vec) {
-    os << inst << ",\n";
-  }
-  os << "]";
-  return os;
-}
+// Tests of the code the visitors emit turn the peephole pass and folding off
+static const CompileOptions naive = {false, false};
 
 BOOST_AUTO_TEST_CASE(lex_val) {
     std::string text = "(val 5)";
@@ -47,6 +52,40 @@ BOOST_AUTO_TEST_CASE(lex_with_newline) {
     BOOST_TEST(!lexer.lexError());
 }
 
+BOOST_AUTO_TEST_CASE(lex_interns_identifiers) {
+    std::string text = "(val xs (lambda (xs) (+ xs 1)))";
+    Lexer lexer(text);
+    std::vector<Token> tokens = lexer.lex();
+    BOOST_TEST(!lexer.lexError());
+
+    BOOST_TEST(tokens[1].value == "val");
+    BOOST_TEST(tokens[2].value == "xs");
+    BOOST_TEST(tokens[2].symbol == SymbolTable::intern("xs"));
+    BOOST_TEST(tokens[2].symbol == tokens[6].symbol);
+    BOOST_TEST(tokens[2].symbol != tokens[1].symbol);
+    BOOST_TEST(SymbolTable::name(tokens[2].symbol) == "xs");
+}
+
+BOOST_AUTO_TEST_CASE(intern_from_many_threads) {
+    // Every thread sees the same symbol for the same name
+    std::vector<std::vector<Symbol>> seen(4);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; t++) {
+      threads.emplace_back([t, &seen] {
+        for (int i = 0; i < 1000; i++) {
+          seen[t].push_back(SymbolTable::intern("sym" + std::to_string(i)));
+        }
+      });
+    }
+    for (auto &thread : threads) {
+      thread.join();
+    }
+    for (int t = 1; t < 4; t++) {
+      BOOST_TEST(seen[t] == seen[0]);
+    }
+    BOOST_TEST(SymbolTable::name(seen[0][42]) == "sym42");
+}
+
 BOOST_AUTO_TEST_CASE(lex_unterminated) {
     std::string text = "(val \"x";
     Lexer lexer(text);
@@ -54,12 +93,102 @@ BOOST_AUTO_TEST_CASE(lex_unterminated) {
     BOOST_TEST(lexer.lexError());
 }
 
+BOOST_AUTO_TEST_CASE(lex_every_scan_level) {
+    // Runs longer than a vector, runs crossing a vector boundary and runs
+    // ending right at the end of the text
+    std::string text;
+    for (int i = 0; i < 40; i++) {
+        text += std::string(i, ' ') + "(val " + std::string(i + 1, 'x') +
+                "_Z9 " + std::string(i + 1, '7') + ")" +
+                std::string(i % 5, '\n') + "\t\r// " +
+                std::string(i * 2, 'c') + " \"//\n" + "\"\n\" \"" +
+                std::string(i, '\n') + std::string(i, 's') + "\" ";
+    }
+    text += "(x " + std::string(70, '1');
+
+    scan::Level saved = scan::level();
+    scan::setLevel(scan::Level::Scalar);
+    Lexer scalar(text);
+    std::vector<Token> expected = scalar.lex();
+    BOOST_TEST(scalar.lexError()); // the number runs into the end
+    for (scan::Level level : {scan::Level::SSE2, scan::Level::AVX2}) {
+        scan::setLevel(level);
+        BOOST_TEST((scan::level() <= level));
+        Lexer lexer(text);
+        std::vector<Token> tokens = lexer.lex();
+        BOOST_TEST(lexer.lexError());
+        BOOST_TEST(tokens.size() == expected.size());
+        for (size_t i = 0; i < tokens.size() && i < expected.size(); i++) {
+            BOOST_TEST(tokens[i].token == expected[i].token);
+            BOOST_TEST(tokens[i].value == expected[i].value);
+            BOOST_TEST(tokens[i].line == expected[i].line);
+        }
+    }
+    scan::setLevel(saved);
+
+    BOOST_TEST(expected[2].value == "x_Z9");
+    BOOST_TEST(expected[3].value == "7");
+    BOOST_TEST(expected[5].token == TokenType::StrConstant);
+    BOOST_TEST(expected[5].value == "\n"); // the comment ends at the newline
+    BOOST_TEST(expected[6].line == 3);
+    BOOST_TEST(expected[6].value == "");
+    BOOST_TEST(expected.back().line == expected[expected.size() - 3].line);
+}
+
+BOOST_AUTO_TEST_CASE(lex_parallel) {
+    // Forms spanning lines, and parens, quotes and newlines inside strings
+    // and comments, none of which may be split
+    std::string text;
+    for (int i = 0; i < 20000; i++) {
+        text += "(val f" + std::to_string(i) + "\n  (lambda (x) // (\"\n" +
+                "    (+ x \"(\n\" " + std::to_string(i) + ")))\n";
+    }
+    text += "(f1 \"unterminated";
+
+    Lexer serial(text);
+    std::vector<Token> expected = serial.lex();
+    BOOST_TEST(serial.lexError());
+    for (unsigned threads : {1u, 3u, 8u}) {
+        Lexer lexer(text);
+        std::vector<Token> tokens = lexer.lexParallel(threads);
+        BOOST_TEST(lexer.lexError());
+        BOOST_TEST(tokens.size() == expected.size());
+        for (size_t i = 0; i < tokens.size() && i < expected.size(); i++) {
+            BOOST_TEST(tokens[i].token == expected[i].token);
+            BOOST_TEST(tokens[i].value == expected[i].value);
+            BOOST_TEST(tokens[i].line == expected[i].line);
+            BOOST_TEST(tokens[i].symbol == expected[i].symbol);
+        }
+        BOOST_TEST(lexer.next().token == TokenType::Eof);
+    }
+
+    Lexer small("(+ 1\n 2)");
+    std::vector<Token> tokens = small.lexParallel(4);
+    BOOST_TEST(!small.lexError());
+    BOOST_TEST(tokens.size() == 6);
+    BOOST_TEST(tokens[4].line == 2);
+}
+
 BOOST_AUTO_TEST_CASE(compile_int) {
   Constant c(5);
 
   Code bytecode = interpreter::compile(c);
   Instruction i = bytecode[0];
-  BOOST_TEST(i == Instruction(OpCode::LOAD_CONST, 5));
+  BOOST_TEST(i == Instruction(OpCode::LOAD_CONST, 0));
+  BOOST_TEST(bytecode.constants[0] == 5);
+}
+
+BOOST_AUTO_TEST_CASE(instruction_encoding) {
+  BOOST_TEST(sizeof(Instruction) == 4);
+
+  Instruction jmp(OpCode::RELATIVE_JUMP, -3);
+  BOOST_TEST((jmp.opCode() == OpCode::RELATIVE_JUMP));
+  BOOST_TEST(jmp.arg() == -3);
+
+  Instruction max(OpCode::CALL_FUNCTION, Instruction::MAX_ARG);
+  BOOST_TEST(max.arg() == Instruction::MAX_ARG);
+  BOOST_CHECK_THROW(Instruction(OpCode::LOAD_CONST, Instruction::MAX_ARG + 1),
+                    std::runtime_error);
 }
 
 BOOST_AUTO_TEST_CASE(compile_and_eval_val) {
@@ -75,18 +204,23 @@ BOOST_AUTO_TEST_CASE(compile_and_eval_val) {
 
   // Test compilation
   Code bytecode = interpreter::compile(l);
-  BOOST_TEST(bytecode.size() == 2);
+  BOOST_TEST(bytecode.size() == 3);
 
   Instruction i1 = bytecode[0];
-  BOOST_TEST(i1 == Instruction(OpCode::LOAD_CONST, 5));
+  BOOST_TEST(i1 == Instruction(OpCode::LOAD_CONST, 0));
+  BOOST_TEST(bytecode.constants[0] == 5);
 
   Instruction i2 = bytecode[1];
-  BOOST_TEST(i2 == Instruction(OpCode::STORE_NAME, "x"));
+  BOOST_TEST(i2 == Instruction(OpCode::STORE_NAME, 0));
+  BOOST_TEST(bytecode.names[0] == SymbolTable::intern("x"));
+
+  Instruction i3 = bytecode[2];
+  BOOST_TEST(i3 == Instruction(OpCode::RETURN, 0));
 
   // Test evaluation
   Environment env = Environment();
   auto result = interpreter::eval(bytecode, env);
-  BOOST_TEST(boost::get<int>(env.lookup("x")) == 5);
+  BOOST_TEST(env.lookup("x").asInt() == 5);
 }
 
 BOOST_AUTO_TEST_CASE(compile_and_eval_conditions) {
@@ -103,17 +237,21 @@ BOOST_AUTO_TEST_CASE(compile_and_eval_conditions) {
   ExpressionList l(std::move(exps));
 
   // Test compilation
-  Code bytecode = interpreter::compile(l);
-  BOOST_TEST(bytecode.size() == 5);
+  Code bytecode = interpreter::compile(l, naive);
+  BOOST_TEST(bytecode.size() == 6);
+
+  // Constant pool is filled in the order the code is laid out: condition,
+  // false, true
+  BOOST_TEST(bytecode.constants == std::vector<int>({1, 3, 2}));
 
   Instruction i0 = bytecode[0];
-  BOOST_TEST(i0 == Instruction(OpCode::LOAD_CONST, 1));
+  BOOST_TEST(i0 == Instruction(OpCode::LOAD_CONST, 0));
 
   Instruction i1 = bytecode[1];
   BOOST_TEST(i1 == Instruction(OpCode::RELATIVE_JUMP_IF_TRUE, 2));
 
   Instruction i2 = bytecode[2];
-  BOOST_TEST(i2 == Instruction(OpCode::LOAD_CONST, 3));
+  BOOST_TEST(i2 == Instruction(OpCode::LOAD_CONST, 1));
 
   Instruction i3 = bytecode[3];
   BOOST_TEST(i3 == Instruction(OpCode::RELATIVE_JUMP, 1));
@@ -121,10 +259,14 @@ BOOST_AUTO_TEST_CASE(compile_and_eval_conditions) {
   Instruction i4 = bytecode[4];
   BOOST_TEST(i4 == Instruction(OpCode::LOAD_CONST, 2));
 
+  Instruction i5 = bytecode[5];
+  BOOST_TEST(i5 == Instruction(OpCode::RETURN, 0));
+  BOOST_TEST(bytecode.stackSize == 1);
+
   // Test evaluation
   Environment env = Environment();
   auto result = interpreter::eval(bytecode, env);
-  BOOST_TEST(boost::get<int>(result) == 2);
+  BOOST_TEST(result.asInt() == 2);
 }
 
 BOOST_AUTO_TEST_CASE(compile_and_eval_conditions_with_vars) {
@@ -144,12 +286,12 @@ BOOST_AUTO_TEST_CASE(compile_and_eval_conditions_with_vars) {
   Environment env = Environment();
   env.define("cond", 1);
   auto result = interpreter::eval(bytecode, env);
-  BOOST_TEST(boost::get<int>(result) == 2);
+  BOOST_TEST(result.asInt() == 2);
 
   env = Environment();
   env.define("cond", 0);
   result = interpreter::eval(bytecode, env);
-  BOOST_TEST(boost::get<int>(result) == 3);
+  BOOST_TEST(result.asInt() == 3);
 }
 
 BOOST_AUTO_TEST_CASE(compile_arithmetic) {
@@ -161,7 +303,7 @@ BOOST_AUTO_TEST_CASE(compile_arithmetic) {
   Code bytecode = interpreter::compile(binop_add);
   Environment env = Environment();
   auto result = interpreter::eval(bytecode, env);
-  BOOST_TEST(boost::get<int>(result) == 3);
+  BOOST_TEST(result.asInt() == 3);
 
   // Subtraction
   bytecode.clear();
@@ -170,7 +312,7 @@ BOOST_AUTO_TEST_CASE(compile_arithmetic) {
   BinaryOperation binop_sub('-', std::move(expr3), std::move(expr4));
   bytecode = interpreter::compile(binop_sub);
   result = interpreter::eval(bytecode, env);
-  BOOST_TEST(boost::get<int>(result) == -1);
+  BOOST_TEST(result.asInt() == -1);
 
   // Nested binop
   bytecode.clear();
@@ -183,7 +325,7 @@ BOOST_AUTO_TEST_CASE(compile_arithmetic) {
   BinaryOperation nested_binop('-', std::move(expr8), std::move(expr7));
   bytecode = interpreter::compile(nested_binop);
   result = interpreter::eval(bytecode, env);
-  BOOST_TEST(boost::get<int>(result) == 0);
+  BOOST_TEST(result.asInt() == 0);
 }
 
 BOOST_AUTO_TEST_CASE(compile_function) {
@@ -201,9 +343,23 @@ BOOST_AUTO_TEST_CASE(compile_function) {
 
   Lambda f(params, std::move(binop_add_exp));
 
-  Code f_code = interpreter::compile(f);
+  Code f_code = interpreter::compile(f, naive);
+  BOOST_TEST(f_code.size() == 2);
+  BOOST_TEST(f_code[0] == Instruction(OpCode::MAKE_FUNCTION, 0));
+  BOOST_TEST(f_code[1] == Instruction(OpCode::RETURN, 0));
 
-  // TODO: Add tests for instructions
+  // The body lives in its own code object with its own side tables
+  const CodeObject &body = *f_code.functions[0];
+  BOOST_TEST(body.params == std::vector<Symbol>({SymbolTable::intern("x")}));
+  BOOST_TEST(body.size() == 4);
+  BOOST_TEST(body[0] == Instruction(OpCode::LOAD_LOCAL, 0));
+  BOOST_TEST(body.names.empty());
+  BOOST_TEST(body.numLocals == 1);
+  BOOST_TEST(body[1] == Instruction(OpCode::LOAD_CONST, 0));
+  BOOST_TEST(body.constants[0] == 1);
+  BOOST_TEST(body[2] == Instruction(OpCode::ADD, 0));
+  BOOST_TEST(body[3] == Instruction(OpCode::RETURN, 0));
+  BOOST_TEST(body.stackSize == 2);
 }
 
 BOOST_AUTO_TEST_CASE(compile_and_eval_function_call) {
@@ -233,5 +389,1169 @@ BOOST_AUTO_TEST_CASE(compile_and_eval_function_call) {
   Code bytecode = interpreter::compile(call);
   Environment env = Environment();
   auto result = interpreter::eval(bytecode, env);
-  BOOST_TEST(boost::get<int>(result) == 2);
-}
\ No newline at end of file
+  BOOST_TEST(result.asInt() == 2);
+}
+// ((lambda (f n) (f f n))
+//  (lambda (self n) (if n (+ n (self self (- n 1))) 0))
+//  n)
+static std::unique_ptr<Expression> recursiveSum(int n) {
+  std::vector<StringConstant> outer_params = {StringConstant("f"),
+                                              StringConstant("n")};
+  std::vector<std::unique_ptr<Expression>> outer_call;
+  outer_call.push_back(std::make_unique<StringConstant>("f"));
+  outer_call.push_back(std::make_unique<StringConstant>("f"));
+  outer_call.push_back(std::make_unique<StringConstant>("n"));
+  auto outer = std::make_unique<Lambda>(
+      outer_params, std::make_unique<ExpressionList>(std::move(outer_call)));
+
+  std::vector<StringConstant> sum_params = {StringConstant("self"),
+                                            StringConstant("n")};
+  std::vector<std::unique_ptr<Expression>> recurse;
+  recurse.push_back(std::make_unique<StringConstant>("self"));
+  recurse.push_back(std::make_unique<StringConstant>("self"));
+  recurse.push_back(std::make_unique<BinaryOperation>(
+      '-', std::make_unique<StringConstant>("n"),
+      std::make_unique<Constant>(1)));
+  std::vector<std::unique_ptr<Expression>> cond;
+  cond.push_back(std::make_unique<StringConstant>("if"));
+  cond.push_back(std::make_unique<StringConstant>("n"));
+  cond.push_back(std::make_unique<BinaryOperation>(
+      '+', std::make_unique<StringConstant>("n"),
+      std::make_unique<ExpressionList>(std::move(recurse))));
+  cond.push_back(std::make_unique<Constant>(0));
+  auto sum = std::make_unique<Lambda>(
+      sum_params, std::make_unique<ExpressionList>(std::move(cond)));
+
+  std::vector<std::unique_ptr<Expression>> call_exps;
+  call_exps.push_back(std::move(outer));
+  call_exps.push_back(std::move(sum));
+  call_exps.push_back(std::make_unique<Constant>(n));
+  return std::make_unique<ExpressionList>(std::move(call_exps));
+}
+
+BOOST_AUTO_TEST_CASE(compile_and_eval_call_through_name) {
+  std::unique_ptr<Expression> call = recursiveSum(10);
+  Code bytecode = interpreter::compile(*call);
+  Environment env = Environment();
+  auto result = interpreter::eval(bytecode, env);
+  BOOST_TEST(result.asInt() == 55);
+}
+
+BOOST_AUTO_TEST_CASE(eval_deep_recursion) {
+  // Calls do not recurse on the C++ stack
+  std::unique_ptr<Expression> call = recursiveSum(5000);
+  Code bytecode = interpreter::compile(*call);
+  Environment env = Environment();
+  auto result = interpreter::eval(bytecode, env);
+  BOOST_TEST(result.asInt() == 12502500);
+}
+
+BOOST_AUTO_TEST_CASE(eval_recursion_limit) {
+  std::unique_ptr<Expression> call = recursiveSum(200);
+  Code bytecode = interpreter::compile(*call);
+  Environment env = Environment();
+
+  int limit = interpreter::recursionLimit();
+  interpreter::setRecursionLimit(100);
+  BOOST_CHECK_THROW(interpreter::eval(bytecode, env), std::runtime_error);
+
+  // The machine is usable again after the error
+  interpreter::setRecursionLimit(limit);
+  auto result = interpreter::eval(bytecode, env);
+  BOOST_TEST(result.asInt() == 20100);
+}
+
+// ((lambda (f n) (f f n))
+//  (lambda (self n) (if n (self self (- n 1)) 42))
+//  n)
+static std::unique_ptr<Expression> countdown(int n) {
+  std::vector<StringConstant> outer_params = {StringConstant("f"),
+                                              StringConstant("n")};
+  std::vector<std::unique_ptr<Expression>> outer_call;
+  outer_call.push_back(std::make_unique<StringConstant>("f"));
+  outer_call.push_back(std::make_unique<StringConstant>("f"));
+  outer_call.push_back(std::make_unique<StringConstant>("n"));
+  auto outer = std::make_unique<Lambda>(
+      outer_params, std::make_unique<ExpressionList>(std::move(outer_call)));
+
+  std::vector<StringConstant> loop_params = {StringConstant("self"),
+                                             StringConstant("n")};
+  std::vector<std::unique_ptr<Expression>> recurse;
+  recurse.push_back(std::make_unique<StringConstant>("self"));
+  recurse.push_back(std::make_unique<StringConstant>("self"));
+  recurse.push_back(std::make_unique<BinaryOperation>(
+      '-', std::make_unique<StringConstant>("n"),
+      std::make_unique<Constant>(1)));
+  std::vector<std::unique_ptr<Expression>> cond;
+  cond.push_back(std::make_unique<StringConstant>("if"));
+  cond.push_back(std::make_unique<StringConstant>("n"));
+  cond.push_back(std::make_unique<ExpressionList>(std::move(recurse)));
+  cond.push_back(std::make_unique<Constant>(42));
+  auto loop = std::make_unique<Lambda>(
+      loop_params, std::make_unique<ExpressionList>(std::move(cond)));
+
+  std::vector<std::unique_ptr<Expression>> call_exps;
+  call_exps.push_back(std::move(outer));
+  call_exps.push_back(std::move(loop));
+  call_exps.push_back(std::make_unique<Constant>(n));
+  return std::make_unique<ExpressionList>(std::move(call_exps));
+}
+
+BOOST_AUTO_TEST_CASE(compile_tail_calls) {
+  std::unique_ptr<Expression> call = countdown(3);
+  Code bytecode = interpreter::compile(*call, naive);
+
+  // Calls whose result is returned become tail calls, the top-level call and
+  // the one feeding + in recursiveSum do not
+  const CodeObject &outer = *bytecode.functions[0];
+  const CodeObject &loop = *bytecode.functions[1];
+  BOOST_TEST(bytecode[bytecode.size() - 2] ==
+             Instruction(OpCode::CALL_FUNCTION, 2, 0));
+  BOOST_TEST(outer[3] == Instruction(OpCode::TAIL_CALL, 2, 0));
+  BOOST_TEST(loop[loop.size() - 2] == Instruction(OpCode::TAIL_CALL, 2, 0));
+
+  std::unique_ptr<Expression> sum = recursiveSum(3);
+  Code sum_bytecode = interpreter::compile(*sum, naive);
+  const CodeObject &sum_body = *sum_bytecode.functions[1];
+  BOOST_TEST(sum_body[sum_body.size() - 3] ==
+             Instruction(OpCode::CALL_FUNCTION, 2, 0));
+}
+
+BOOST_AUTO_TEST_CASE(eval_tail_calls_in_constant_space) {
+  // A loop far deeper than the recursion limit runs in one frame
+  std::unique_ptr<Expression> call = countdown(1000000);
+  Code bytecode = interpreter::compile(*call);
+  Environment env = Environment();
+
+  int limit = interpreter::recursionLimit();
+  interpreter::setRecursionLimit(10);
+  auto result = interpreter::eval(bytecode, env);
+  interpreter::setRecursionLimit(limit);
+  BOOST_TEST(result.asInt() == 42);
+}
+
+BOOST_AUTO_TEST_CASE(value_representation) {
+  BOOST_TEST(sizeof(Value) == 8);
+
+  Value a(-7), b(3);
+  BOOST_TEST(a.isInt());
+  BOOST_TEST(Value::add(a, b).asInt() == -4);
+  BOOST_TEST(Value::sub(a, b).asInt() == -10);
+  BOOST_TEST(Value::mul(a, b).asInt() == -21);
+
+  // Arithmetic wraps around like 32-bit two's complement
+  Value max(2147483647), one(1);
+  BOOST_TEST(Value::add(max, one).asInt() == -2147483648);
+
+  // Functions are reference counted heap objects
+  std::vector<StringConstant> params = {StringConstant("x")};
+  Lambda id(params, std::make_unique<StringConstant>("x"));
+  Code bytecode = interpreter::compile(id);
+  Environment env = Environment();
+  Value f = interpreter::eval(bytecode, env);
+  BOOST_TEST(f.isFunction());
+  BOOST_TEST(!f.isInt());
+  BOOST_TEST(f.asFunction()->refCount == 1);
+  {
+    Value copy = f;
+    BOOST_TEST(f.asFunction()->refCount == 2);
+  }
+  BOOST_TEST(f.asFunction()->refCount == 1);
+}
+
+// (lambda (x) ((lambda (y) (+ x y)) 2)) applied to 40, and a global g added
+// to the result of the inner lambda
+static std::unique_ptr<Expression> nestedClosure() {
+  std::vector<StringConstant> inner_params = {StringConstant("y")};
+  auto inner_body = std::make_unique<BinaryOperation>(
+      '+', std::make_unique<StringConstant>("x"),
+      std::make_unique<StringConstant>("y"));
+  std::vector<std::unique_ptr<Expression>> inner_call;
+  inner_call.push_back(
+      std::make_unique<Lambda>(inner_params, std::move(inner_body)));
+  inner_call.push_back(std::make_unique<Constant>(2));
+  auto outer_body = std::make_unique<BinaryOperation>(
+      '+', std::make_unique<ExpressionList>(std::move(inner_call)),
+      std::make_unique<StringConstant>("g"));
+
+  std::vector<StringConstant> outer_params = {StringConstant("x")};
+  std::vector<std::unique_ptr<Expression>> outer_call;
+  outer_call.push_back(
+      std::make_unique<Lambda>(outer_params, std::move(outer_body)));
+  outer_call.push_back(std::make_unique<Constant>(40));
+  return std::make_unique<ExpressionList>(std::move(outer_call));
+}
+
+BOOST_AUTO_TEST_CASE(compile_lexical_addresses) {
+  std::unique_ptr<Expression> program = nestedClosure();
+  Code bytecode = interpreter::compile(*program, naive);
+
+  const CodeObject &outer = *bytecode.functions[0];
+  const CodeObject &inner = *outer.functions[0];
+  BOOST_TEST(outer.upvalues.empty());
+  BOOST_TEST(inner.upvalues == std::vector<Upvalue>({{true, 0}}));
+
+  // x is captured from the outer frame, y is in the inner frame, g is a global
+  BOOST_TEST(outer[0] == Instruction(OpCode::MAKE_CELL, 0));
+  BOOST_TEST(inner[0] == Instruction(OpCode::LOAD_UPVALUE, 0));
+  BOOST_TEST(inner[1] == Instruction(OpCode::LOAD_LOCAL, 0));
+  BOOST_TEST(outer.names == std::vector<Symbol>({SymbolTable::intern("g")}));
+
+  Environment env = Environment();
+  env.define("g", 100);
+  auto result = interpreter::eval(bytecode, env);
+  BOOST_TEST(result.asInt() == 142);
+}
+
+BOOST_AUTO_TEST_CASE(compile_and_eval_local_val) {
+  // ((lambda (x) (val y (* x 2))) 21) stores into a frame slot, not the
+  // environment
+  std::vector<std::unique_ptr<Expression>> val_exps;
+  val_exps.push_back(std::make_unique<StringConstant>("val"));
+  val_exps.push_back(std::make_unique<StringConstant>("y"));
+  val_exps.push_back(std::make_unique<BinaryOperation>(
+      '*', std::make_unique<StringConstant>("x"),
+      std::make_unique<Constant>(2)));
+  std::vector<StringConstant> params = {StringConstant("x")};
+  std::vector<std::unique_ptr<Expression>> call_exps;
+  call_exps.push_back(std::make_unique<Lambda>(
+      params, std::make_unique<ExpressionList>(std::move(val_exps))));
+  call_exps.push_back(std::make_unique<Constant>(21));
+  ExpressionList call(std::move(call_exps));
+
+  Code bytecode = interpreter::compile(call, naive);
+  const CodeObject &body = *bytecode.functions[0];
+  BOOST_TEST(body.numLocals == 2);
+  BOOST_TEST(body[3] == Instruction(OpCode::STORE_LOCAL, 1));
+
+  Environment env = Environment();
+  interpreter::eval(bytecode, env);
+  BOOST_TEST(!env.isDefined("y"));
+}
+
+BOOST_AUTO_TEST_CASE(compile_and_eval_upvalue_chain) {
+  // ((lambda (x) ((lambda (y) ((lambda (z) (+ x z)) 3)) 2)) 40): the middle
+  // lambda passes x on to the inner one without using it
+  std::vector<StringConstant> z_params = {StringConstant("z")};
+  std::vector<std::unique_ptr<Expression>> z_call;
+  z_call.push_back(std::make_unique<Lambda>(
+      z_params, std::make_unique<BinaryOperation>(
+                    '+', std::make_unique<StringConstant>("x"),
+                    std::make_unique<StringConstant>("z"))));
+  z_call.push_back(std::make_unique<Constant>(3));
+  std::vector<StringConstant> y_params = {StringConstant("y")};
+  std::vector<std::unique_ptr<Expression>> y_call;
+  y_call.push_back(std::make_unique<Lambda>(
+      y_params, std::make_unique<ExpressionList>(std::move(z_call))));
+  y_call.push_back(std::make_unique<Constant>(2));
+  std::vector<StringConstant> x_params = {StringConstant("x")};
+  std::vector<std::unique_ptr<Expression>> x_call;
+  x_call.push_back(std::make_unique<Lambda>(
+      x_params, std::make_unique<ExpressionList>(std::move(y_call))));
+  x_call.push_back(std::make_unique<Constant>(40));
+  ExpressionList program(std::move(x_call));
+
+  Code bytecode = interpreter::compile(program);
+  const CodeObject &outer = *bytecode.functions[0];
+  const CodeObject &middle = *outer.functions[0];
+  const CodeObject &inner = *middle.functions[0];
+  BOOST_TEST(outer[0] == Instruction(OpCode::MAKE_CELL, 0));
+  BOOST_TEST(middle.upvalues == std::vector<Upvalue>({{true, 0}}));
+  BOOST_TEST(inner.upvalues == std::vector<Upvalue>({{false, 0}}));
+  BOOST_TEST(inner[0] == Instruction(OpCode::LOAD_UPVALUE, 0));
+
+  Environment env = Environment();
+  BOOST_TEST(interpreter::eval(bytecode, env).asInt() == 43);
+}
+
+BOOST_AUTO_TEST_CASE(compile_peephole) {
+  // (lambda (self n) (if n (self self (- n 1)) 42)) with the pass on
+  std::unique_ptr<Expression> call = countdown(3);
+  Code bytecode = interpreter::compile(*call);
+  const CodeObject &loop = *bytecode.functions[1];
+
+  // Loads and arithmetic are fused, the jump out of the false arm returns
+  std::vector<Instruction> expected = {
+      Instruction(OpCode::JUMP_IF_LOCAL, 1, 2),
+      Instruction(OpCode::LOAD_CONST, 0),
+      Instruction(OpCode::RETURN, 0),
+      Instruction(OpCode::LOAD_LOCAL_LOCAL, 0, 0),
+      Instruction(OpCode::LOAD_LOCAL, 1),
+      Instruction(OpCode::SUB_CONST, 1),
+      Instruction(OpCode::TAIL_CALL, 2, 0),
+      Instruction(OpCode::RETURN, 0)};
+  BOOST_TEST(loop.instructions == expected);
+  BOOST_TEST(loop.stackSize == 3);
+
+  Environment env = Environment();
+  BOOST_TEST(interpreter::eval(bytecode, env).asInt() == 42);
+
+  // Both settings compute the same results
+  std::unique_ptr<Expression> sum = recursiveSum(100);
+  Code optimized = interpreter::compile(*sum);
+  Code plain = interpreter::compile(*sum, naive);
+  BOOST_TEST(optimized.functions[1]->size() < plain.functions[1]->size());
+  BOOST_TEST(interpreter::eval(optimized, env).asInt() ==
+             interpreter::eval(plain, env).asInt());
+}
+
+BOOST_AUTO_TEST_CASE(fold_constants) {
+  // (lambda (x) (if (- 2 2) x (+ (* 2 3) x))) folds to (lambda (x) (+ 6 x))
+  std::vector<std::unique_ptr<Expression>> cond;
+  cond.push_back(std::make_unique<StringConstant>("if"));
+  cond.push_back(std::make_unique<BinaryOperation>(
+      '-', std::make_unique<Constant>(2), std::make_unique<Constant>(2)));
+  cond.push_back(std::make_unique<StringConstant>("x"));
+  cond.push_back(std::make_unique<BinaryOperation>(
+      '+',
+      std::make_unique<BinaryOperation>('*', std::make_unique<Constant>(2),
+                                        std::make_unique<Constant>(3)),
+      std::make_unique<StringConstant>("x")));
+  std::vector<StringConstant> params = {StringConstant("x")};
+  std::vector<std::unique_ptr<Expression>> call_exps;
+  call_exps.push_back(std::make_unique<Lambda>(
+      params, std::make_unique<ExpressionList>(std::move(cond))));
+  call_exps.push_back(std::make_unique<Constant>(4));
+  std::unique_ptr<Expression> call =
+      std::make_unique<ExpressionList>(std::move(call_exps));
+
+  Code plain = interpreter::compile(*call, naive);
+  call = interpreter::fold(std::move(call));
+  Code folded = interpreter::compile(*call, naive);
+
+  const CodeObject &body = *folded.functions[0];
+  BOOST_TEST(body.size() == 4);
+  BOOST_TEST(body[0] == Instruction(OpCode::LOAD_CONST, 0));
+  BOOST_TEST(body.constants[0] == 6);
+  BOOST_TEST(body.size() < plain.functions[0]->size());
+
+  Environment env = Environment();
+  BOOST_TEST(interpreter::eval(folded, env).asInt() == 10);
+  BOOST_TEST(interpreter::eval(plain, env).asInt() == 10);
+
+  // A constant root is replaced as a whole, with the interpreter's wrapping
+  std::unique_ptr<Expression> big = std::make_unique<BinaryOperation>(
+      '*', std::make_unique<Constant>(1 << 20),
+      std::make_unique<Constant>(1 << 12));
+  big = interpreter::fold(std::move(big));
+  auto *constant = dynamic_cast<Constant *>(big.get());
+  BOOST_TEST(constant);
+  BOOST_TEST(constant->getValue() == 0);
+
+  // Programs run from source are folded before they are compiled
+  interpreter::runSource("(val f (lambda (x) (if (- 2 2) x (+ (* 2 3) x))))",
+                         env);
+  const CodeObject &f =
+      *env.find(SymbolTable::intern("f"))->asFunction()->code;
+  BOOST_TEST(f.constants == std::vector<int>{6});
+  BOOST_TEST(interpreter::runSource("(f 4)", env).asInt() == 10);
+
+  // A tree compile borrows is left as it was, so it can be compiled again
+  std::vector<std::unique_ptr<Expression>> root_exps;
+  root_exps.push_back(std::make_unique<StringConstant>("if"));
+  root_exps.push_back(std::make_unique<Constant>(1));
+  root_exps.push_back(std::make_unique<Constant>(7));
+  root_exps.push_back(std::make_unique<Constant>(8));
+  ExpressionList root(std::move(root_exps));
+  BOOST_TEST(interpreter::eval(interpreter::compile(root), env).asInt() == 7);
+  BOOST_TEST(interpreter::eval(interpreter::compile(root), env).asInt() == 7);
+  BOOST_TEST(interpreter::run(root, env, interpreter::Engine::Stack).asInt() ==
+             7);
+  BOOST_TEST(
+      interpreter::run(root, env, interpreter::Engine::Register).asInt() == 7);
+
+  // One handed over is folded
+  std::unique_ptr<Expression> owned =
+      std::make_unique<ExpressionList>(std::move(root.getExpressions()));
+  Code folded_root = interpreter::compile(std::move(owned));
+  BOOST_TEST(folded_root.constants == std::vector<int>{7});
+}
+
+BOOST_AUTO_TEST_CASE(eval_name_inline_cache) {
+  // (+ g (* g 2))
+  BinaryOperation sum('+', std::make_unique<StringConstant>("g"),
+                      std::make_unique<BinaryOperation>(
+                          '*', std::make_unique<StringConstant>("g"),
+                          std::make_unique<Constant>(2)));
+  Code bytecode = interpreter::compile(sum);
+  BOOST_TEST(bytecode.nameCaches.size() == 1);
+  BOOST_TEST(bytecode.nameCaches[0].shape == 0);
+
+  Environment env = Environment();
+  env.define("g", 1);
+  BOOST_TEST(interpreter::eval(bytecode, env).asInt() == 3);
+  BOOST_TEST(bytecode.nameCaches[0].shape == env.shape());
+
+  // Redefining a name and adding others keep the cached entry valid
+  env.define("g", 10);
+  for (int i = 0; i < 100; i++) {
+    env.define("h" + std::to_string(i), i);
+  }
+  uint64_t shape = env.shape();
+  BOOST_TEST(interpreter::eval(bytecode, env).asInt() == 30);
+  BOOST_TEST(env.shape() == shape);
+
+  // Replacing the environment, or using another one, misses the cache
+  env = Environment();
+  BOOST_TEST(env.shape() != shape);
+  env.define("g", 100);
+  BOOST_TEST(interpreter::eval(bytecode, env).asInt() == 300);
+
+  Environment other = Environment();
+  BOOST_CHECK_THROW(interpreter::eval(bytecode, other), std::runtime_error);
+  other.define("g", 5);
+  BOOST_TEST(interpreter::eval(bytecode, other).asInt() == 15);
+  BOOST_TEST(interpreter::eval(bytecode, env).asInt() == 300);
+}
+
+BOOST_AUTO_TEST_CASE(compile_registers) {
+  // (lambda (a b) (+ a (- b 1))) reads its operands in place
+  std::vector<StringConstant> params = {StringConstant("a"),
+                                        StringConstant("b")};
+  Lambda f(params, std::make_unique<BinaryOperation>(
+                       '+', std::make_unique<StringConstant>("a"),
+                       std::make_unique<BinaryOperation>(
+                           '-', std::make_unique<StringConstant>("b"),
+                           std::make_unique<Constant>(1))));
+  RegisterCode code = interpreter::compileRegisters(f);
+  BOOST_TEST(code.size() == 2);
+  BOOST_TEST(code[0] == RegisterInstruction(RegOpCode::MAKE_FUNCTION, 0, 0));
+
+  const RegisterCode &body = *code.functions[0];
+  std::vector<RegisterInstruction> expected = {
+      RegisterInstruction(RegOpCode::SUB_CONST, 3, 1, 0),
+      RegisterInstruction(RegOpCode::ADD, 2, 0, 3),
+      RegisterInstruction(RegOpCode::RETURN, 2, 0, 0)};
+  BOOST_TEST(body.instructions == expected);
+  BOOST_TEST(body.numLocals == 2);
+  BOOST_TEST(body.numRegisters == 4);
+}
+
+BOOST_AUTO_TEST_CASE(eval_engines_agree) {
+  std::vector<std::unique_ptr<Expression>> programs;
+  programs.push_back(recursiveSum(100));
+  programs.push_back(countdown(100000));
+  programs.push_back(nestedClosure());
+
+  for (auto &program : programs) {
+    Environment stack_env = Environment();
+    stack_env.define("g", 100);
+    Environment register_env = Environment();
+    register_env.define("g", 100);
+    BOOST_TEST(
+        interpreter::run(*program, stack_env, interpreter::Engine::Stack)
+            .asInt() ==
+        interpreter::run(*program, register_env, interpreter::Engine::Register)
+            .asInt());
+  }
+
+  // Calls whose callee or arguments are calls themselves
+  const std::string curried =
+      "(val k (lambda (x) (lambda (y) y)))\n"
+      "(val add (lambda (a) (lambda (b) (+ a b))))\n"
+      "(val sub3 (lambda (x) (lambda (y) (lambda (z) (- (- x y) z)))))\n"
+      "(val f (lambda (a b c) (- a (* b c))))\n";
+  const std::vector<std::pair<std::string, int>> calls = {
+      {"((k 1) 2)", 2},
+      {"((add 1) 2)", 3},
+      {"(((sub3 10) 2) 3)", 5},
+      {"(f ((add 4) 5) ((k 0) 2) (f 7 1 3))", 1},
+      {"((lambda (n) (+ ((add n) 2) (((sub3 n) 1) 1))) 5)", 10},
+      {"((lambda (n) ((add ((k n) n)) (f n 1 1))) 5)", 9},
+      // A val used as a value stands for -1
+      {"((lambda (a b) b) (val x 1) 5)", 5},
+      {"((lambda (a b) a) (val x 1) 5)", -1},
+      {"(+ (if (val z 0) 1 (val w 3)) ((lambda (a) (val q a)) 4))", 0}};
+  for (const auto &[source, expected] : calls) {
+    for (auto engine : {interpreter::Engine::Stack,
+                        interpreter::Engine::Register}) {
+      Environment curried_env = Environment();
+      interpreter::runSource(curried, curried_env, engine);
+      Value result = interpreter::runSource(source, curried_env, engine);
+      BOOST_TEST(result.isInt());
+      BOOST_TEST((result.isInt() && result.asInt() == expected));
+    }
+  }
+
+  // Deep non-tail recursion hits the same limit
+  std::unique_ptr<Expression> deep = recursiveSum(200);
+  Environment env = Environment();
+  int limit = interpreter::recursionLimit();
+  interpreter::setRecursionLimit(100);
+  BOOST_CHECK_THROW(
+      interpreter::run(*deep, env, interpreter::Engine::Register),
+      std::runtime_error);
+  interpreter::setRecursionLimit(limit);
+  BOOST_TEST(
+      interpreter::run(*deep, env, interpreter::Engine::Register).asInt() ==
+      20100);
+
+  // An error releases what the frames it unwinds hold
+  for (auto engine : {interpreter::Engine::Stack,
+                      interpreter::Engine::Register}) {
+    Environment unwind_env = Environment();
+    size_t before = gc::stats().objects;
+    BOOST_CHECK_THROW(
+        interpreter::runSource("((lambda (f) (+ f 1)) (lambda (x) x))",
+                               unwind_env, engine),
+        std::runtime_error);
+    BOOST_TEST(gc::stats().objects == before);
+  }
+
+  // Functions of one machine cannot be called by the other
+  std::vector<StringConstant> params = {StringConstant("x")};
+  std::vector<std::unique_ptr<Expression>> define;
+  define.push_back(std::make_unique<StringConstant>("val"));
+  define.push_back(std::make_unique<StringConstant>("id"));
+  define.push_back(
+      std::make_unique<Lambda>(params, std::make_unique<StringConstant>("x")));
+  ExpressionList definition(std::move(define));
+  interpreter::run(definition, env, interpreter::Engine::Register);
+
+  std::vector<std::unique_ptr<Expression>> use;
+  use.push_back(std::make_unique<StringConstant>("id"));
+  use.push_back(std::make_unique<Constant>(7));
+  ExpressionList call(std::move(use));
+  BOOST_TEST(interpreter::run(call, env, interpreter::Engine::Register)
+                 .asInt() == 7);
+  BOOST_CHECK_THROW(interpreter::run(call, env, interpreter::Engine::Stack),
+                    std::runtime_error);
+}
+
+BOOST_AUTO_TEST_CASE(eval_jit) {
+  // (val leaf (lambda (a b) (if a (+ (* a 3) b) (- b 7))))
+  std::vector<StringConstant> params = {StringConstant("a"),
+                                        StringConstant("b")};
+  std::vector<std::unique_ptr<Expression>> cond;
+  cond.push_back(std::make_unique<StringConstant>("if"));
+  cond.push_back(std::make_unique<StringConstant>("a"));
+  cond.push_back(std::make_unique<BinaryOperation>(
+      '+',
+      std::make_unique<BinaryOperation>('*',
+                                        std::make_unique<StringConstant>("a"),
+                                        std::make_unique<Constant>(3)),
+      std::make_unique<StringConstant>("b")));
+  cond.push_back(std::make_unique<BinaryOperation>(
+      '-', std::make_unique<StringConstant>("b"),
+      std::make_unique<Constant>(7)));
+  std::vector<std::unique_ptr<Expression>> define;
+  define.push_back(std::make_unique<StringConstant>("val"));
+  define.push_back(std::make_unique<StringConstant>("leaf"));
+  define.push_back(std::make_unique<Lambda>(
+      params, std::make_unique<ExpressionList>(std::move(cond))));
+  ExpressionList definition(std::move(define));
+
+  // (leaf x 5)
+  std::vector<std::unique_ptr<Expression>> use;
+  use.push_back(std::make_unique<StringConstant>("leaf"));
+  use.push_back(std::make_unique<StringConstant>("x"));
+  use.push_back(std::make_unique<Constant>(5));
+  ExpressionList call(std::move(use));
+  Code call_bytecode = interpreter::compile(call);
+
+  bool enabled = interpreter::jitEnabled();
+  int threshold = interpreter::jitThreshold();
+  interpreter::setJitThreshold(10);
+  for (bool jit : {false, true}) {
+    interpreter::setJitEnabled(jit);
+    Code bytecode = interpreter::compile(definition);
+    Environment env = Environment();
+    interpreter::eval(bytecode, env);
+    for (int i = -50; i <= 50; i++) {
+      env.define("x", i);
+      BOOST_TEST(interpreter::eval(call_bytecode, env).asInt() ==
+                 (i ? i * 3 + 5 : -2));
+    }
+    const CodeObject &leaf = *bytecode.functions[0];
+    BOOST_TEST(leaf.jit.attempted == jit);
+#if defined(__x86_64__) && defined(__linux__)
+    BOOST_TEST((leaf.jit.native != nullptr) == jit);
+#endif
+
+    // A body that bails out is interpreted and raises the error
+    env.define("x", env.lookup("leaf"));
+    BOOST_CHECK_THROW(interpreter::eval(call_bytecode, env),
+                      std::runtime_error);
+  }
+
+  // Bodies with calls stay interpreted
+  std::unique_ptr<Expression> loop = countdown(1000);
+  Code loop_bytecode = interpreter::compile(*loop);
+  Environment env = Environment();
+  BOOST_TEST(interpreter::eval(loop_bytecode, env).asInt() == 42);
+  BOOST_TEST(loop_bytecode.functions[1]->jit.attempted);
+  BOOST_TEST(!loop_bytecode.functions[1]->jit.native);
+
+  interpreter::setJitEnabled(enabled);
+  interpreter::setJitThreshold(threshold);
+}
+
+BOOST_AUTO_TEST_CASE(eval_quickening) {
+  // A call site that keeps calling the same function is quickened
+  std::unique_ptr<Expression> sum = recursiveSum(10);
+  Code bytecode = interpreter::compile(*sum, naive);
+  const CodeObject &sum_body = *bytecode.functions[1];
+  size_t site = sum_body.size() - 3;
+  BOOST_TEST(sum_body.callCaches.size() == 1);
+  Environment env = Environment();
+  BOOST_TEST(interpreter::eval(bytecode, env).asInt() == 55);
+  BOOST_TEST(sum_body[site] == Instruction(OpCode::CALL_KNOWN, 2, 0));
+  BOOST_TEST(sum_body.callCaches[0].callee == sum_body.id);
+  BOOST_TEST(interpreter::eval(bytecode, env).asInt() == 55);
+
+  // (val apply (lambda (f x) (f x))) calls whatever it is given
+  std::vector<StringConstant> apply_params = {StringConstant("f"),
+                                              StringConstant("x")};
+  std::vector<std::unique_ptr<Expression>> apply_call;
+  apply_call.push_back(std::make_unique<StringConstant>("f"));
+  apply_call.push_back(std::make_unique<StringConstant>("x"));
+  std::vector<std::unique_ptr<Expression>> define;
+  define.push_back(std::make_unique<StringConstant>("val"));
+  define.push_back(std::make_unique<StringConstant>("apply"));
+  define.push_back(std::make_unique<Lambda>(
+      apply_params, std::make_unique<ExpressionList>(std::move(apply_call))));
+  ExpressionList definition(std::move(define));
+  Code apply_bytecode = interpreter::compile(definition);
+  interpreter::eval(apply_bytecode, env);
+  const CodeObject &apply = *apply_bytecode.functions[0];
+
+  // (apply (lambda (x) (<op> x 2)) 5)
+  auto call = [&](char op) {
+    std::vector<StringConstant> params = {StringConstant("x")};
+    std::vector<std::unique_ptr<Expression>> exps;
+    exps.push_back(std::make_unique<StringConstant>("apply"));
+    exps.push_back(std::make_unique<Lambda>(
+        params, std::make_unique<BinaryOperation>(
+                    op, std::make_unique<StringConstant>("x"),
+                    std::make_unique<Constant>(2))));
+    exps.push_back(std::make_unique<Constant>(5));
+    ExpressionList exp(std::move(exps));
+    Code code = interpreter::compile(exp);
+    return interpreter::eval(code, env).asInt();
+  };
+  BOOST_TEST(call('+') == 7);
+  BOOST_TEST(apply[1] == Instruction(OpCode::TAIL_CALL_KNOWN, 1, 0));
+
+  // A different callee deoptimizes the site for good
+  BOOST_TEST(call('*') == 10);
+  BOOST_TEST(apply[1] == Instruction(OpCode::TAIL_CALL, 1, 0));
+  BOOST_TEST(apply.callCaches[0].generic);
+  BOOST_TEST(call('-') == 3);
+  BOOST_TEST(apply[1] == Instruction(OpCode::TAIL_CALL, 1, 0));
+}
+
+BOOST_AUTO_TEST_CASE(arena_allocation) {
+  Arena arena(256);
+  size_t before = arena.bytesUsed();
+  {
+    Arena::Scope scope(arena);
+    std::unique_ptr<Expression> sum = recursiveSum(100);
+    BOOST_TEST(arena.bytesUsed() > before);
+    BOOST_TEST(arena.blockCount() > 1);
+
+    // Nodes from an arena compile and run like any other
+    Code bytecode = interpreter::compile(*sum);
+    Environment env = Environment();
+    BOOST_TEST(interpreter::eval(bytecode, env).asInt() == 5050);
+
+    // Scopes nest
+    Arena inner;
+    {
+      Arena::Scope inner_scope(inner);
+      BOOST_TEST(Arena::current() == &inner);
+      std::unique_ptr<Expression> node = std::make_unique<Constant>(1);
+      BOOST_TEST(inner.bytesUsed() > 0);
+    }
+    BOOST_TEST(Arena::current() == &arena);
+  }
+  BOOST_TEST(Arena::current() == nullptr);
+
+  // Outside a scope nodes come from the heap
+  size_t used = arena.bytesUsed();
+  std::unique_ptr<Expression> node = std::make_unique<Constant>(1);
+  BOOST_TEST(arena.bytesUsed() == used);
+
+  // Containers can allocate from an arena too
+  std::pmr::vector<int> numbers(&arena);
+  numbers.assign(1000, 7);
+  BOOST_TEST(arena.bytesUsed() >= used + 1000 * sizeof(int));
+}
+
+BOOST_AUTO_TEST_CASE(parse_forms) {
+  Lexer lexer("(val x 5)\n"
+              "// comment\n"
+              "(+ x 2 3)\n"
+              "((lambda (a b) (- a b)) 10 4)\n");
+  Parser parser(lexer);
+
+  // Forms come out one at a time
+  std::unique_ptr<Expression> define = parser.next();
+  auto *list = dynamic_cast<ExpressionList *>(define.get());
+  BOOST_TEST(list);
+  BOOST_TEST(list->getExpressions().size() == 3);
+
+  std::unique_ptr<Expression> sum = parser.next();
+  auto *outer = dynamic_cast<BinaryOperation *>(sum.get());
+  BOOST_TEST(outer);
+  BOOST_TEST(dynamic_cast<BinaryOperation *>(&outer->getLeft()));
+
+  std::unique_ptr<Expression> call = parser.next();
+  BOOST_TEST(call.get());
+  BOOST_TEST(!parser.next().get());
+  BOOST_TEST(!parser.next().get());
+
+  Environment env = Environment();
+  interpreter::run(*define, env);
+  BOOST_TEST(interpreter::run(*sum, env).asInt() == 10);
+  BOOST_TEST(interpreter::run(*call, env).asInt() == 6);
+}
+
+BOOST_AUTO_TEST_CASE(parse_malformed_forms) {
+  // val and if with the wrong number of parts are syntax errors
+  Environment env = Environment();
+  for (const char *source :
+       {"(val x)", "(val)", "(val x 1 2)", "(if 1 2)", "(if)",
+        "(if 1 2 3 4)", "((lambda (x) (if x 1)) 0)",
+        "((lambda (x) (val y)) 0)"}) {
+    for (auto engine :
+         {interpreter::Engine::Stack, interpreter::Engine::Register}) {
+      BOOST_CHECK_THROW(interpreter::runSource(source, env, engine),
+                        std::runtime_error);
+    }
+  }
+
+  // So are trees built without the parser
+  std::vector<std::unique_ptr<Expression>> val_exps;
+  val_exps.push_back(std::make_unique<StringConstant>("val"));
+  val_exps.push_back(std::make_unique<StringConstant>("x"));
+  ExpressionList val(std::move(val_exps));
+  std::vector<std::unique_ptr<Expression>> if_exps;
+  if_exps.push_back(std::make_unique<StringConstant>("if"));
+  if_exps.push_back(std::make_unique<Constant>(1));
+  if_exps.push_back(std::make_unique<Constant>(2));
+  ExpressionList if_(std::move(if_exps));
+  ExpressionList empty({});
+  for (ExpressionList *list : {&val, &if_, &empty}) {
+    BOOST_CHECK_THROW(interpreter::compile(*list), std::runtime_error);
+    BOOST_CHECK_THROW(interpreter::compileRegisters(*list),
+                      std::runtime_error);
+  }
+}
+
+BOOST_AUTO_TEST_CASE(run_source) {
+  std::string source =
+      "(val sum (lambda (self n) (if n (+ n (self self (- n 1))) 0)))\n"
+      "(val twice (lambda (f x) (f (f x))))\n"
+      "(twice (lambda (x) (* x 3)) (sum sum 100))\n";
+  for (auto engine : {interpreter::Engine::Stack,
+                      interpreter::Engine::Register}) {
+    Environment env = Environment();
+    BOOST_TEST(interpreter::runSource(source, env, engine).asInt() == 45450);
+  }
+
+  Environment env = Environment();
+  BOOST_TEST(interpreter::runSource("", env).asInt() == -1);
+
+  // Forms before a syntax error have run
+  BOOST_CHECK_THROW(interpreter::runSource("(val y 1)\n(+ y)\n", env),
+                    std::runtime_error);
+  BOOST_TEST(env.lookup("y").asInt() == 1);
+  BOOST_CHECK_THROW(interpreter::runSource("(+ 1 2))\n", env),
+                    std::runtime_error);
+  BOOST_CHECK_THROW(interpreter::runSource("(lambda (x) x x)\n", env),
+                    std::runtime_error);
+  BOOST_CHECK_THROW(interpreter::runSource("(f (g 1)\n", env),
+                    std::runtime_error);
+  BOOST_CHECK_THROW(interpreter::runSource("()\n", env), std::runtime_error);
+}
+
+BOOST_AUTO_TEST_CASE(lex_mapped_file) {
+  std::string path =
+      (std::filesystem::temp_directory_path() / "compiler-test.lisp").string();
+  {
+    std::ofstream out(path);
+    out << "(val twice (lambda (x) (* x 2)))\n(twice 21)\n";
+  }
+
+  // Tokens point into the mapping rather than owning copies
+  {
+    SourceFile file(path);
+    Lexer lexer(file);
+    std::vector<Token> tokens = lexer.lex();
+    BOOST_TEST(!lexer.lexError());
+    BOOST_TEST(tokens[2].value == "twice");
+    std::string_view text = file.text();
+    BOOST_TEST((tokens[2].value.data() >= text.data() &&
+                tokens[2].value.data() < text.data() + text.size()));
+  }
+
+  Environment env = Environment();
+  BOOST_TEST(interpreter::runFile(path, env).asInt() == 42);
+
+  std::ofstream(path).close();
+  BOOST_TEST(interpreter::runFile(path, env).asInt() == -1);
+  std::filesystem::remove(path);
+  BOOST_CHECK_THROW(interpreter::runFile(path, env), std::runtime_error);
+}
+
+BOOST_AUTO_TEST_CASE(bytecode_file) {
+  std::string path =
+      (std::filesystem::temp_directory_path() / "compiler-test.lbc").string();
+  // Nested lambdas with parameters, captured variables and calls
+  bytecode::Program program = bytecode::compile(
+      "(val sum (lambda (self n) (if n (+ n (self self (- n 1))) 0)))\n"
+      "(val adder (lambda (x) (lambda (y) (+ x y))))\n"
+      "(val add3 (adder 3))\n"
+      "(add3 (sum sum 100))\n");
+  BOOST_TEST(program.size() == 4);
+
+  // Run first, so that the saved calls have been quickened
+  Environment env = Environment();
+  BOOST_TEST(bytecode::run(program, env).asInt() == 5053);
+  bytecode::save(program, path);
+
+  bytecode::Program loaded = bytecode::load(path);
+  BOOST_TEST(loaded.size() == program.size());
+  const CodeObject &sum = *loaded[0]->functions[0];
+  BOOST_TEST(sum.params.size() == 2);
+  BOOST_TEST(sum.params[1] == SymbolTable::intern("n"));
+  BOOST_TEST(sum.stackSize == program[0]->functions[0]->stackSize);
+  BOOST_TEST(sum.size() == program[0]->functions[0]->size());
+  for (size_t i = 0; i < sum.size(); i++) {
+    OpCode op = (*program[0]->functions[0])[i].opCode();
+    if (op == OpCode::CALL_KNOWN)
+      op = OpCode::CALL_FUNCTION;
+    BOOST_TEST((sum[i].opCode() == op));
+  }
+  const CodeObject &inner = *loaded[1]->functions[0]->functions[0];
+  BOOST_TEST(inner.upvalues ==
+             program[1]->functions[0]->functions[0]->upvalues);
+  Environment loaded_env = Environment();
+  BOOST_TEST(bytecode::run(loaded, loaded_env).asInt() == 5053);
+
+  bytecode::save(bytecode::compile(""), path);
+  BOOST_TEST(bytecode::run(bytecode::load(path), loaded_env).asInt() == -1);
+
+  // Truncated files, and files that are not bytecode, are rejected
+  bytecode::save(program, path);
+  std::filesystem::resize_file(path, std::filesystem::file_size(path) - 4);
+  BOOST_CHECK_THROW(bytecode::load(path), std::runtime_error);
+  std::ofstream(path) << "(+ 1 2)\n";
+  BOOST_CHECK_THROW(bytecode::load(path), std::runtime_error);
+  std::filesystem::remove(path);
+  BOOST_CHECK_THROW(bytecode::load(path), std::runtime_error);
+
+  // Writes that only fail once the file is flushed are reported
+  if (std::filesystem::exists("/dev/full")) {
+    BOOST_CHECK_THROW(bytecode::save(program, "/dev/full"),
+                      std::runtime_error);
+  }
+}
+
+BOOST_AUTO_TEST_CASE(compile_cache) {
+  BOOST_TEST(CompileCache::hex(CompileCache::key("abc")) ==
+             "ba7816bf8f01cfea414140de5dae2223"
+             "b00361a396177a9cb410ff61f20015ad");
+  BOOST_TEST(CompileCache::hex(CompileCache::key(std::string(56, 'a'))) ==
+             "b35439a4ac6f0948b6d6f9e3c6af0f5f"
+             "590ce20f1bde7090ef7970686ec6738a");
+
+  std::string sum =
+      "(val sum (lambda (self n) (if n (+ n (self self (- n 1))) 0)))\n"
+      "(sum sum 100)\n";
+  CompileCache cache(1 << 20);
+  bytecode::Program first = cache.compile(sum);
+  bytecode::Program second = cache.compile(sum);
+  // Each lookup has code objects of its own
+  BOOST_TEST(first[0] != second[0]);
+  Environment env = Environment();
+  BOOST_TEST(bytecode::run(second, env).asInt() == 5050);
+  CompileCache::Stats stats = cache.stats();
+  BOOST_TEST(stats.misses == 1);
+  BOOST_TEST(stats.hits == 1);
+  BOOST_TEST(stats.entries == 1);
+  BOOST_TEST(stats.bytes == bytecode::serialize(first).size() * 4);
+  BOOST_CHECK_THROW(cache.compile("(+ 1)"), std::runtime_error);
+  BOOST_TEST(cache.stats().entries == 1);
+
+  // Room for two programs of this size: using the first keeps it, and the
+  // one used least recently goes
+  auto program = [](int i) { return "(* " + std::to_string(i) + " 2)\n"; };
+  CompileCache small(2 * bytecode::serialize(cache.compile(program(1))).size() *
+                     4);
+  small.compile(program(1));
+  small.compile(program(2));
+  small.compile(program(1));
+  small.compile(program(3));
+  stats = small.stats();
+  BOOST_TEST(stats.evictions == 1);
+  BOOST_TEST(stats.entries == 2);
+  small.compile(program(1));
+  BOOST_TEST(small.stats().hits == 2);
+  small.compile(program(2));
+  BOOST_TEST(small.stats().misses == 4);
+
+  // A second cache over the same directory finds what the first wrote
+  std::filesystem::path directory =
+      std::filesystem::temp_directory_path() / "compiler-test-cache";
+  std::filesystem::remove_all(directory);
+  std::filesystem::create_directory(directory);
+  {
+    CompileCache writer(1 << 20, directory.string());
+    writer.compile(sum);
+  }
+  CompileCache reader(1 << 20, directory.string());
+  Environment disk_env = Environment();
+  BOOST_TEST(bytecode::run(reader.compile(sum), disk_env).asInt() == 5050);
+  reader.compile(sum);
+  stats = reader.stats();
+  BOOST_TEST(stats.diskHits == 1);
+  BOOST_TEST(stats.hits == 1);
+  BOOST_TEST(stats.misses == 0);
+  std::filesystem::remove_all(directory);
+
+  // Many threads sharing one cache, and running what it gives them
+  CompileCache shared(1 << 20);
+  std::vector<std::thread> threads;
+  std::vector<int> results(8);
+  for (int t = 0; t < 8; t++) {
+    threads.emplace_back([&, t] {
+      for (int i = 0; i < 200; i++) {
+        Environment env = Environment();
+        results[t] += bytecode::run(shared.compile(program(i % 10)), env)
+                          .asInt();
+      }
+    });
+  }
+  for (auto &thread : threads)
+    thread.join();
+  for (int result : results)
+    BOOST_TEST(result == 20 * 90);
+  stats = shared.stats();
+  BOOST_TEST(stats.hits + stats.misses == 1600);
+  BOOST_TEST(stats.entries == 10);
+}
+
+BOOST_AUTO_TEST_CASE(compile_deep_nesting) {
+  // (if x (+ 1 (if x (+ 1 ... 0) 2)) 2), with jumps patched at every level
+  std::unique_ptr<Expression> exp = std::make_unique<Constant>(0);
+  for (int i = 0; i < 5000; i++) {
+    std::vector<std::unique_ptr<Expression>> cond;
+    cond.push_back(std::make_unique<StringConstant>("if"));
+    cond.push_back(std::make_unique<StringConstant>("x"));
+    cond.push_back(std::make_unique<BinaryOperation>(
+        '+', std::make_unique<Constant>(1), std::move(exp)));
+    cond.push_back(std::make_unique<Constant>(2));
+    exp = std::make_unique<ExpressionList>(std::move(cond));
+  }
+  for (CompileOptions options : {CompileOptions(), naive}) {
+    Code bytecode = interpreter::compile(*exp, options);
+    Environment env = Environment();
+    env.define("x", 1);
+    BOOST_TEST(interpreter::eval(bytecode, env).asInt() == 5000);
+    env.define("x", 0);
+    BOOST_TEST(interpreter::eval(bytecode, env).asInt() == 2);
+  }
+}
+
+BOOST_AUTO_TEST_CASE(collect_closure_cycles) {
+  // Every call of make leaves a closure and the cell of f, which hold each
+  // other, and the cell of n
+  std::string make =
+      "(val make (lambda (f n) (val f (lambda (i) (if i (f (- i 1)) n)))))\n";
+  std::string calls;
+  for (int i = 0; i < 100; i++)
+    calls += "(make 0 " + std::to_string(i) + ")\n";
+
+  int threshold = gc::threshold();
+  for (auto engine : {interpreter::Engine::Stack,
+                      interpreter::Engine::Register}) {
+    gc::setThreshold(0);
+    gc::collect();
+    size_t before = gc::stats().objects;
+    Environment env = Environment();
+    interpreter::runSource(make + calls, env, engine);
+    BOOST_TEST(gc::stats().objects == before + 1 + 300);
+    gc::Stats stats = gc::stats();
+    BOOST_TEST(gc::collect() == 300);
+    BOOST_TEST(gc::stats().objects == before + 1);
+    BOOST_TEST(gc::stats().freed == stats.freed + 300);
+    BOOST_TEST(gc::stats().collections[gc::GENERATIONS - 1] ==
+               stats.collections[gc::GENERATIONS - 1] + 1);
+    BOOST_TEST(gc::stats().bytes < stats.bytes);
+
+    // Collected as they are allocated, the 900 objects of the cycles never
+    // pile up. Those of a call that is running when generation 0 is collected
+    // move up, and wait for a collection of generation 1.
+    gc::setThreshold(50);
+    interpreter::runSource(calls + calls + calls, env, engine);
+    BOOST_TEST(gc::stats().objects < before + 150);
+    BOOST_TEST(gc::stats().collections[0] > stats.collections[0]);
+    BOOST_TEST(gc::stats().totalPause >= gc::stats().longestPause);
+  }
+
+  // What is still referenced survives collections of every generation
+  gc::setThreshold(0);
+  Environment env = Environment();
+  interpreter::runSource(make + "(val twice (lambda (x) (* x 2)))\n", env);
+  gc::collect();
+  for (int generation = 0; generation < gc::GENERATIONS; generation++) {
+    interpreter::runSource("(make 0 1)\n", env);
+    BOOST_TEST(gc::collect(generation) == 3);
+  }
+  BOOST_TEST(interpreter::runSource("(twice 21)\n", env).asInt() == 42);
+  gc::setThreshold(threshold);
+}
+
+BOOST_AUTO_TEST_CASE(isolates_share_code) {
+  bytecode::Program program = bytecode::compile(
+      "(val make (lambda (f n) (val f (lambda (i) (if i (f (- i 1)) n)))))\n"
+      "(val sum (lambda (self n) (if n (+ n (self self (- n 1))) 0)))\n"
+      "(make 0 1)\n"
+      "(+ base (sum sum 100))\n");
+  size_t before = gc::stats().objects;
+
+  // Run once on its own, the program quickens its calls; sharing undoes that
+  // and drops every cache
+  {
+    interpreter::Isolate isolate;
+    isolate.globals().define("base", Value(1));
+    BOOST_TEST(isolate.run(program).asInt() == 5051);
+    BOOST_TEST(isolate.heap().stats().objects == 2 + 3);
+    BOOST_TEST(isolate.heap().collect() == 3);
+  }
+  interpreter::share(program);
+  std::vector<Instruction> shared;
+  for (const auto &form : program) {
+    BOOST_TEST(form->nameCaches.empty());
+    for (const auto &function : form->functions) {
+      BOOST_TEST(function->callCaches.empty());
+      for (Instruction ins : function->instructions)
+        BOOST_TEST((ins.opCode() != OpCode::CALL_KNOWN &&
+                    ins.opCode() != OpCode::TAIL_CALL_KNOWN));
+      shared.insert(shared.end(), function->instructions.begin(),
+                    function->instructions.end());
+    }
+  }
+
+  // Many isolates on several threads at once, each with globals of its own
+  const int threads = 4;
+  const int runs = 50;
+  std::vector<int> results(threads * runs);
+  std::vector<size_t> garbage(threads * runs);
+  std::vector<std::thread> workers;
+  for (int t = 0; t < threads; t++) {
+    workers.emplace_back([&, t] {
+      for (int i = 0; i < runs; i++) {
+        interpreter::Isolate isolate;
+        isolate.globals().define("base", Value(t * runs + i));
+        results[t * runs + i] = isolate.run(program).asInt();
+        garbage[t * runs + i] = isolate.heap().collect();
+      }
+    });
+  }
+  // Sharing it again only reads it, and so does copying it
+  for (int i = 0; i < runs; i++) {
+    interpreter::share(program);
+    BOOST_TEST(interpreter::sharedCopy(program.back()) == program.back());
+  }
+  for (auto &worker : workers)
+    worker.join();
+  for (int i = 0; i < threads * runs; i++) {
+    BOOST_TEST(results[i] == i + 5050);
+    BOOST_TEST(garbage[i] == 3);
+  }
+  std::vector<Instruction> after;
+  for (const auto &form : program) {
+    for (const auto &function : form->functions)
+      after.insert(after.end(), function->instructions.begin(),
+                   function->instructions.end());
+  }
+  BOOST_TEST((after == shared));
+
+  // A value can outlive its isolate, and what an error leaves on the stack
+  // is released before the isolate is used again
+  Value kept;
+  {
+    interpreter::Isolate isolate;
+    kept = isolate.run(bytecode::compile("(lambda (x) x)"));
+    bytecode::Program failing = bytecode::compile("((lambda (x) x) (+ 1 y))");
+    BOOST_CHECK_THROW(isolate.run(failing), std::runtime_error);
+    BOOST_TEST(isolate.heap().stats().objects == 1);
+  }
+  BOOST_TEST(kept.isFunction());
+  kept = Value();
+  BOOST_TEST(gc::stats().objects == before);
+}
+
+BOOST_AUTO_TEST_CASE(pmap_and_preduce) {
+  std::string program =
+      "(val offset 10)\n"
+      "(val square (lambda (x) (* x x)))\n"
+      "(val squares (pmap (lambda (i) (+ offset (square i))) 1000))\n"
+      "(val scaled ((lambda (k) (pmap (lambda (i) (* i k)) 10)) 7))\n"
+      "(val sum (preduce (lambda (a b) (+ a b)) 5 (lambda (i) i) 1000))\n"
+      "(val mixed (preduce (lambda (a b) (- (* a 3) b)) 1 square 1000))\n";
+
+  unsigned threads = parallel::threads();
+  int mixed = 0;
+  for (unsigned size : {1u, 2u, 5u}) {
+    parallel::setThreads(size);
+    Environment env = Environment();
+    parallel::define(env);
+    interpreter::runSource(program, env);
+    BOOST_TEST(interpreter::runSource("(squares 0)", env).asInt() == 10);
+    BOOST_TEST(interpreter::runSource("(squares 999)", env).asInt() ==
+               999 * 999 + 10);
+    BOOST_TEST(interpreter::runSource("(scaled 3)", env).asInt() == 21);
+    BOOST_TEST(env.lookup("sum").asInt() == 5 + 999 * 1000 / 2);
+    // combine is not associative, yet the chunks are the same on any pool
+    if (size == 1)
+      mixed = env.lookup("mixed").asInt();
+    BOOST_TEST(env.lookup("mixed").asInt() == mixed);
+
+    BOOST_CHECK_THROW(interpreter::runSource("(squares 1000)", env),
+                      std::runtime_error);
+    BOOST_CHECK_THROW(interpreter::runSource("(pmap square (- 0 1))", env),
+                      std::runtime_error);
+    BOOST_CHECK_THROW(
+        interpreter::runSource("(pmap (lambda (i) square) 10)", env),
+        std::runtime_error);
+    BOOST_CHECK_THROW(
+        interpreter::runSource("(pmap (lambda (i) (pmap square i)) 10)", env),
+        std::runtime_error);
+    BOOST_CHECK_THROW(
+        interpreter::runSource("(pmap (lambda (i) (+ i missing)) 10)", env),
+        std::runtime_error);
+    BOOST_CHECK_THROW(interpreter::runSource("((pmap square 0) 0)", env),
+                      std::runtime_error);
+  }
+  parallel::setThreads(threads);
+
+  // The workers run a copy of the code, so the code of the caller keeps its
+  // quickened calls, even while it is in the middle of running it
+  Environment caller = Environment();
+  parallel::define(caller);
+  interpreter::runSource(
+      "(val tri (lambda (n) (if n (+ n (tri (- n 1))) 0)))\n(tri 10)\n",
+      caller);
+  const CodeObject &tri = *caller.lookup("tri").asFunction()->code;
+  std::vector<Instruction> quickened = tri.instructions;
+  BOOST_TEST((std::find_if(quickened.begin(), quickened.end(),
+                           [](Instruction ins) {
+                             return ins.opCode() == OpCode::CALL_KNOWN;
+                           }) != quickened.end()));
+  BOOST_TEST(
+      interpreter::runSource("((lambda (n) (+ (tri n) ((pmap tri 10) 9))) 4)",
+                             caller)
+          .asInt() == 10 + 45);
+  BOOST_TEST(!tri.shared.set);
+  BOOST_TEST((tri.instructions == quickened));
+  BOOST_TEST(!tri.callCaches.empty());
+
+  // No calls leave init
+  Environment env = Environment();
+  parallel::define(env);
+  BOOST_TEST(interpreter::runSource("(preduce pmap 42 pmap 0)", env).asInt() ==
+             42);
+}